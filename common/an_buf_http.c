@@ -9,6 +9,7 @@
 
 struct an_buf_http_state {
 	struct an_buffer *hbuf;
+	struct an_buffer *tail;	/* Last fragment chained after hbuf */
 };
 
 #define an_buf_http_get(buf)	\
@@ -18,9 +19,15 @@ static size_t
 an_buf_http_length(an_buf_const_ptr_t buf)
 {
 	struct an_buffer *hbuf;
+	size_t len;
 
-	hbuf = an_buf_http_get(buf.wbuf);
-	return hbuf->size;
+	len = 0;
+	for (hbuf = an_buf_http_get(buf.wbuf); hbuf != NULL;
+	    hbuf = hbuf->next) {
+		len += hbuf->size;
+	}
+
+	return len;
 }
 
 static void
@@ -68,5 +75,21 @@ an_buf_http_wrap(struct an_buffer *hbuf)
 	buf = an_wbuf_create(&an_buf_http_if, sizeof(struct an_buf_http_state));
 	s = an_buf_private(buf);
 	s->hbuf = hbuf;
+	s->tail = hbuf;
+	while (s->tail->next != NULL) {
+		s->tail = s->tail->next;
+	}
+
 	return buf;
 }
+
+void
+an_buf_http_append(struct an_wbuf *buf, struct an_buffer *frag)
+{
+	struct an_buf_http_state *s;
+
+	s = an_buf_private(buf);
+	assert(frag->next == NULL);
+	s->tail->next = frag;
+	s->tail = frag;
+}
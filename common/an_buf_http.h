@@ -7,4 +7,11 @@ struct an_buffer;
 
 struct an_wbuf *an_buf_http_wrap(struct an_buffer *);
 
+/*
+ * Chain a fragment, e.g. one from an_io_get_refbuf(), at the end of the
+ * response. Data added to the an_wbuf itself still goes to the wrapped
+ * buffer, which is always sent first.
+ */
+void an_buf_http_append(struct an_wbuf *, struct an_buffer *);
+
 #endif /* AN_BUF_HTTP_H_ */
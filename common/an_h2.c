@@ -0,0 +1,589 @@
+#include <string.h>
+#include <strings.h>
+
+#include "common/an_cc.h"
+#include "common/an_h2.h"
+#include "common/an_malloc.h"
+
+struct an_hpack_entry {
+	size_t name_len;
+	size_t value_len;
+	char data[];	/* Name, then value */
+};
+
+struct an_hpack_static_entry {
+	const char *name;
+	size_t name_len;
+	const char *value;
+	size_t value_len;
+};
+
+#define AN_HPACK_S(X) (X), sizeof(X) - 1
+
+/* RFC 7541 appendix A; index 1 is the first entry. */
+static const struct an_hpack_static_entry an_hpack_static_table[] = {
+	{ AN_HPACK_S(":authority"), AN_HPACK_S("") },
+	{ AN_HPACK_S(":method"), AN_HPACK_S("GET") },
+	{ AN_HPACK_S(":method"), AN_HPACK_S("POST") },
+	{ AN_HPACK_S(":path"), AN_HPACK_S("/") },
+	{ AN_HPACK_S(":path"), AN_HPACK_S("/index.html") },
+	{ AN_HPACK_S(":scheme"), AN_HPACK_S("http") },
+	{ AN_HPACK_S(":scheme"), AN_HPACK_S("https") },
+	{ AN_HPACK_S(":status"), AN_HPACK_S("200") },
+	{ AN_HPACK_S(":status"), AN_HPACK_S("204") },
+	{ AN_HPACK_S(":status"), AN_HPACK_S("206") },
+	{ AN_HPACK_S(":status"), AN_HPACK_S("304") },
+	{ AN_HPACK_S(":status"), AN_HPACK_S("400") },
+	{ AN_HPACK_S(":status"), AN_HPACK_S("404") },
+	{ AN_HPACK_S(":status"), AN_HPACK_S("500") },
+	{ AN_HPACK_S("accept-charset"), AN_HPACK_S("") },
+	{ AN_HPACK_S("accept-encoding"), AN_HPACK_S("gzip, deflate") },
+	{ AN_HPACK_S("accept-language"), AN_HPACK_S("") },
+	{ AN_HPACK_S("accept-ranges"), AN_HPACK_S("") },
+	{ AN_HPACK_S("accept"), AN_HPACK_S("") },
+	{ AN_HPACK_S("access-control-allow-origin"), AN_HPACK_S("") },
+	{ AN_HPACK_S("age"), AN_HPACK_S("") },
+	{ AN_HPACK_S("allow"), AN_HPACK_S("") },
+	{ AN_HPACK_S("authorization"), AN_HPACK_S("") },
+	{ AN_HPACK_S("cache-control"), AN_HPACK_S("") },
+	{ AN_HPACK_S("content-disposition"), AN_HPACK_S("") },
+	{ AN_HPACK_S("content-encoding"), AN_HPACK_S("") },
+	{ AN_HPACK_S("content-language"), AN_HPACK_S("") },
+	{ AN_HPACK_S("content-length"), AN_HPACK_S("") },
+	{ AN_HPACK_S("content-location"), AN_HPACK_S("") },
+	{ AN_HPACK_S("content-range"), AN_HPACK_S("") },
+	{ AN_HPACK_S("content-type"), AN_HPACK_S("") },
+	{ AN_HPACK_S("cookie"), AN_HPACK_S("") },
+	{ AN_HPACK_S("date"), AN_HPACK_S("") },
+	{ AN_HPACK_S("etag"), AN_HPACK_S("") },
+	{ AN_HPACK_S("expect"), AN_HPACK_S("") },
+	{ AN_HPACK_S("expires"), AN_HPACK_S("") },
+	{ AN_HPACK_S("from"), AN_HPACK_S("") },
+	{ AN_HPACK_S("host"), AN_HPACK_S("") },
+	{ AN_HPACK_S("if-match"), AN_HPACK_S("") },
+	{ AN_HPACK_S("if-modified-since"), AN_HPACK_S("") },
+	{ AN_HPACK_S("if-none-match"), AN_HPACK_S("") },
+	{ AN_HPACK_S("if-range"), AN_HPACK_S("") },
+	{ AN_HPACK_S("if-unmodified-since"), AN_HPACK_S("") },
+	{ AN_HPACK_S("last-modified"), AN_HPACK_S("") },
+	{ AN_HPACK_S("link"), AN_HPACK_S("") },
+	{ AN_HPACK_S("location"), AN_HPACK_S("") },
+	{ AN_HPACK_S("max-forwards"), AN_HPACK_S("") },
+	{ AN_HPACK_S("proxy-authenticate"), AN_HPACK_S("") },
+	{ AN_HPACK_S("proxy-authorization"), AN_HPACK_S("") },
+	{ AN_HPACK_S("range"), AN_HPACK_S("") },
+	{ AN_HPACK_S("referer"), AN_HPACK_S("") },
+	{ AN_HPACK_S("refresh"), AN_HPACK_S("") },
+	{ AN_HPACK_S("retry-after"), AN_HPACK_S("") },
+	{ AN_HPACK_S("server"), AN_HPACK_S("") },
+	{ AN_HPACK_S("set-cookie"), AN_HPACK_S("") },
+	{ AN_HPACK_S("strict-transport-security"), AN_HPACK_S("") },
+	{ AN_HPACK_S("transfer-encoding"), AN_HPACK_S("") },
+	{ AN_HPACK_S("user-agent"), AN_HPACK_S("") },
+	{ AN_HPACK_S("vary"), AN_HPACK_S("") },
+	{ AN_HPACK_S("via"), AN_HPACK_S("") },
+	{ AN_HPACK_S("www-authenticate"), AN_HPACK_S("") },
+};
+
+#define AN_HPACK_STATIC_COUNT \
+	(sizeof(an_hpack_static_table) / sizeof(an_hpack_static_table[0]))
+
+/* Every entry counts for its name and value, plus 32 bytes. */
+#define AN_HPACK_ENTRY_OVERHEAD	32
+
+/* A Huffman code is at least 5 bits long. */
+#define AN_HPACK_HUFFMAN_BOUND(LEN) (((LEN) * 8) / 5 + 1)
+
+/*
+ * RFC 7541 appendix B is a canonical Huffman code, so all we need to
+ * decode it is the first code and the number of symbols of each length.
+ */
+/* Code of the first symbol of each length, in canonical order. */
+static const uint32_t an_hpack_huffman_first[31] = {
+	0, 0, 0, 0, 0, 0, 0x14, 0x5c,
+	0xf8, 0, 0x3f8, 0x7fa, 0xffa, 0x1ff8, 0x3ffc, 0x7ffc,
+	0, 0, 0, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8,
+	0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0, 0x3ffffffc
+};
+
+static const uint16_t an_hpack_huffman_count[31] = {
+	0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+	0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const uint16_t an_hpack_huffman_offset[31] = {
+	0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92,
+	0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253
+};
+
+/* Symbols sorted by code length, then code. */
+static const uint16_t an_hpack_huffman_symbols[257] = {
+	48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+	45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+	95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+	58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+	77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+	106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+	88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+	0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+	195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+	167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+	132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+	173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+	233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+	151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+	183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+	171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+	200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+	255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+	246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+	6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+	21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+	249, 10, 13, 22, 256
+};
+
+#define AN_HPACK_HUFFMAN_EOS	256
+
+static AN_MALLOC_DEFINE(an_hpack_entry_token,
+    .string = "an_hpack_entry",
+    .mode   = AN_MEMORY_MODE_VARIABLE);
+
+static AN_MALLOC_DEFINE(an_hpack_table_token,
+    .string = "an_hpack_table",
+    .mode   = AN_MEMORY_MODE_VARIABLE);
+
+static AN_MALLOC_DEFINE(an_hpack_scratch_token,
+    .string = "an_hpack_scratch",
+    .mode   = AN_MEMORY_MODE_VARIABLE);
+
+void
+an_hpack_decoder_init(struct an_hpack_decoder *dec, size_t limit)
+{
+
+	memset(dec, 0, sizeof(*dec));
+	dec->capacity = limit / AN_HPACK_ENTRY_OVERHEAD + 1;
+	dec->entries = an_calloc_region(an_hpack_table_token, dec->capacity,
+	    sizeof(dec->entries[0]));
+	dec->max_size = limit;
+	dec->limit = limit;
+	return;
+}
+
+static void
+an_hpack_evict(struct an_hpack_decoder *dec)
+{
+	struct an_hpack_entry *entry;
+
+	entry = dec->entries[dec->first];
+	dec->entries[dec->first] = NULL;
+	dec->first = (dec->first + 1) % dec->capacity;
+	dec->count--;
+	dec->size -= entry->name_len + entry->value_len + AN_HPACK_ENTRY_OVERHEAD;
+	an_free(an_hpack_entry_token, entry);
+	return;
+}
+
+void
+an_hpack_decoder_deinit(struct an_hpack_decoder *dec)
+{
+
+	while (dec->count > 0) {
+		an_hpack_evict(dec);
+	}
+
+	an_free(an_hpack_table_token, dec->entries);
+	an_free(an_hpack_scratch_token, dec->scratch);
+	memset(dec, 0, sizeof(*dec));
+	return;
+}
+
+static void
+an_hpack_resize(struct an_hpack_decoder *dec, size_t max_size)
+{
+
+	dec->max_size = max_size;
+	while (dec->size > dec->max_size) {
+		an_hpack_evict(dec);
+	}
+
+	return;
+}
+
+static void
+an_hpack_insert(struct an_hpack_decoder *dec, const char *name,
+    size_t name_len, const char *value, size_t value_len)
+{
+	struct an_hpack_entry *entry;
+	size_t size = name_len + value_len + AN_HPACK_ENTRY_OVERHEAD;
+
+	if (size > dec->max_size) {
+		/* Not an error: the table simply ends up empty. */
+		while (dec->count > 0) {
+			an_hpack_evict(dec);
+		}
+
+		return;
+	}
+
+	/* The name may come from an entry we are about to evict. */
+	entry = an_malloc_region(an_hpack_entry_token,
+	    sizeof(*entry) + name_len + value_len);
+	entry->name_len = name_len;
+	entry->value_len = value_len;
+	memcpy(entry->data, name, name_len);
+	memcpy(entry->data + name_len, value, value_len);
+
+	while (dec->size + size > dec->max_size) {
+		an_hpack_evict(dec);
+	}
+
+	dec->entries[(dec->first + dec->count) % dec->capacity] = entry;
+	dec->count++;
+	dec->size += size;
+	return;
+}
+
+static bool
+an_hpack_lookup(const struct an_hpack_decoder *dec, uint64_t index,
+    const char **name, size_t *name_len, const char **value, size_t *value_len)
+{
+	const struct an_hpack_entry *entry;
+
+	if (index == 0) {
+		return false;
+	}
+
+	if (index <= AN_HPACK_STATIC_COUNT) {
+		const struct an_hpack_static_entry *s;
+
+		s = &an_hpack_static_table[index - 1];
+		*name = s->name;
+		*name_len = s->name_len;
+		*value = s->value;
+		*value_len = s->value_len;
+		return true;
+	}
+
+	/* The dynamic table is indexed from the newest entry. */
+	index -= AN_HPACK_STATIC_COUNT + 1;
+	if (index >= dec->count) {
+		return false;
+	}
+
+	entry = dec->entries[(dec->first + dec->count - 1 - index) % dec->capacity];
+	*name = entry->data;
+	*name_len = entry->name_len;
+	*value = entry->data + entry->name_len;
+	*value_len = entry->value_len;
+	return true;
+}
+
+/* RFC 7541 section 5.1, with an N-bit prefix. */
+static bool
+an_hpack_decode_int(const uint8_t **p, const uint8_t *end, unsigned int n,
+    uint64_t *ret)
+{
+	const uint8_t *q = *p;
+	uint64_t max = (1U << n) - 1;
+	uint64_t value;
+	unsigned int shift;
+
+	value = *q++ & max;
+	if (value < max) {
+		*p = q;
+		*ret = value;
+		return true;
+	}
+
+	for (shift = 0; q < end; shift += 7) {
+		uint8_t byte = *q++;
+
+		/* Nothing we deal with comes close to 2^32. */
+		if (shift > 28) {
+			return false;
+		}
+
+		value += (uint64_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) {
+			*p = q;
+			*ret = value;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+an_hpack_huffman_decode(const uint8_t *src, size_t len, char *dst,
+    size_t *dst_len)
+{
+	size_t i, out = 0;
+	uint32_t code = 0;
+	unsigned int bits = 0;
+
+	for (i = 0; i < len; i++) {
+		unsigned int j;
+
+		for (j = 8; j-- > 0; ) {
+			uint32_t delta;
+			uint16_t symbol;
+
+			code = (code << 1) | ((src[i] >> j) & 1);
+			bits++;
+
+			delta = code - an_hpack_huffman_first[bits];
+			if (delta >= an_hpack_huffman_count[bits]) {
+				continue;
+			}
+
+			/* EOS only ever appears as padding. */
+			symbol = an_hpack_huffman_symbols[
+			    an_hpack_huffman_offset[bits] + delta];
+			if (symbol == AN_HPACK_HUFFMAN_EOS) {
+				return false;
+			}
+
+			dst[out++] = symbol;
+			code = 0;
+			bits = 0;
+		}
+	}
+
+	/* Padding is strictly shorter than a byte, and a prefix of EOS. */
+	if (bits > 7 || code != (1U << bits) - 1) {
+		return false;
+	}
+
+	*dst_len = out;
+	return true;
+}
+
+/*
+ * Decodes a string literal, either pointing into the block or into the
+ * scratch buffer at *scratch_used.
+ */
+static bool
+an_hpack_decode_string(struct an_hpack_decoder *dec, const uint8_t **p,
+    const uint8_t *end, size_t *scratch_used, const char **ret, size_t *ret_len)
+{
+	uint64_t len;
+	bool huffman;
+
+	if (*p >= end) {
+		return false;
+	}
+
+	huffman = (**p & 0x80) != 0;
+	if (an_hpack_decode_int(p, end, 7, &len) == false ||
+	    len > (uint64_t)(end - *p)) {
+		return false;
+	}
+
+	if (huffman == false) {
+		*ret = (const char *)*p;
+		*ret_len = len;
+		*p += len;
+		return true;
+	}
+
+	/* an_hpack_decode sized the scratch buffer for the whole block. */
+	if (an_hpack_huffman_decode(*p, len, dec->scratch + *scratch_used,
+	    ret_len) == false) {
+		return false;
+	}
+
+	*ret = dec->scratch + *scratch_used;
+	*scratch_used += *ret_len;
+	*p += len;
+	return true;
+}
+
+bool
+an_hpack_decode(struct an_hpack_decoder *dec, const uint8_t *block, size_t len,
+    an_hpack_header_cb_t *cb, void *arg)
+{
+	const uint8_t *p = block;
+	const uint8_t *end = block + len;
+	bool headers = false;
+
+	if (AN_HPACK_HUFFMAN_BOUND(len) > dec->scratch_size) {
+		size_t size = AN_HPACK_HUFFMAN_BOUND(len);
+
+		dec->scratch = an_realloc_region(an_hpack_scratch_token,
+		    dec->scratch, dec->scratch_size, size);
+		dec->scratch_size = size;
+	}
+
+	while (p < end) {
+		const char *name, *value;
+		size_t name_len, value_len;
+		size_t scratch_used = 0;
+		uint64_t index;
+		uint8_t byte = *p;
+
+		if ((byte & 0x80) != 0) {
+			/* Indexed header field */
+			if (an_hpack_decode_int(&p, end, 7, &index) == false ||
+			    an_hpack_lookup(dec, index, &name, &name_len,
+			    &value, &value_len) == false) {
+				return false;
+			}
+
+			cb(arg, name, name_len, value, value_len);
+			headers = true;
+			continue;
+		}
+
+		if ((byte & 0xe0) == 0x20) {
+			/* Dynamic table size update, only ahead of headers. */
+			if (headers == true ||
+			    an_hpack_decode_int(&p, end, 5, &index) == false ||
+			    index > dec->limit) {
+				return false;
+			}
+
+			an_hpack_resize(dec, index);
+			continue;
+		}
+
+		/*
+		 * Literal with incremental indexing (6-bit prefix), or
+		 * without indexing and never indexed (4-bit prefix).
+		 */
+		if (an_hpack_decode_int(&p, end, (byte & 0xc0) == 0x40 ? 6 : 4,
+		    &index) == false) {
+			return false;
+		}
+
+		if (index == 0) {
+			if (an_hpack_decode_string(dec, &p, end, &scratch_used,
+			    &name, &name_len) == false) {
+				return false;
+			}
+		} else if (an_hpack_lookup(dec, index, &name, &name_len,
+		    &value, &value_len) == false) {
+			return false;
+		}
+
+		if (an_hpack_decode_string(dec, &p, end, &scratch_used,
+		    &value, &value_len) == false) {
+			return false;
+		}
+
+		cb(arg, name, name_len, value, value_len);
+		headers = true;
+		if ((byte & 0xc0) == 0x40) {
+			an_hpack_insert(dec, name, name_len, value, value_len);
+		}
+	}
+
+	return true;
+}
+
+static size_t
+an_hpack_encode_int(uint8_t *dst, uint8_t flags, unsigned int n, uint64_t value)
+{
+	uint64_t max = (1U << n) - 1;
+	size_t i = 0;
+
+	if (value < max) {
+		dst[i++] = flags | value;
+		return i;
+	}
+
+	dst[i++] = flags | max;
+	for (value -= max; value >= 0x80; value >>= 7) {
+		dst[i++] = 0x80 | (value & 0x7f);
+	}
+
+	dst[i++] = value;
+	return i;
+}
+
+static size_t
+an_hpack_encode_string(uint8_t *dst, const char *str, size_t len, bool lower)
+{
+	size_t i, n;
+
+	n = an_hpack_encode_int(dst, 0, 7, len);
+	for (i = 0; i < len; i++) {
+		char c = str[i];
+
+		if (lower == true && c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		}
+
+		dst[n + i] = c;
+	}
+
+	return n + len;
+}
+
+size_t
+an_hpack_encode_status(uint8_t *dst, unsigned int status)
+{
+	char digits[3];
+	size_t n;
+
+	/* Static table entries 8 to 14 */
+	switch (status) {
+	case 200:
+		dst[0] = 0x80 | 8;
+		return 1;
+	case 204:
+		dst[0] = 0x80 | 9;
+		return 1;
+	case 206:
+		dst[0] = 0x80 | 10;
+		return 1;
+	case 304:
+		dst[0] = 0x80 | 11;
+		return 1;
+	case 400:
+		dst[0] = 0x80 | 12;
+		return 1;
+	case 404:
+		dst[0] = 0x80 | 13;
+		return 1;
+	case 500:
+		dst[0] = 0x80 | 14;
+		return 1;
+	}
+
+	digits[0] = '0' + (status / 100) % 10;
+	digits[1] = '0' + (status / 10) % 10;
+	digits[2] = '0' + status % 10;
+
+	/* Literal without indexing, with the name of entry 8 */
+	n = an_hpack_encode_int(dst, 0, 4, 8);
+	n += an_hpack_encode_string(dst + n, digits, sizeof(digits), false);
+	return n;
+}
+
+size_t
+an_hpack_encode_header(uint8_t *dst, const char *name, size_t name_len,
+    const char *value, size_t value_len)
+{
+	size_t i, n;
+
+	/* Skip the pseudo-headers, entries 1 to 14. */
+	for (i = 14; i < AN_HPACK_STATIC_COUNT; i++) {
+		const struct an_hpack_static_entry *s = &an_hpack_static_table[i];
+
+		if (s->name_len == name_len &&
+		    strncasecmp(s->name, name, name_len) == 0) {
+			break;
+		}
+	}
+
+	if (i < AN_HPACK_STATIC_COUNT) {
+		n = an_hpack_encode_int(dst, 0, 4, i + 1);
+	} else {
+		n = an_hpack_encode_int(dst, 0, 4, 0);
+		n += an_hpack_encode_string(dst + n, name, name_len, true);
+	}
+
+	n += an_hpack_encode_string(dst + n, value, value_len, false);
+	return n;
+}
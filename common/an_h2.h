@@ -0,0 +1,178 @@
+/* HTTP/2 framing (RFC 7540) and header compression (RFC 7541) */
+
+#ifndef AN_H2_H
+#define AN_H2_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Only the protocol bits live here; an_server drives connections and
+ * maps streams onto its requests. The HPACK decoder is complete, while
+ * the encoder never indexes anything nor uses Huffman coding: that is
+ * always valid, and keeps the response path free of per-connection
+ * compression state.
+ */
+
+#define AN_H2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define AN_H2_PREFACE_LEN	(sizeof(AN_H2_PREFACE) - 1)
+
+#define AN_H2_FRAME_HEADER_LEN	9
+/* The default, and smallest allowed, SETTINGS_MAX_FRAME_SIZE */
+#define AN_H2_FRAME_SIZE	16384
+#define AN_H2_FRAME_SIZE_MAX	((1U << 24) - 1)
+#define AN_H2_WINDOW		65535
+#define AN_H2_WINDOW_MAX	0x7fffffff
+#define AN_H2_STREAM_MAX	0x7fffffff
+
+enum an_h2_frame_type {
+	AN_H2_DATA = 0x0,
+	AN_H2_HEADERS = 0x1,
+	AN_H2_PRIORITY = 0x2,
+	AN_H2_RST_STREAM = 0x3,
+	AN_H2_SETTINGS = 0x4,
+	AN_H2_PUSH_PROMISE = 0x5,
+	AN_H2_PING = 0x6,
+	AN_H2_GOAWAY = 0x7,
+	AN_H2_WINDOW_UPDATE = 0x8,
+	AN_H2_CONTINUATION = 0x9
+};
+
+#define AN_H2_FLAG_END_STREAM	0x01
+#define AN_H2_FLAG_ACK		0x01
+#define AN_H2_FLAG_END_HEADERS	0x04
+#define AN_H2_FLAG_PADDED	0x08
+#define AN_H2_FLAG_PRIORITY	0x20
+
+enum an_h2_error {
+	AN_H2_NO_ERROR = 0x0,
+	AN_H2_PROTOCOL_ERROR = 0x1,
+	AN_H2_INTERNAL_ERROR = 0x2,
+	AN_H2_FLOW_CONTROL_ERROR = 0x3,
+	AN_H2_SETTINGS_TIMEOUT = 0x4,
+	AN_H2_STREAM_CLOSED = 0x5,
+	AN_H2_FRAME_SIZE_ERROR = 0x6,
+	AN_H2_REFUSED_STREAM = 0x7,
+	AN_H2_CANCEL = 0x8,
+	AN_H2_COMPRESSION_ERROR = 0x9,
+	AN_H2_CONNECT_ERROR = 0xa,
+	AN_H2_ENHANCE_YOUR_CALM = 0xb,
+	AN_H2_INADEQUATE_SECURITY = 0xc,
+	AN_H2_HTTP_1_1_REQUIRED = 0xd
+};
+
+enum an_h2_setting {
+	AN_H2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+	AN_H2_SETTINGS_ENABLE_PUSH = 0x2,
+	AN_H2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	AN_H2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+	AN_H2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+	AN_H2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+#define AN_H2_SETTING_LEN	6
+
+struct an_h2_frame {
+	uint32_t length;
+	uint8_t type;
+	uint8_t flags;
+	uint32_t stream;
+};
+
+static inline uint32_t
+an_h2_read32(const uint8_t *p)
+{
+
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	    ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void
+an_h2_write32(uint8_t *p, uint32_t x)
+{
+
+	p[0] = x >> 24;
+	p[1] = x >> 16;
+	p[2] = x >> 8;
+	p[3] = x;
+}
+
+static inline void
+an_h2_frame_read(struct an_h2_frame *frame, const uint8_t *p)
+{
+
+	frame->length = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+	frame->type = p[3];
+	frame->flags = p[4];
+	/* Ignore the reserved bit. */
+	frame->stream = an_h2_read32(p + 5) & AN_H2_STREAM_MAX;
+}
+
+static inline void
+an_h2_frame_write(uint8_t *p, uint32_t length, uint8_t type, uint8_t flags,
+    uint32_t stream)
+{
+
+	p[0] = length >> 16;
+	p[1] = length >> 8;
+	p[2] = length;
+	p[3] = type;
+	p[4] = flags;
+	an_h2_write32(p + 5, stream);
+}
+
+/*
+ * HPACK decoder, one per connection. The dynamic table never grows
+ * beyond the SETTINGS_HEADER_TABLE_SIZE we advertised.
+ */
+struct an_hpack_entry;
+
+struct an_hpack_decoder {
+	struct an_hpack_entry **entries;	/* Ring, newest last */
+	unsigned int capacity;
+	unsigned int first;
+	unsigned int count;
+	size_t size;		/* As defined in RFC 7541 section 4.1 */
+	size_t max_size;	/* As set by the peer's encoder */
+	size_t limit;		/* Our SETTINGS_HEADER_TABLE_SIZE */
+	/* Huffman decoded strings of the current header. */
+	char *scratch;
+	size_t scratch_size;
+};
+
+/**
+ * @brief Called for every decoded header; strings are not NUL terminated
+ * and only valid during the call.
+ */
+typedef void an_hpack_header_cb_t(void *, const char *name, size_t name_len,
+    const char *value, size_t value_len);
+
+void an_hpack_decoder_init(struct an_hpack_decoder *, size_t limit);
+void an_hpack_decoder_deinit(struct an_hpack_decoder *);
+
+/**
+ * @brief Decode a complete header block, calling @a cb for each header.
+ * @return false on decoding errors, which are connection errors
+ * (COMPRESSION_ERROR) as the dynamic table can't be trusted anymore.
+ */
+bool an_hpack_decode(struct an_hpack_decoder *, const uint8_t *, size_t,
+    an_hpack_header_cb_t *cb, void *arg);
+
+/* Upper bound on the size of an encoded header. */
+#define AN_HPACK_HEADER_BOUND(NAME_LEN, VALUE_LEN) ((NAME_LEN) + (VALUE_LEN) + 16)
+
+/**
+ * @brief Encode a :status pseudo-header, in at most AN_HPACK_HEADER_BOUND(0, 3) bytes.
+ * @return the number of bytes written.
+ */
+size_t an_hpack_encode_status(uint8_t *, unsigned int status);
+
+/**
+ * @brief Encode a header as a literal without indexing, lowercasing its
+ * name. Writes at most AN_HPACK_HEADER_BOUND(name_len, value_len) bytes.
+ * @return the number of bytes written.
+ */
+size_t an_hpack_encode_header(uint8_t *, const char *name, size_t name_len,
+    const char *value, size_t value_len);
+
+#endif /* AN_H2_H */
@@ -0,0 +1,150 @@
+#include <string.h>
+#include <strings.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "common/an_cc.h"
+#include "common/an_http_scan.h"
+#include "third_party/http-parser/http_parser.h"
+
+#define AN_HTTP_SCAN_VERSION_LEN	(sizeof("HTTP/1.1\r\n") - 1)
+
+/* RFC 7230 tchar, which is also what http_parser accepts in header names. */
+static const bool an_http_token[256] = {
+	['0' ... '9'] = true,
+	['A' ... 'Z'] = true,
+	['a' ... 'z'] = true,
+	['!'] = true, ['#'] = true, ['$'] = true, ['%'] = true, ['&'] = true,
+	['\''] = true, ['*'] = true, ['+'] = true, ['-'] = true, ['.'] = true,
+	['^'] = true, ['_'] = true, ['`'] = true, ['|'] = true, ['~'] = true
+};
+
+static inline bool
+an_http_scan_crlfcrlf(const char *data, size_t i)
+{
+
+	return i >= 3 && memcmp(data + i - 3, "\r\n\r\n", 4) == 0;
+}
+
+const char *
+an_http_scan_headers_end(const char *data, size_t len)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i lf = _mm_set1_epi8('\n');
+
+	/* Only look closer at line feeds, 16 bytes at a time. */
+	for (; i + 16 <= len; i += 16) {
+		__m128i chunk;
+		unsigned int mask;
+
+		chunk = _mm_loadu_si128((const __m128i *)(data + i));
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, lf));
+		while (mask != 0) {
+			size_t j = i + __builtin_ctz(mask);
+
+			if (an_http_scan_crlfcrlf(data, j)) {
+				return data + j + 1;
+			}
+
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	for (; i < len; i++) {
+		if (data[i] == '\n' && an_http_scan_crlfcrlf(data, i)) {
+			return data + i + 1;
+		}
+	}
+
+	return NULL;
+}
+
+/* Headers that change how http_parser frames the message or the connection. */
+static bool
+an_http_scan_special_header(const char *name, size_t len)
+{
+
+	switch (len) {
+	case sizeof("upgrade") - 1:
+		return strncasecmp(name, "upgrade", len) == 0;
+	case sizeof("connection") - 1:
+		return strncasecmp(name, "connection", len) == 0;
+	case sizeof("content-length") - 1:
+		return strncasecmp(name, "content-length", len) == 0;
+	case sizeof("proxy-connection") - 1:
+		return strncasecmp(name, "proxy-connection", len) == 0;
+	case sizeof("transfer-encoding") - 1:
+		return strncasecmp(name, "transfer-encoding", len) == 0;
+	}
+
+	return false;
+}
+
+bool
+an_http_scan_request(const char *data, size_t len, struct an_http_scan *scan)
+{
+	const char *end, *line, *uri, *uri_end, *cr, *p;
+
+	if (len < sizeof("GET / HTTP/1.1\r\n\r\n") - 1 ||
+	    memcmp(data, "GET /", 5) != 0) {
+		return false;
+	}
+
+	end = an_http_scan_headers_end(data, len);
+	if (end == NULL || (size_t)(end - data) > HTTP_MAX_HEADER_SIZE) {
+		return false;
+	}
+
+	/* Request line: "GET <uri> HTTP/1.x\r\n", with a single space each. */
+	uri = data + 4;
+	uri_end = memchr(uri, ' ', end - uri);
+	if (uri_end == NULL ||
+	    (size_t)(end - uri_end) < 1 + AN_HTTP_SCAN_VERSION_LEN + 2) {
+		return false;
+	}
+
+	for (p = uri; p < uri_end; p++) {
+		if (AN_CC_UNLIKELY((unsigned char)*p <= ' ' ||
+		    (unsigned char)*p >= 0x7f)) {
+			return false;
+		}
+	}
+
+	p = uri_end + 1;
+	if (memcmp(p, "HTTP/1.", 7) != 0 || (p[7] != '0' && p[7] != '1') ||
+	    p[8] != '\r' || p[9] != '\n') {
+		return false;
+	}
+
+	scan->keepalive = p[7] == '1';
+
+	/*
+	 * Header lines, up to the empty line. We know there is no
+	 * "\r\n\r\n" before end, so every line is non-empty.
+	 */
+	for (line = p + AN_HTTP_SCAN_VERSION_LEN; line < end - 2; line = cr + 2) {
+		cr = memchr(line, '\r', end - line);
+		if (cr[1] != '\n' || memchr(line, '\n', cr - line) != NULL) {
+			return false;
+		}
+
+		p = line;
+		while (p < cr && an_http_token[(unsigned char)*p]) {
+			p++;
+		}
+
+		if (p == line || p == cr || *p != ':' ||
+		    an_http_scan_special_header(line, p - line)) {
+			return false;
+		}
+	}
+
+	scan->total_len = end - data;
+	scan->uri_offset = uri - data;
+	scan->uri_len = uri_end - uri;
+	return true;
+}
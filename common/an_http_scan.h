@@ -0,0 +1,44 @@
+/* Fast path for simple HTTP requests, ahead of http_parser */
+
+#ifndef AN_HTTP_SCAN_H
+#define AN_HTTP_SCAN_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Most of our traffic is made of small GET requests that arrive in a
+ * single read: a request line, a handful of headers we don't look at,
+ * and no body. For those, we only need to know where the URI is and
+ * where the request ends, which we can find by looking for line breaks
+ * in bulk rather than running every byte through http_parser's state
+ * machine.
+ *
+ * The scanner is deliberately conservative: it only accepts requests
+ * that http_parser would parse the same way, and leaves anything else
+ * (other methods, bodies, Connection or Upgrade headers, incomplete
+ * headers, odd whitespace...) to http_parser, which remains the
+ * reference for what is valid.
+ */
+
+struct an_http_scan {
+	uint32_t total_len;	/* Up to and including the final "\r\n\r\n" */
+	uint32_t uri_offset;
+	uint32_t uri_len;
+	bool keepalive;
+};
+
+/**
+ * @brief Scan the request at the start of @a data.
+ * @return true and fill @a scan if it is a complete, simple request;
+ * false if it must go through http_parser instead.
+ */
+bool an_http_scan_request(const char *data, size_t len, struct an_http_scan *scan);
+
+/**
+ * @brief Returns a pointer just past the first "\r\n\r\n" in @a data,
+ * or NULL if there is none.
+ */
+const char *an_http_scan_headers_end(const char *data, size_t len);
+
+#endif /* AN_HTTP_SCAN_H */
@@ -4,13 +4,18 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
+#include <linux/filter.h>
 #include <netinet/tcp.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <malloc.h>
+#include <math.h>
 #include <netdb.h>
 #include <numa.h>
+#include <poll.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdint.h>
@@ -20,15 +25,31 @@
 
 #include <ck_pr.h>
 #include <ck_ring.h>
+#include <ck_spinlock.h>
+#ifdef AN_IO_URING
+#include <liburing.h>
+#endif
+#ifdef AN_IO_KTLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#if !defined(SSL_OP_ENABLE_KTLS)
+#error "AN_IO_KTLS requires OpenSSL 3.0 or later, built with kTLS support"
+#endif
+#endif
 
 #include "common/memory/pool.h"
+#include "common/memory/slab.h"
 #include "common/rtbr/rtbr.h"
 #include "common/an_array.h"
 #include "common/an_buf_http.h"
 #include "common/an_cc.h"
+#include "common/an_h2.h"
+#include "common/an_http_scan.h"
 #include "common/an_malloc.h"
 #include "common/an_string.h"
 #include "common/an_md.h"
+#include "common/an_wheel.h"
+#include "common/log_linear_bin.h"
 #include "common/an_rand.h"
 #include "common/an_server.h"
 #include "common/an_syslog.h"
@@ -38,9 +59,39 @@
 
 #define INITIAL_BUFFER_SIZE	4096ULL
 #define INITIAL_NUM_EVENTS	64ULL
+#define MAX_WRITE_IOVECS	64	/* Fragments per writev() call */
+#define RESPONSE_BATCH		64U	/* Minimum responses per loop */
+#define URING_ENTRIES		4096U
+#define URING_GEN_SHIFT		48	/* Above any user space pointer */
+/* What a completion is for, in the low bits of its (aligned) an_io */
+#define URING_TAG_POLL		0U
+#define URING_TAG_ACCEPT	1U	/* Multishot accept of a listener */
+#define URING_TAG_SEND		2U	/* Send in the middle of a chain */
+#define URING_TAG_SENT		3U	/* Last send of a chain */
+#define URING_TAG_MASK		3U
+/* Event we report for completed send chains; epoll never does. */
+#define URING_EVENT_SENT	EPOLLMSG
 #define MAX_REQUEST_TIME	1000000ULL /* Maximum request time, in us. */
 #define POOL_SIZE		(4 * 1024 * 1024 * 1024ULL)	/* 4GB */
 #define BUMP_SIZE		(16 * 1024 * 1024ULL)		/* 16MB */
+#define RESPONSE_SLAB_SIZE	(1024 * 1024 * 1024ULL)		/* 1GB */
+#define OUTPUT_POOLS		8U	/* Output pools, one per NUMA node */
+#define MAX_BODY_PRESIZE	(1024 * 1024ULL)	/* Trust Content-Length up to 1MB */
+#define TLS_MIN_READ		4096ULL	/* See an_io_connection_preread() */
+#define H2_READ_SIZE		(64 * 1024ULL)	/* h2c frame buffer */
+#define H2_OUTPUT_LOW		(64 * 1024ULL)	/* Stop queueing DATA frames */
+#define H2_OUTPUT_MAX		(1024 * 1024ULL)	/* Stop reading frames */
+#define H2_MAX_STREAMS		100U	/* Default h2_max_streams */
+/* Room we leave for the Content-Length of a rewritten request */
+#define H2_HEAD_RESERVE		(sizeof("content-length: 4294967295\r\n\r\n") - 1)
+
+/*
+ * Released input buffers are cached by size class, from 512 bytes to
+ * 64KB and above, for reuse by the next request on the same I/O thread.
+ */
+#define INBUF_CACHE_MIN_LB	9U
+#define INBUF_CACHE_CLASSES	8U
+#define INBUF_CACHE_DEPTH	16
 #define TOTAL_LARGE_ALLOCATION_LIMIT POOL_SIZE
 
 /*
@@ -57,15 +108,25 @@
 #define RID_CONNIDX_SHIFT	28
 #define RID_IOTDIDX_SHIFT	56
 
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
 _Static_assert((uint64_t)(RID_FACTOR * RID_FACTOR_INV) == 1,
     "RID_FACTOR_INV * RID_FACTOR modulo 2^64 must be 1");
 
 #define AN_IO_PARENT(PTR, TYPE)		container_of(PTR, TYPE, io)
 
+/*
+ * Timer wheel ticks are rdtsc cycles shifted down by that much, which
+ * is about 100us at common clock rates.
+ */
+#define AN_IO_TICK_SHIFT	18
+
 #define an_pool_get(POOL, SIZE)						\
 	(__builtin_choose_expr(						\
 	    __builtin_types_compatible_p(__typeof__(POOL), struct an_pool_private *), \
-		an_pool_input_get, an_pool_output_get)(SIZE))
+		an_pool_input_get, an_pool_output_get)(POOL, SIZE))
 
 /* Uncomment this to trace connection state changes. */
 //#define AN_IO_DEBUG	1
@@ -88,9 +149,28 @@ _Static_assert((uint64_t)(RID_FACTOR * RID_FACTOR_INV) == 1,
 	} while (0);
 
 /*
- * TODO:
- *
- * - Support for SSL/TLS.
+ * TLS is terminated in the kernel (kTLS), when built with AN_IO_KTLS.
+ * We only run the handshake through OpenSSL; once it completes, the
+ * session keys are installed on the socket for both directions and the
+ * OpenSSL state is dropped, so the rest of the server only ever sees
+ * plaintext through read() and writev(). Connections that cannot be
+ * offloaded (unsupported cipher, no tls module in the kernel...) are
+ * closed rather than served in user space.
+ */
+
+/*
+ * HTTP/2 over cleartext TCP (h2c), for clients that start right away
+ * with the connection preface ("prior knowledge"); there is no support
+ * for the HTTP/1.1 Upgrade dance. An h2 connection stays READING for its
+ * whole life, and each stream maps to a slot of its pseudo-pipeline:
+ * request IDs carry the slot as they do for pipelined requests, and
+ * pipeline_len is pinned to the maximum number of concurrent streams.
+ * Requests are rewritten as HTTP/1.1, each in its own input buffer and
+ * RTBR section as streams complete in any order, so handlers cannot
+ * tell the difference. Responses are parsed back into HEADERS frames,
+ * and their body sent as DATA frames within the flow control windows.
+ * Frames are serialized into a per-connection output buffer, which
+ * bounds how far ahead of the socket we copy.
  */
 
 enum an_io_connection_state {
@@ -102,14 +182,132 @@ enum an_io_connection_state {
 	HTTP_CONNECTION_CLOSING		/* In asynchronous tear-down */
 };
 
-/* Input and output buffer pools */
+/*
+ * Input and output buffer pools. Input pools are private to their I/O
+ * thread, and backed by its NUMA node. Responses are allocated from the
+ * output pool of the node whose I/O thread will write them out.
+ */
 AN_POOL_PRIVATE(static, input, BUMP_SIZE, POOL_SIZE);
-AN_POOL_SHARED(static, output, BUMP_SIZE, POOL_SIZE);
+AN_POOL_SHARED_ARRAY(static, output, OUTPUT_POOLS, BUMP_SIZE, POOL_SIZE);
+
+/*
+ * Input buffers we are done with, chained through their next field.
+ * They only remain valid as long as the input pool doesn't move on
+ * to another bump region, so the cache is flushed whenever its
+ * generation changes.
+ */
+struct an_io_inbuf_cache {
+	uint64_t generation;
+	struct an_buffer *head[INBUF_CACHE_CLASSES];
+	unsigned int count[INBUF_CACHE_CLASSES];
+};
+
+enum an_io_h2_stream_state {
+	H2_STREAM_FREE,		/* Unused slot */
+	H2_STREAM_RECEIVING,	/* Reading the request body */
+	H2_STREAM_DISPATCHED,	/* Waiting on a worker thread */
+	H2_STREAM_SENDING	/* Sending the response body */
+};
+
+/*
+ * When we handed a request over, and when a worker picked it up (written
+ * by the worker), for the latency histograms. Kept per request, as h2
+ * streams and pipelined requests are in flight at the same time.
+ */
+struct an_io_request_times {
+	uint64_t enqueued;
+	uint64_t dequeued;
+};
+
+struct an_io_h2_stream {
+	enum an_io_h2_stream_state state;
+	uint32_t id;
+	/* Set when the client resets a stream a worker is processing. */
+	bool reset;
+	/* Whether the stream is on the send queue */
+	bool queued;
+	int64_t send_window;
+	int64_t recv_window;
+	uint64_t start;
+	uint64_t responded;
+	struct an_io_request_times times;
+	struct an_rtbr_section rtbr_section;
+	/*
+	 * The request rewritten as HTTP/1.1: head_len bytes of request line
+	 * and headers, H2_HEAD_RESERVE bytes of room, then the body.
+	 */
+	struct an_buffer *inbuf;
+	uint32_t head_len;
+	struct an_http_request request;
+	/* The response, and how much of its body is left to send. */
+	struct an_buffer *response;
+	struct an_buffer *cursor;
+	size_t left;
+	TAILQ_ENTRY(an_io_h2_stream) send_next;
+};
+
+/*
+ * The request header block being decoded: pseudo-header values first,
+ * then regular headers as HTTP/1.1 lines from offset regular on.
+ */
+struct an_io_h2_head {
+	char *data;
+	size_t len;
+	size_t size;
+	size_t method;
+	size_t method_len;
+	size_t path;
+	size_t path_len;
+	size_t authority;
+	size_t authority_len;
+	size_t regular;
+	bool collect;	/* Only decode, for trailers and refused streams */
+	bool in_regular;
+	bool host;
+	bool malformed;
+};
+
+struct an_io_h2 {
+	struct an_hpack_decoder hpack;
+	/* Frames read from the socket */
+	uint8_t *rbuf;
+	size_t rlen;
+	size_t rsize;
+	/* Frames to write out, from wout to wlen */
+	uint8_t *wbuf;
+	size_t wlen;
+	size_t wout;
+	size_t wsize;
+	/* Scratch space for encoding response header blocks */
+	uint8_t *hbuf;
+	size_t hsize;
+	/* A header block, spanning HEADERS and CONTINUATION frames */
+	uint8_t *block;
+	size_t block_len;
+	size_t block_size;
+	uint32_t block_stream;	/* Non-zero until we get END_HEADERS */
+	uint8_t block_flags;
+	bool block_new;		/* Whether it opens a new stream */
+	struct an_io_h2_head head;
+	uint32_t last_stream;
+	uint32_t max_frame_size;
+	int64_t initial_window;
+	int64_t send_window;
+	int64_t recv_window;
+	/* No new streams; close once they are all done. */
+	bool goaway;
+	bool goaway_sent;
+	uint32_t active;
+	uint32_t max_streams;
+	TAILQ_HEAD(, an_io_h2_stream) sendq;
+	struct an_io_h2_stream streams[];
+};
 
 struct an_http_response {
 	an_request_id_t id;
 	struct an_buffer *buf;
 	struct an_http_response *next;
+	bool slab;	/* From the responses slab, rather than an_malloc */
 };
 
 enum an_io_kind {
@@ -123,6 +321,10 @@ struct an_io {
 	enum an_io_kind kind;	/* The kind of I/O object */
 	uint32_t events;	/* The events we're subscribed for */
 	int fd;			/* The socket */
+#ifdef AN_IO_URING
+	bool armed;		/* A poll request is in flight */
+	uint16_t generation;	/* Tells stale poll completions apart */
+#endif
 };
 
 /* The decoded information in an an_request_id_t */
@@ -132,39 +334,126 @@ struct an_request_location {
 	uint32_t generation;
 };
 
-/* An HTTP connection */
+/*
+ * Connection state only needed while a connection is active, from the
+ * time we start reading a request until its connection goes back to
+ * idle or is freed. Most connections are idle at any given time, so
+ * these are allocated on activation (see an_io_connection_preread())
+ * and recycled through a per-thread free list, rather than embedded in
+ * every connection slot. Workers read the request (and its input
+ * buffer) through request IDs until they submit its response, so the
+ * active state must stay allocated while pending > 0.
+ */
+struct an_io_connection_active {
+	struct an_rtbr_section rtbr_section;
+	uint64_t request_start;
+	/* When we got the response, for the latency histograms */
+	uint64_t responded;
+	/* Phase timestamps of the request, without pipelining */
+	struct an_io_request_times times;
+	http_parser parser;
+	/* Past the headers of the request being parsed */
+	bool reading_body;
+	/*
+	 * The request currently being parsed. Without pipelining, we
+	 * process requests in a strictly sequential fashion, so this is
+	 * also the request we hand over to worker threads.
+	 */
+	struct an_http_request request;
+	/*
+	 * HTTP pipelining state, only used when pipeline_depth > 1. The
+	 * requests and responses arrays are allocated from the input pool
+	 * along with inbuf, and are indexed by the request's position in
+	 * the current batch.
+	 */
+	uint32_t pipeline_written;	/* Responses written in this batch */
+	uint32_t pipeline_end;		/* End offset of the last request */
+	struct an_http_request *pipeline;
+	struct an_buffer **responses;
+	struct an_io_request_times *pipeline_times;
+	/* Linkage for the I/O thread's free list */
+	SLIST_ENTRY(an_io_connection_active) free_next;
+};
+
+#ifdef AN_IO_URING
+/* Scatter/gather lists of a send chain, see an_io_uring_send(). */
+struct an_io_uring_vec {
+	struct iovec iov[MAX_WRITE_IOVECS];
+	struct msghdr msg[MAX_WRITE_IOVECS];
+};
+#endif
+
+/*
+ * A connection slot. Request IDs index into the I/O thread's array of
+ * those, so they never move; workers may also look at the active state
+ * (through request IDs) while the request is pending.
+ */
 struct an_io_connection {
 	struct an_io_thread *iotd;
 	struct an_io_listener *listener;
 	struct an_io io;
 	enum an_io_connection_state state;
-	struct an_rtbr_section rtbr_section;
-	uint64_t request_start;
 	uint32_t generation;
 	uint64_t timeout;
-	http_parser parser;
+	/* Request deadline when active, idle timeout when idle. */
+	struct an_wheel_timer timer;
+	/* Set while on the I/O thread's stack of shortened deadlines. */
+	uint8_t deadline_queued;
+	struct an_io_connection *deadline_next;
 	bool keepalive;
 	bool remote_closed;
+	/* Set for the lifetime of TLS connections. */
+	bool tls;
+#ifdef AN_IO_KTLS
+	/* Only until the handshake completes. */
+	SSL *ssl;
+#endif
 	struct an_buffer *inbuf;
 	struct an_buffer *outbuf;
-	/*
-	 * Since we do not support HTTP pipelining, we process requests
-	 * in a strictly sequential fashion, and we can embed the public
-	 * request object here to avoid allocations.
-	 */
-	struct an_http_request request;
+	/* Non-NULL from READING until the connection goes idle or is freed */
+	struct an_io_connection_active *active;
+	/* Number of requests for which we are still waiting on a response. */
+	uint32_t pending;
+	/* Requests parsed in the current pipelining batch */
+	uint32_t pipeline_len;
+	/* Whether the connection is on the flush queue */
+	bool flush_queued;
+#ifdef AN_IO_URING
+	/* Bytes of the linked send chain in flight, 0 if none */
+	size_t sending;
+	/* Bytes of its last send */
+	size_t send_tail;
+	/* First failure (-errno) of the chain, else bytes of its last send */
+	int send_result;
+	/* Allocated on first send, and kept along with the slot */
+	struct an_io_uring_vec *send_vec;
+#endif
+	/* Until we know whether the client starts with the h2 preface */
+	bool h2_candidate;
+	/* HTTP/2 state, NULL for HTTP/1.x connections */
+	struct an_io_h2 *h2;
 	/* Linkage for the free connections list */
 	SLIST_ENTRY(an_io_connection) free_next;
+	/* Linkage for the queue of connections with responses to write */
+	STAILQ_ENTRY(an_io_connection) flush_next;
 	/* Linkage for the idle connections list */
 	LIST_ENTRY(an_io_connection) idle_next;
 	/* Linkage for the active connections list */
 	LIST_ENTRY(an_io_connection) active_next;
 };
 
+#ifdef AN_IO_URING
+AN_ARRAY_PRIMITIVE(int, fd_list);
+#endif
+
 struct an_io_listener {
 	struct an_io_thread *iotd;
 	char *service;
 	struct an_io io;
+#ifdef AN_IO_URING
+	/* Sockets from the multishot accept, not set up yet */
+	AN_ARRAY_INSTANCE(fd_list) accepted;
+#endif
 };
 
 AN_ARRAY_PRIMITIVE(struct an_io_listener *, listener_list);
@@ -184,6 +473,8 @@ enum an_io_stat {
 	AN_IO_WRITE_ERRORS,
 	/* Request timeout exceeded */
 	AN_IO_REQUEST_TIMEOUT,
+	/* Idle connections closed after idle_timeout_ms */
+	AN_IO_IDLE_TIMEOUT,
 	/* Number of times the connection was closed early by our peer */
 	AN_IO_RESET_BY_PEER,
 	/*
@@ -199,6 +490,14 @@ enum an_io_stat {
 	AN_IO_OOM_FAILURES,
 	/* Number of valid requests processed */
 	AN_IO_NUM_REQUESTS,
+	/* Requests answered with a 503 by admission control */
+	AN_IO_SHED_REQUESTS,
+	/* Requests parsed by the fast path, without http_parser */
+	AN_IO_SCANNED_REQUESTS,
+	/* TLS handshakes that failed or could not be offloaded */
+	AN_IO_TLS_FAILURES,
+	/* Connections that switched to HTTP/2 */
+	AN_IO_H2_CONNECTIONS,
 	AN_IO_STAT_MAX
 };
 
@@ -206,6 +505,61 @@ struct an_io_stats {
 	uint64_t values[AN_IO_STAT_MAX];
 };
 
+/* Request phases we keep latency histograms for. */
+enum an_io_phase {
+	/* From the first byte read to handing the request over */
+	AN_IO_PHASE_READ,
+	/* Waiting in the FIFO for a worker */
+	AN_IO_PHASE_QUEUE,
+	/* From the worker picking it up to us getting the response */
+	AN_IO_PHASE_HANDLER,
+	/* From getting the response to having written all of it */
+	AN_IO_PHASE_WRITE,
+	AN_IO_PHASE_MAX
+};
+
+static const char *const an_io_phase_names[AN_IO_PHASE_MAX] = {
+	[AN_IO_PHASE_READ] = "read",
+	[AN_IO_PHASE_QUEUE] = "queue",
+	[AN_IO_PHASE_HANDLER] = "handler",
+	[AN_IO_PHASE_WRITE] = "write"
+};
+
+/*
+ * Latency histograms in microseconds, with log-linear bins: 16 bins
+ * of 2us each for [0, 32us), then 8 bins per power of 2 up to 2^32us.
+ */
+#define AN_IO_HIST_LINEAR_LB	4
+#define AN_IO_HIST_SUBRANGE_LB	3
+#define AN_IO_HIST_MAX_LB	32
+#define AN_IO_HIST_BINS							\
+	(((AN_IO_HIST_MAX_LB - AN_IO_HIST_LINEAR_LB) << AN_IO_HIST_SUBRANGE_LB) + \
+	(1 << AN_IO_HIST_SUBRANGE_LB))
+
+/*
+ * Only ever updated by the owning I/O thread, and only read by the
+ * stats callback, which never resets them.
+ */
+struct an_io_histogram {
+	uint64_t counts[AN_IO_HIST_BINS];
+};
+
+/*
+ * Admission control state, updated by the worker threads dequeuing
+ * requests from an I/O thread. Over each interval, we track the lowest
+ * time a request spent between its first byte being read and a worker
+ * picking it up. If even that stayed above target, we have a standing
+ * queue rather than a burst, and shed requests that waited too long
+ * during the next interval.
+ */
+struct an_io_codel {
+	uint64_t target;	/* 0 if disabled */
+	uint64_t interval;
+	uint64_t min_sojourn;
+	uint64_t interval_end;
+	uint8_t overloaded;	/* This would be a bool if ck_pr supported it */
+} CK_CC_CACHELINE;
+
 struct an_io_thread {
 	struct an_io_server *server;
 	pthread_t thread;
@@ -217,34 +571,105 @@ struct an_io_thread {
 
 	/* Concurrent stack of responses (MPSC) */
 	struct an_http_response *responses_head;
+	/* Responses popped off the stack but not processed yet, in order */
+	struct an_http_response *responses_backlog;
+	struct an_http_response **responses_backlog_tail;
 
 	/* Connections storage and management */
 	uint32_t max_total_connections;
 	uint32_t max_active_connections;
+	uint32_t pipeline_depth;
+	/* Concurrent streams per h2c connection, 0 if h2c is disabled */
+	uint32_t h2_max_streams;
 	struct an_io_connection *connections;
-	/* Free list of connection objects */
+	/*
+	 * Free list of connection objects. Slots past num_conns_used were
+	 * never handed out: we only touch them when the free list runs
+	 * dry, so that a large max_total_connections costs address space
+	 * rather than memory.
+	 */
 	SLIST_HEAD(, an_io_connection) free_conns;
+	uint32_t num_conns_used;
+	/* Free list of active connection states */
+	SLIST_HEAD(, an_io_connection_active) free_actives;
 	/* List of established but idle connections */
 	LIST_HEAD(, an_io_connection) idle_conns;
 	/* List of established and active connections */
 	LIST_HEAD(, an_io_connection) active_conns;
+	/* Connections with responses ready to be written */
+	STAILQ_HEAD(, an_io_connection) flush_conns;
+	/* Released input buffers, from our (thread-local) input pool */
+	struct an_io_inbuf_cache inbuf_cache;
 
 	/* I/O event notification bits */
 	struct epoll_event *events;
 	unsigned int nevents;
 	int epollfd;
+#ifdef AN_IO_URING
+	/* Used instead of epollfd when uring is set. */
+	struct io_uring ring;
+	bool uring;
+#endif
 	uint64_t request_timeout;
+	uint64_t idle_timeout;
+
+	/* Request deadlines and idle timeouts of our connections. */
+	struct an_wheel wheel;
+
+	/*
+	 * Connections whose deadline got shortened by a handler, so we
+	 * re-arm their timer (MPSC stack).
+	 */
+	struct an_io_connection *deadlines_head;
+
+	/* NUMA node we run on, for picking workers to wake up. */
+	unsigned int numa_node;
+
+	/*
+	 * Our thread-local input pool, for stats; NULL once we exit. The
+	 * lock keeps the TLS alive while the stats thread reads it.
+	 */
+	struct an_pool_private *input;
+	ck_spinlock_fas_t input_lock;
 
 	/* The eventfd notifying us we have responses to process */
 	struct an_io io;
 
 	/* Statistics */
 	struct an_io_stats stats;
+	struct an_io_histogram latency[AN_IO_PHASE_MAX];
+
+	/* Written to by worker threads. */
+	struct an_io_codel codel;
+
+	/* Busy polling budget in rdtsc cycles, 0 to always block. */
+	uint64_t busy_poll;
+	/* Set while busy polling; read by workers, see an_io_thread_notify(). */
+	uint8_t polling CK_CC_CACHELINE;
 
 	/* The listeners attached to this I/O thread. */
 	AN_ARRAY_INSTANCE(listener_list) listeners;
 };
 
+/*
+ * A worker thread blocked in an_io_server_read_batch(). Each worker
+ * parks on its own eventfd, so that I/O threads can wake up exactly as
+ * many workers as they have new requests.
+ */
+struct an_io_worker {
+	int fd;
+	unsigned int node;	/* NUMA node of the idle list we park on */
+	bool parked;		/* Protected by the idle list's lock */
+	LIST_ENTRY(an_io_worker) idle_entry;
+};
+
+/* Parked worker threads, one list per NUMA node. */
+struct an_io_idle_list {
+	ck_spinlock_fas_t lock;
+	unsigned int count;
+	LIST_HEAD(, an_io_worker) workers;
+} CK_CC_CACHELINE;
+
 struct an_io_server {
 	/* Startup and shutdown management. */
 	sem_t startup;
@@ -260,8 +685,18 @@ struct an_io_server {
 	 */
 	uint8_t quiesce;	/* This would be a bool if ck_pr supported it */
 
-	/* Worker threads eventfd */
+	/*
+	 * Worker threads eventfd, only written to once somebody asked for
+	 * it with an_io_server_notify_fd(). Workers blocking in
+	 * an_io_server_read() park on the idle lists instead.
+	 */
 	int workers_eventfd;
+	uint8_t notify_fd_used;	/* This would be a bool if ck_pr supported it */
+
+	/* Parked worker threads, indexed by NUMA node. */
+	struct an_io_idle_list *idle;
+	unsigned int num_nodes;
+	pthread_key_t worker_key;
 
 	struct an_io_thread *threads;
 	unsigned int num_threads;
@@ -274,6 +709,27 @@ struct an_io_server {
 
 	/* Hard limit on response sizes. */
 	size_t max_response_size;
+
+	/* Whether connections are steered to I/O threads by CPU. */
+	bool steer_connections;
+
+	/* See busy_poll_us in struct an_server_config. */
+	int busy_poll_us;
+	uint64_t busy_poll;
+
+	/* Whether buffer pools are backed by huge pages. */
+	bool huge_pages;
+
+#ifdef AN_IO_KTLS
+	/* Non-NULL when terminating TLS. */
+	SSL_CTX *tls;
+#endif
+
+	/*
+	 * Merged latency histograms as of the last time stats were
+	 * cleared, owned by the stats callback.
+	 */
+	struct an_io_histogram latency_cleared[AN_IO_PHASE_MAX];
 };
 
 static AN_MALLOC_DEFINE(an_io_server_token,
@@ -285,16 +741,25 @@ static AN_MALLOC_DEFINE(an_io_thread_token,
     .string = "an_io_thread",
     .mode   = AN_MEMORY_MODE_VARIABLE);
 
-static AN_MALLOC_DEFINE(an_io_listener_token,
-    .string = "an_io_listener",
+static AN_MALLOC_DEFINE(an_io_worker_token,
+    .string = "an_io_worker",
     .mode   = AN_MEMORY_MODE_FIXED,
-    .size   = sizeof(struct an_io_listener));
+    .size   = sizeof(struct an_io_worker));
+
+static AN_MALLOC_DEFINE(an_io_idle_list_token,
+    .string = "an_io_idle_list",
+    .mode   = AN_MEMORY_MODE_VARIABLE);
 
 static AN_MALLOC_DEFINE(an_http_response_token,
     .string = "an_http_response",
     .mode   = AN_MEMORY_MODE_FIXED,
     .size   = sizeof(struct an_http_response));
 
+static AN_MALLOC_DEFINE(an_io_listener_token,
+    .string = "an_io_listener",
+    .mode   = AN_MEMORY_MODE_FIXED,
+    .size   = sizeof(struct an_io_listener));
+
 static AN_MALLOC_DEFINE(an_io_ring_buffer_token,
     .string = "ck_ring_buffer_t",
     .mode   = AN_MEMORY_MODE_VARIABLE);
@@ -303,21 +768,98 @@ static AN_MALLOC_DEFINE(an_io_connection_token,
     .string = "an_io_connection array",
     .mode   = AN_MEMORY_MODE_VARIABLE);
 
+static AN_MALLOC_DEFINE(an_io_connection_active_token,
+    .string = "an_io_connection_active",
+    .mode   = AN_MEMORY_MODE_FIXED,
+    .size   = sizeof(struct an_io_connection_active));
+
 static AN_MALLOC_DEFINE(an_io_event_token,
     .string = "struct epoll_event",
     .mode   = AN_MEMORY_MODE_VARIABLE);
 
-static void an_io_subscribe(const struct an_io_thread *, struct an_io *, uint32_t);
+static AN_MALLOC_DEFINE(an_io_h2_token,
+    .string = "an_io_h2",
+    .mode   = AN_MEMORY_MODE_VARIABLE);
+
+static AN_MALLOC_DEFINE(an_io_h2_buffer_token,
+    .string = "an_io_h2 buffer",
+    .mode   = AN_MEMORY_MODE_VARIABLE);
+
+#ifdef AN_IO_URING
+static AN_MALLOC_DEFINE(an_io_uring_vec_token,
+    .string = "an_io_uring_vec",
+    .mode   = AN_MEMORY_MODE_FIXED,
+    .size   = sizeof(struct an_io_uring_vec));
+#endif
+
+/*
+ * Responses are allocated by workers and freed by I/O threads, so
+ * slab magazines keep flowing from the latter to the former. We fall
+ * back to an_malloc if the slab is ever exhausted.
+ */
+AN_SLAB(static, responses, sizeof(struct an_http_response),
+    RESPONSE_SLAB_SIZE);
+
+static struct an_http_response *
+an_http_response_get(an_request_id_t id, struct an_buffer *buf)
+{
+	struct an_http_response *resp;
+
+	resp = an_slab_alloc(&responses);
+	if (AN_CC_LIKELY(resp != NULL)) {
+		resp->slab = true;
+	} else {
+		resp = an_calloc_object(an_http_response_token);
+		resp->slab = false;
+	}
+
+	resp->id = id;
+	resp->buf = buf;
+	resp->next = NULL;
+	return resp;
+}
+
+static void
+an_http_response_put(struct an_http_response *resp)
+{
+
+	if (AN_CC_LIKELY(resp->slab)) {
+		an_slab_free(&responses, resp);
+	} else {
+		an_free(an_http_response_token, resp);
+	}
+}
+
+static void an_io_subscribe(struct an_io_thread *, struct an_io *, uint32_t);
+static int an_io_thread_wait(struct an_io_thread *, int);
+static unsigned int an_io_current_node(const struct an_io_server *);
+static void an_io_worker_destroy(void *);
+static unsigned int an_io_server_wake_workers(struct an_io_server *,
+    unsigned int, unsigned int);
+#ifdef AN_IO_KTLS
+static void an_io_connection_handshake(struct an_io_connection *);
+#endif
+static void an_io_h2_start(struct an_io_connection *);
+static void an_io_h2_destroy(struct an_io_connection *);
+#ifdef AN_IO_URING
+static bool an_io_uring_init(struct an_io_thread *);
+static void an_io_uring_rearm(struct an_io_thread *, unsigned int);
+static void an_io_uring_send(struct an_io_connection *);
+static void an_io_uring_cancel_send(struct an_io_connection *);
+static void an_io_uring_sent(struct an_io_connection *);
+#endif
 
 static uint64_t an_server_large_allocations = 0;
 
 /* Used by the stats callback. */
 static struct an_io_server *server;
 
+static __thread struct an_io_worker *an_io_worker_self;
+
 /* Request ID encoding and decoding functions. */
 static inline void
 an_request_id_encode(an_request_id_t *rid, const struct an_io_thread *iotd,
-    const struct an_io_connection *conn)
+    const struct an_io_connection *conn, uint32_t slot)
 {
 
 	/*
@@ -333,11 +875,14 @@ an_request_id_encode(an_request_id_t *rid, const struct an_io_thread *iotd,
 	 * I/O thread index       |                    generation number
 	 *                        v
 	 *                  connection index
+	 *
+	 * Pipelined requests on the same connection are told apart by
+	 * adding their position in the pipeline to the generation number.
 	 */
 	rid->id =
 	    ((uint64_t)(iotd - iotd->server->threads) << RID_IOTDIDX_SHIFT) |
 	    ((uint64_t)(conn - iotd->connections) << RID_CONNIDX_SHIFT) |
-	    conn->generation;
+	    ((conn->generation + slot) & RID_GEN_MASK);
 	rid->id *= RID_FACTOR;
 }
 
@@ -413,7 +958,7 @@ on_url(http_parser *parser, const char *data, size_t len)
 	struct an_buffer *buffer;
 
 	conn = parser->data;
-	req = &conn->request;
+	req = &conn->active->request;
 	buffer = conn->inbuf;
 
 	if (AN_CC_LIKELY(req->uri_offset == 0)) {
@@ -431,7 +976,7 @@ on_body(http_parser *parser, const char *data, size_t len)
 	struct an_buffer *buffer;
 
 	conn = parser->data;
-	req = &conn->request;
+	req = &conn->active->request;
 	buffer = conn->inbuf;
 
 	if (AN_CC_LIKELY(req->body_offset == 0)) {
@@ -441,17 +986,37 @@ on_body(http_parser *parser, const char *data, size_t len)
 	return 0;
 }
 
+static int
+on_headers_complete(http_parser *parser)
+{
+	struct an_io_connection *conn;
+
+	conn = parser->data;
+	conn->active->reading_body = true;
+	return 0;
+}
+
 static int
 on_message_complete(http_parser *parser)
 {
 	struct an_io_connection *conn;
 
 	conn = parser->data;
+	conn->active->reading_body = false;
 
 	if (!http_should_keep_alive(parser)) {
 		conn->keepalive = false;
 	}
 
+	if (conn->iotd->pipeline_depth > 1) {
+		/*
+		 * Stop at the message boundary, so that the caller knows
+		 * where this request ends; see an_io_connection_parse().
+		 */
+		http_parser_pause(parser, 1);
+		return 0;
+	}
+
 	AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_PROCESSING);
 	return 0;
 }
@@ -498,6 +1063,9 @@ an_io_thread_stats(struct an_io_thread *iotd, unsigned int id,
 	evbuffer_add_printf(buf,
 	    "iothread.%u.request_timeouts_sum: %.3f\n", id,
 	    (double)an_io_stat_get(iotd, AN_IO_REQUEST_TIMEOUT, clear) / elapsed);
+	evbuffer_add_printf(buf,
+	    "iothread.%u.idle_timeouts_sum: %.3f\n", id,
+	    (double)an_io_stat_get(iotd, AN_IO_IDLE_TIMEOUT, clear) / elapsed);
 	evbuffer_add_printf(buf,
 	    "iothread.%u.write_errors_sum: %.3f\n", id,
 	    (double)an_io_stat_get(iotd, AN_IO_WRITE_ERRORS, clear) / elapsed);
@@ -519,6 +1087,158 @@ an_io_thread_stats(struct an_io_thread *iotd, unsigned int id,
 	evbuffer_add_printf(buf,
 	    "iothread.%u.num_requests_sum: %.3f\n", id,
 	    (double)an_io_stat_get(iotd, AN_IO_NUM_REQUESTS, clear) / elapsed);
+	evbuffer_add_printf(buf,
+	    "iothread.%u.shed_requests_sum: %.3f\n", id,
+	    (double)an_io_stat_get(iotd, AN_IO_SHED_REQUESTS, clear) / elapsed);
+	evbuffer_add_printf(buf,
+	    "iothread.%u.scanned_requests_sum: %.3f\n", id,
+	    (double)an_io_stat_get(iotd, AN_IO_SCANNED_REQUESTS, clear) / elapsed);
+	evbuffer_add_printf(buf,
+	    "iothread.%u.tls_failures_sum: %.3f\n", id,
+	    (double)an_io_stat_get(iotd, AN_IO_TLS_FAILURES, clear) / elapsed);
+	evbuffer_add_printf(buf,
+	    "iothread.%u.h2_connections_sum: %.3f\n", id,
+	    (double)an_io_stat_get(iotd, AN_IO_H2_CONNECTIONS, clear) / elapsed);
+}
+
+static inline void
+an_io_latency_add(struct an_io_thread *iotd, enum an_io_phase phase,
+    uint64_t begin, uint64_t end)
+{
+	uint64_t us;
+	size_t bin;
+
+	us = end > begin ? an_md_rdtsc_scale(end - begin) : 0;
+	us = min(us, (1ULL << AN_IO_HIST_MAX_LB) - 1);
+	bin = log_linear_bin_down_of(us, NULL, NULL, AN_IO_HIST_LINEAR_LB,
+	    AN_IO_HIST_SUBRANGE_LB);
+	assert(bin < AN_IO_HIST_BINS);
+	iotd->latency[phase].counts[bin]++;
+}
+
+/* The smallest value that maps to a histogram bin. */
+static uint64_t
+an_io_histogram_value(size_t bin)
+{
+	size_t range, sub_index;
+
+	/* The linear range and the first power of 2 share range 0. */
+	range = bin >> AN_IO_HIST_SUBRANGE_LB;
+	if (range > 0) {
+		range--;
+	}
+
+	sub_index = bin - (range << AN_IO_HIST_SUBRANGE_LB);
+	return (uint64_t)sub_index <<
+	    (AN_IO_HIST_LINEAR_LB + range - AN_IO_HIST_SUBRANGE_LB);
+}
+
+static uint64_t
+an_io_histogram_percentile(const struct an_io_histogram *hist,
+    uint64_t total, double q)
+{
+	uint64_t rank, seen;
+	size_t i;
+
+	rank = max((uint64_t)ceil(q * total), 1ULL);
+	seen = 0;
+	for (i = 0; i < AN_IO_HIST_BINS; i++) {
+		seen += hist->counts[i];
+		if (seen >= rank) {
+			return an_io_histogram_value(i);
+		}
+	}
+
+	return an_io_histogram_value(AN_IO_HIST_BINS - 1);
+}
+
+/*
+ * Merge the latency histograms of all I/O threads, and print a few
+ * percentiles for what happened since stats were last cleared.
+ */
+static void
+an_io_server_latency_stats(struct evbuffer *buf, bool clear)
+{
+	struct an_io_histogram merged, delta;
+	const char *name;
+	uint64_t count, total;
+	unsigned int i, phase;
+	size_t j;
+
+	for (phase = 0; phase < AN_IO_PHASE_MAX; phase++) {
+		memset(&merged, 0, sizeof(merged));
+		for (i = 0; i < server->num_threads; i++) {
+			for (j = 0; j < AN_IO_HIST_BINS; j++) {
+				merged.counts[j] += ck_pr_load_64(
+				    &server->threads[i].latency[phase].counts[j]);
+			}
+		}
+
+		total = 0;
+		for (j = 0; j < AN_IO_HIST_BINS; j++) {
+			count = merged.counts[j] -
+			    server->latency_cleared[phase].counts[j];
+			delta.counts[j] = count;
+			total += count;
+		}
+
+		if (clear == true) {
+			server->latency_cleared[phase] = merged;
+		}
+
+		name = an_io_phase_names[phase];
+		evbuffer_add_printf(buf,
+		    "iothread.%s_latency_count: %"PRIu64"\n", name, total);
+		if (total == 0) {
+			continue;
+		}
+
+		evbuffer_add_printf(buf,
+		    "iothread.%s_latency_us_p50: %"PRIu64"\n", name,
+		    an_io_histogram_percentile(&delta, total, 0.5));
+		evbuffer_add_printf(buf,
+		    "iothread.%s_latency_us_p90: %"PRIu64"\n", name,
+		    an_io_histogram_percentile(&delta, total, 0.9));
+		evbuffer_add_printf(buf,
+		    "iothread.%s_latency_us_p99: %"PRIu64"\n", name,
+		    an_io_histogram_percentile(&delta, total, 0.99));
+		evbuffer_add_printf(buf,
+		    "iothread.%s_latency_us_p999: %"PRIu64"\n", name,
+		    an_io_histogram_percentile(&delta, total, 0.999));
+	}
+}
+
+/* Occupancy and churn of the buffer pools; gauges, never cleared. */
+static void
+an_io_server_pool_stats(struct evbuffer *buf)
+{
+	struct an_pool_private *pool;
+	struct an_io_thread *iotd;
+	struct an_pool_stats stats;
+	char name[32];
+	unsigned int i;
+
+	for (i = 0; i < server->num_threads; i++) {
+		iotd = &server->threads[i];
+		ck_spinlock_fas_lock(&iotd->input_lock);
+		pool = iotd->input;
+		if (pool != NULL) {
+			an_pool_private_stats(pool, &stats);
+		}
+		ck_spinlock_fas_unlock(&iotd->input_lock);
+		if (pool == NULL) {
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "iothread.%u.input", i);
+		an_pool_stats_print(buf, name, &stats);
+	}
+
+	for (i = 0; i < min(server->num_nodes, OUTPUT_POOLS); i++) {
+		an_pool_shared_stats(&output[i], &stats);
+		snprintf(name, sizeof(name), "output.%u", i);
+		an_pool_stats_print(buf, name, &stats);
+	}
 }
 
 static void
@@ -529,17 +1249,17 @@ an_io_server_stats(struct evbuffer *buf, double elapsed, bool clear)
 	for (i = 0; i < server->num_threads; i++) {
 		an_io_thread_stats(&server->threads[i], i, buf, elapsed, clear);
 	}
+
+	an_io_server_latency_stats(buf, clear);
+	an_io_server_pool_stats(buf);
 }
 
 /* Internal request buffer API */
 static bool
-an_pool_grow_to(struct an_buffer *buf, size_t want)
+an_pool_grow_to(struct an_buffer *buf, size_t new_size)
 {
-	uint64_t new_size;
 	void *data;
 
-	new_size = next_power_of_2(want);
-
 	if (buf->external_allocation) {
 		data = realloc(buf->data, new_size);
 		if (AN_CC_UNLIKELY(data == NULL)) {
@@ -551,6 +1271,12 @@ an_pool_grow_to(struct an_buffer *buf, size_t want)
 		return true;
 	}
 
+	/* Usually possible while a single large request streams in. */
+	if (an_pool_private_extend(&input, buf->data, buf->size, new_size)) {
+		buf->size = new_size;
+		return true;
+	}
+
 	data = an_pool_alloc(&input, new_size, false, 8);
 	if (AN_CC_UNLIKELY(data == NULL)) {
 		return false;
@@ -566,20 +1292,42 @@ static bool
 an_pool_grow(struct an_buffer *buf)
 {
 
-	return an_pool_grow_to(buf, buf->size + 1);
+	return an_pool_grow_to(buf, next_power_of_2(buf->size + 1));
+}
+
+/*
+ * Offset at which the body of the request being read ends, if we know
+ * it (and it is small enough that we don't mind allocating it before
+ * the bytes actually show up), or 0.
+ */
+static size_t
+an_io_connection_body_end(const struct an_io_connection *conn)
+{
+	uint64_t left;
+
+	if (conn->active->reading_body == false) {
+		return 0;
+	}
+
+	left = conn->active->parser.content_length;
+	if (left == 0 || left == ULLONG_MAX || left > MAX_BODY_PRESIZE) {
+		return 0;
+	}
+
+	return conn->inbuf->in + left;
 }
 
 static struct an_buffer *
-an_pool_input_get(size_t want)
+an_pool_input_get(struct an_pool_private *pool, size_t want)
 {
 	struct an_buffer *buf;
 
-	buf = an_pool_alloc(&input, sizeof(struct an_buffer), false, 8);
+	buf = an_pool_alloc(pool, sizeof(struct an_buffer), false, 8);
 	if (AN_CC_UNLIKELY(buf == NULL)) {
 		return NULL;
 	}
 
-	buf->data = an_pool_alloc(&input, want, true, 8);
+	buf->data = an_pool_alloc(pool, want, true, 8);
 	if (AN_CC_UNLIKELY(buf->data == NULL)) {
 		return NULL;
 	}
@@ -587,22 +1335,25 @@ an_pool_input_get(size_t want)
 	buf->in = 0;
 	buf->out = 0;
 	buf->size = want;
+	buf->next = NULL;
 	buf->external_allocation = false;
+	buf->release = NULL;
+	buf->release_arg = NULL;
 
 	return buf;
 }
 
 static struct an_buffer *
-an_pool_output_get(size_t want)
+an_pool_output_get(struct an_pool_shared *pool, size_t want)
 {
 	struct an_buffer *buf;
 
-	buf = an_pool_alloc(&output, sizeof(struct an_buffer), false, 8);
+	buf = an_pool_alloc(pool, sizeof(struct an_buffer), false, 8);
 	if (AN_CC_UNLIKELY(buf == NULL)) {
 		return NULL;
 	}
 
-	buf->data = an_pool_alloc(&output, want, true, 8);
+	buf->data = an_pool_alloc(pool, want, true, 8);
 	if (AN_CC_UNLIKELY(buf->data == NULL)) {
 		return NULL;
 	}
@@ -610,39 +1361,144 @@ an_pool_output_get(size_t want)
 	buf->in = 0;
 	buf->out = 0;
 	buf->size = want;
+	buf->next = NULL;
 	buf->external_allocation = false;
+	buf->release = NULL;
+	buf->release_arg = NULL;
 
 	return buf;
 }
 
-/* I/O object API */
 static void
-an_io_init(struct an_io *io, enum an_io_kind kind, int fd)
+an_io_inbuf_cache_sync(struct an_io_inbuf_cache *cache)
 {
 
-	io->kind = kind;
-	io->fd = fd;
-	io->events = 0;
+	if (AN_CC_LIKELY(cache->generation == input.generation)) {
+		return;
+	}
+
+	/* The buffers are gone along with their bump region. */
+	memset(cache, 0, sizeof(*cache));
+	cache->generation = input.generation;
 }
 
-static void
-an_io_deinit(struct an_io_thread *iotd, struct an_io *io)
+/* Get an input buffer of at least @a want bytes, preferably a cached one. */
+static struct an_buffer *
+an_io_inbuf_get(struct an_io_thread *iotd, size_t want)
 {
+	struct an_io_inbuf_cache *cache;
+	struct an_buffer *buf;
+	unsigned int lb;
 
-	an_io_subscribe(iotd, io, 0);
-	if (io->fd != -1) {
+	cache = &iotd->inbuf_cache;
+	lb = max(log2_ceiling(want), INBUF_CACHE_MIN_LB);
+	if (lb >= INBUF_CACHE_MIN_LB + INBUF_CACHE_CLASSES) {
+		return an_pool_get(&input, want);
+	}
+
+	an_io_inbuf_cache_sync(cache);
+	buf = cache->head[lb - INBUF_CACHE_MIN_LB];
+	if (buf == NULL) {
+		return an_pool_get(&input, 1ULL << lb);
+	}
+
+	cache->head[lb - INBUF_CACHE_MIN_LB] = buf->next;
+	cache->count[lb - INBUF_CACHE_MIN_LB]--;
+	buf->next = NULL;
+	buf->in = 0;
+	buf->out = 0;
+	assert(buf->size >= want);
+	return buf;
+}
+
+/*
+ * Cache an input buffer nobody references anymore. Buffers from
+ * previous bump regions are left for the pool to reclaim.
+ */
+static void
+an_io_inbuf_put(struct an_io_thread *iotd, struct an_buffer *buf)
+{
+	struct an_io_inbuf_cache *cache;
+	unsigned int class;
+
+	if (buf == NULL || buf->external_allocation ||
+	    buf->size < (1ULL << INBUF_CACHE_MIN_LB)) {
+		return;
+	}
+
+	cache = &iotd->inbuf_cache;
+	an_io_inbuf_cache_sync(cache);
+	if (!an_pool_private_current(&input, buf) ||
+	    !an_pool_private_current(&input, buf->data)) {
+		return;
+	}
+
+	class = min(log2_floor(buf->size) - INBUF_CACHE_MIN_LB,
+	    INBUF_CACHE_CLASSES - 1);
+	if (cache->count[class] >= INBUF_CACHE_DEPTH) {
+		return;
+	}
+
+	buf->next = cache->head[class];
+	cache->head[class] = buf;
+	cache->count[class]++;
+}
+
+/* Release a response buffer chain once it has been written out. */
+static void
+an_io_buffer_release(struct an_buffer *buf)
+{
+	struct an_buffer *next;
+
+	for (; buf != NULL; buf = next) {
+		next = buf->next;
+		if (buf->release != NULL) {
+			/* We only reference that data, let the owner know. */
+			buf->release(buf->release_arg);
+		}
+
+		if (AN_CC_LIKELY(!buf->external_allocation)) {
+			/* Pool allocations are reclaimed wholesale. */
+			continue;
+		}
+
+		ck_pr_sub_64(&an_server_large_allocations,
+		    malloc_usable_size(buf->data));
+		free(buf->data);
+		free(buf);
+	}
+}
+
+/* I/O object API */
+static void
+an_io_init(struct an_io *io, enum an_io_kind kind, int fd)
+{
+
+	io->kind = kind;
+	io->fd = fd;
+	io->events = 0;
+#ifdef AN_IO_URING
+	io->armed = false;
+#endif
+}
+
+static void
+an_io_deinit(struct an_io_thread *iotd, struct an_io *io)
+{
+
+	an_io_subscribe(iotd, io, 0);
+	if (io->fd != -1) {
 		close(io->fd);
 		io->fd = -1;
 	}
 }
 
 static int
-an_io_setopt(const struct an_io *io, int level, int opt)
+an_io_setopt_value(const struct an_io *io, int level, int opt, int value)
 {
-	int ret, on;
+	int ret;
 
-	on = 1;
-	ret = setsockopt(io->fd, level, opt, &on, sizeof(on));
+	ret = setsockopt(io->fd, level, opt, &value, sizeof(value));
 	if (ret != 0) {
 		an_syslog(LOG_WARNING, "Failed to enable socket option %d "
 		    "(level %d): %d (%s)", opt, level, errno,
@@ -651,6 +1507,25 @@ an_io_setopt(const struct an_io *io, int level, int opt)
 	return ret;
 }
 
+static int
+an_io_setopt(const struct an_io *io, int level, int opt)
+{
+
+	return an_io_setopt_value(io, level, opt, 1);
+}
+
+/* Whether reading from that socket would not block, without reading. */
+static bool
+an_io_readable(const struct an_io *io)
+{
+	struct pollfd pfd = {
+		.fd = io->fd,
+		.events = POLLIN
+	};
+
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN) != 0;
+}
+
 static int
 an_io_cloexec(const struct an_io *io)
 {
@@ -714,6 +1589,14 @@ an_io_thread_listen(struct an_io_thread *iotd, const char *host,
 		an_io_setopt(&io, SOL_SOCKET, SO_KEEPALIVE);
 		an_io_setopt(&io, IPPROTO_TCP, TCP_NODELAY);
 		an_io_setopt(&io, IPPROTO_TCP, TCP_QUICKACK);
+		if (iotd->server->busy_poll_us > 0) {
+			/*
+			 * Accepted sockets inherit this. Raising it above
+			 * net.core.busy_read takes CAP_NET_ADMIN.
+			 */
+			an_io_setopt_value(&io, SOL_SOCKET, SO_BUSY_POLL,
+			    iotd->server->busy_poll_us);
+		}
 
 		ret = bind(fd, ai->ai_addr, ai->ai_addrlen);
 		if (ret == 0) {
@@ -746,6 +1629,9 @@ an_io_thread_listen(struct an_io_thread *iotd, const char *host,
 	listener->io = io;
 	listener->iotd = iotd;
 	listener->service = an_string_dup(service);
+#ifdef AN_IO_URING
+	AN_ARRAY_INIT(fd_list, &listener->accepted, 8);
+#endif
 
 	AN_ARRAY_PUSH(listener_list, &iotd->listeners, &listener);
 
@@ -756,17 +1642,65 @@ an_io_thread_listen(struct an_io_thread *iotd, const char *host,
 static void
 an_io_listener_destroy(struct an_io_listener *listener)
 {
+#ifdef AN_IO_URING
+	int *fd;
+
+	AN_ARRAY_FOREACH(&listener->accepted, fd) {
+		close(*fd);
+	}
+	AN_ARRAY_DEINIT(fd_list, &listener->accepted);
+#endif
 
 	an_string_free(listener->service);
 	an_io_deinit(listener->iotd, &listener->io);
 	an_free(an_io_listener_token, listener);
 }
 
+/*
+ * Every I/O thread has its own SO_REUSEPORT listener for each address,
+ * and the kernel normally picks one by hashing the connection 4-tuple.
+ * Instead, route new connections to the listener at index
+ * (CPU % num_threads) in the reuseport group, i.e., the one belonging
+ * to the I/O thread pinned to that CPU (see an_io_thread()).
+ *
+ * Sockets are indexed in the order they started listening, which is
+ * the I/O thread order since an_io_server_listen() goes through them
+ * sequentially. If the index is out of bounds (e.g., some listeners
+ * were closed), the kernel falls back to hashing.
+ */
+static int
+an_io_server_steer(struct an_io_server *server,
+    const struct an_io_listener *listener)
+{
+	struct sock_filter code[] = {
+		/* A = the current CPU */
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		/* A = A % num_threads */
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, server->num_threads },
+		/* Return the index of the socket in the reuseport group */
+		{ BPF_RET | BPF_A, 0, 0, 0 }
+	};
+	struct sock_fprog prog = {
+		.len = ARRAY_SIZE(code),
+		.filter = code
+	};
+	int ret;
+
+	ret = setsockopt(listener->io.fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+	    &prog, sizeof(prog));
+	if (ret != 0) {
+		an_syslog(LOG_WARNING, "Failed to attach reuseport steering "
+		    "program: %d (%s)", errno, an_strerror(errno));
+	}
+	return ret;
+}
+
 /* Configure the server to listen on the specified address and port. */
 int
 an_io_server_listen(struct an_io_server *server, const char *host,
     in_port_t port)
 {
+	struct an_io_thread *iotd;
 	unsigned int i;
 	int ret;
 
@@ -776,6 +1710,14 @@ an_io_server_listen(struct an_io_server *server, const char *host,
 			return -1;
 		}
 	}
+
+	if (server->steer_connections) {
+		/* The program applies to the whole reuseport group. */
+		iotd = &server->threads[0];
+		an_io_server_steer(server, *AN_ARRAY_VALUE(listener_list,
+		    &iotd->listeners, AN_ARRAY_LENGTH(listener_list,
+		    &iotd->listeners) - 1));
+	}
 	return 0;
 }
 
@@ -788,6 +1730,23 @@ an_io_thread_wakeup(const struct an_io_thread *iotd)
 	assert(ret == 0);
 }
 
+/*
+ * Let the I/O thread know it has work, unless it is busy polling and
+ * will notice anyway; see an_io_thread_poll().
+ */
+static void
+an_io_thread_notify(struct an_io_thread *iotd)
+{
+
+	/* Pairs with the fence in an_io_thread_poll(). */
+	ck_pr_fence_memory();
+	if (ck_pr_load_8(&iotd->polling) != 0) {
+		return;
+	}
+
+	an_io_thread_wakeup(iotd);
+}
+
 bool
 an_io_server_quiesce(struct an_io_server *server)
 {
@@ -815,6 +1774,62 @@ an_io_server_quiesce(struct an_io_server *server)
 	return true;
 }
 
+/* Convert an rdtsc timestamp to timer wheel ticks, rounding up. */
+static inline uint64_t
+an_io_ticks(uint64_t tsc)
+{
+
+	return (tsc + (1ULL << AN_IO_TICK_SHIFT) - 1) >> AN_IO_TICK_SHIFT;
+}
+
+/* The deadline of the request in progress, or 0 if there is none. */
+static uint64_t
+an_io_connection_deadline(const struct an_io_connection *conn)
+{
+	uint64_t timeout;
+
+	if (conn->iotd->request_timeout == 0) {
+		return 0;
+	}
+
+	timeout = ck_pr_load_64(&conn->timeout);
+	if (AN_CC_LIKELY(timeout == 0)) {
+		timeout = conn->iotd->request_timeout;
+	}
+
+	return conn->active->request_start + timeout;
+}
+
+/* Arm the request timer of an active connection. */
+static void
+an_io_connection_arm(struct an_io_connection *conn)
+{
+	uint64_t deadline;
+
+	deadline = an_io_connection_deadline(conn);
+	if (deadline == 0) {
+		an_wheel_remove(&conn->iotd->wheel, &conn->timer);
+		return;
+	}
+
+	an_wheel_add(&conn->iotd->wheel, &conn->timer, an_io_ticks(deadline));
+}
+
+/* Arm the idle timer of a connection waiting for its next request. */
+static void
+an_io_connection_arm_idle(struct an_io_connection *conn)
+{
+	struct an_io_thread *iotd;
+
+	iotd = conn->iotd;
+	if (iotd->idle_timeout == 0) {
+		return;
+	}
+
+	an_wheel_add(&iotd->wheel, &conn->timer,
+	    an_io_ticks(an_md_rdtsc() + iotd->idle_timeout));
+}
+
 /* Get a connection object from the free list. */
 static struct an_io_connection *
 an_io_connection_get(struct an_io_thread *iotd)
@@ -822,36 +1837,98 @@ an_io_connection_get(struct an_io_thread *iotd)
 	struct an_io_connection *conn;
 
 	conn = SLIST_FIRST(&iotd->free_conns);
-	if (conn == NULL) {
+	if (conn != NULL) {
+		SLIST_REMOVE_HEAD(&iotd->free_conns, free_next);
+	} else if (iotd->num_conns_used < iotd->max_total_connections) {
+		conn = &iotd->connections[iotd->num_conns_used++];
+		an_wheel_timer_init(&conn->timer);
+	} else {
 		return NULL;
 	}
 
-	SLIST_REMOVE_HEAD(&iotd->free_conns, free_next);
 	LIST_INSERT_HEAD(&iotd->idle_conns, conn, idle_next);
 	return conn;
 }
 
+/* Attach fresh active state to a connection that starts reading. */
+static bool
+an_io_connection_active_get(struct an_io_connection *conn)
+{
+	struct an_io_connection_active *active;
+	struct an_io_thread *iotd;
+
+	iotd = conn->iotd;
+	active = SLIST_FIRST(&iotd->free_actives);
+	if (active != NULL) {
+		SLIST_REMOVE_HEAD(&iotd->free_actives, free_next);
+		memset(active, 0, sizeof(*active));
+	} else {
+		active = an_calloc_object(an_io_connection_active_token);
+		if (AN_CC_UNLIKELY(active == NULL)) {
+			return false;
+		}
+	}
+
+	http_parser_init(&active->parser, HTTP_REQUEST);
+	active->parser.data = conn;
+	conn->active = active;
+	return true;
+}
+
+static void
+an_io_connection_active_put(struct an_io_connection *conn)
+{
+	struct an_io_thread *iotd;
+
+	if (conn->active == NULL) {
+		return;
+	}
+
+	iotd = conn->iotd;
+	SLIST_INSERT_HEAD(&iotd->free_actives, conn->active, free_next);
+	conn->active = NULL;
+}
+
 /* Reset a connection object so it can be reused. */
 static void
 an_io_connection_recycle(struct an_io_connection *conn)
 {
+	uint32_t i;
 
-	if (conn->state > HTTP_CONNECTION_IDLE) {
-		an_rtbr_end(&conn->rtbr_section);
+	/*
+	 * Cache the input buffer while our RTBR section still keeps its
+	 * bump region from being recycled; see an_io_inbuf_put().
+	 */
+	an_io_inbuf_put(conn->iotd, conn->inbuf);
+	conn->inbuf = NULL;
+	if (conn->h2 != NULL) {
+		/* Streams have their own sections, see an_io_h2_start(). */
+		an_io_h2_destroy(conn);
+	} else if (conn->state > HTTP_CONNECTION_IDLE) {
+		an_rtbr_end(&conn->active->rtbr_section);
 	}
-	memset(&conn->request, 0, sizeof(conn->request));
-	conn->request_start = 0;
+	an_wheel_remove(&conn->iotd->wheel, &conn->timer);
 	conn->timeout = 0;
-	conn->inbuf = NULL;
-	if (AN_CC_UNLIKELY(conn->outbuf != NULL &&
-	    conn->outbuf->external_allocation)) {
-		ck_pr_sub_64(&an_server_large_allocations,
-		    malloc_usable_size(conn->outbuf->data));
-		free(conn->outbuf->data);
-		free(conn->outbuf);
+	if (conn->active != NULL && conn->active->responses != NULL) {
+		/* Responses we received but never got to write. */
+		for (i = conn->active->pipeline_written;
+		    i < conn->pipeline_len; i++) {
+			if (conn->active->responses[i] != conn->outbuf) {
+				an_io_buffer_release(conn->active->responses[i]);
+			}
+		}
 	}
+	an_io_buffer_release(conn->outbuf);
 	conn->outbuf = NULL;
-	http_parser_init(&conn->parser, HTTP_REQUEST);
+	conn->pending = 0;
+	conn->pipeline_len = 0;
+	an_io_connection_active_put(conn);
+#ifdef AN_IO_KTLS
+	if (conn->ssl != NULL) {
+		SSL_free(conn->ssl);
+		conn->ssl = NULL;
+	}
+#endif
 }
 
 /* Dispose of a request object by putting it back on the free list. */
@@ -862,7 +1939,7 @@ an_io_connection_put(struct an_io_connection *conn)
 
 	iotd = conn->iotd;
 
-	assert(conn->state != HTTP_CONNECTION_PROCESSING);
+	assert(conn->pending == 0);
 	an_io_connection_recycle(conn);
 
 	if (conn->state != HTTP_CONNECTION_FREE) {
@@ -879,6 +1956,35 @@ an_io_connection_put(struct an_io_connection *conn)
 	}
 }
 
+/* Position of a request ID in its connection's pipeline. */
+static inline uint32_t
+an_io_connection_slot(const struct an_io_connection *conn, an_request_id_t rid)
+{
+	struct an_request_location loc;
+
+	loc = an_request_id_decode(rid);
+	return (loc.generation - conn->generation) & RID_GEN_MASK;
+}
+
+/*
+ * Phase timestamps of the request in @a slot. Workers get here through
+ * request IDs, while the request is pending.
+ */
+static inline struct an_io_request_times *
+an_io_connection_times(struct an_io_connection *conn, uint32_t slot)
+{
+
+	if (conn->h2 != NULL) {
+		return &conn->h2->streams[slot].times;
+	}
+
+	if (conn->active->pipeline_times != NULL) {
+		return &conn->active->pipeline_times[slot];
+	}
+
+	return &conn->active->times;
+}
+
 /* Locate the I/O thread corresponding to a request ID. */
 static inline struct an_io_thread *
 an_io_thread_select(struct an_io_server *server, an_request_id_t rid)
@@ -900,6 +2006,7 @@ an_io_thread_connection_select(struct an_io_thread *iotd, an_request_id_t rid)
 {
 	struct an_request_location loc;
 	struct an_io_connection *conn;
+	uint32_t slot;
 
 	loc = an_request_id_decode(rid);
 	if (AN_CC_UNLIKELY(loc.conn_idx >= iotd->max_total_connections)) {
@@ -908,8 +2015,14 @@ an_io_thread_connection_select(struct an_io_thread *iotd, an_request_id_t rid)
 		return NULL;
 	}
 
+	/*
+	 * Pipelined requests have generation numbers in
+	 * [conn->generation, conn->generation + pipeline_len).
+	 */
 	conn = &iotd->connections[loc.conn_idx];
-	if (AN_CC_UNLIKELY(conn->generation != loc.generation)) {
+	slot = an_io_connection_slot(conn, rid);
+	if (AN_CC_UNLIKELY(slot != 0 &&
+	    slot >= ck_pr_load_32(&conn->pipeline_len))) {
 		an_syslog(LOG_CRIT, "Invalid request ID (%#"PRIx64"): "
 		    "generation mismatch: %#"PRIx32" != %#"PRIx32, rid.id,
 		    loc.generation, conn->generation);
@@ -933,6 +2046,19 @@ an_io_connection_select(struct an_io_server *server, an_request_id_t id)
 	return an_io_thread_connection_select(iotd, id);
 }
 
+/* Whether the kernel may still be sending from the connection's buffers. */
+static inline bool
+an_io_connection_sending(const struct an_io_connection *conn)
+{
+
+#ifdef AN_IO_URING
+	return conn->sending > 0;
+#else
+	(void)conn;
+	return false;
+#endif
+}
+
 /* Forcibly close a connection that may be in-flight. */
 static void
 an_io_connection_close(struct an_io_connection *conn)
@@ -942,25 +2068,72 @@ an_io_connection_close(struct an_io_connection *conn)
 		return;
 	}
 
+#ifdef AN_IO_URING
+	if (an_io_connection_sending(conn)) {
+		/*
+		 * Linked sends look the socket up when they start: keep
+		 * it open until the chain is over, see an_io_uring_sent().
+		 */
+		an_io_uring_cancel_send(conn);
+		AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_CLOSING);
+		an_wheel_remove(&conn->iotd->wheel, &conn->timer);
+		return;
+	}
+#endif
+
 	an_io_deinit(conn->iotd, &conn->io);
-	if (conn->state == HTTP_CONNECTION_PROCESSING) {
+	if (conn->pending > 0) {
 		/*
 		 * The connection is currently being processed by a
 		 * worker thread. We mark it as closing, and will
-		 * recycle it once we have gotten a response.
+		 * recycle it once we have gotten all the responses.
 		 */
 		AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_CLOSING);
+		an_wheel_remove(&conn->iotd->wheel, &conn->timer);
 		return;
 	}
 	an_io_connection_put(conn);
 }
 
+/*
+ * Allocate the pipelining state for a connection that is about to
+ * start reading, if pipelining is enabled.
+ */
+static bool
+an_io_pipeline_alloc(struct an_io_connection *conn)
+{
+	uint32_t depth;
+
+	depth = conn->iotd->pipeline_depth;
+	if (depth <= 1) {
+		return true;
+	}
+
+	conn->active->pipeline = an_pool_alloc(&input,
+	    depth * sizeof(struct an_http_request), false, 8);
+	conn->active->responses = an_pool_alloc(&input,
+	    depth * sizeof(struct an_buffer *), true, 8);
+	conn->active->pipeline_times = an_pool_alloc(&input,
+	    depth * sizeof(struct an_io_request_times), false, 8);
+	if (AN_CC_UNLIKELY(conn->active->pipeline == NULL ||
+	    conn->active->responses == NULL ||
+	    conn->active->pipeline_times == NULL)) {
+		conn->active->pipeline = NULL;
+		conn->active->responses = NULL;
+		conn->active->pipeline_times = NULL;
+		return false;
+	}
+
+	return true;
+}
+
 /*
  * Try to transition a connection to the active state.
  *
  * This function checks that we do not exceed the maximum number of
- * active connections, allocates a buffer for input, and transitions the
- * state from HTTP_CONNECTION_IDLE to HTTP_CONNECTION_READING.
+ * active connections, allocates a buffer for input along with the
+ * active state, and transitions the state from HTTP_CONNECTION_IDLE to
+ * HTTP_CONNECTION_READING.
  */
 static bool
 an_io_connection_preread(struct an_io_connection *conn)
@@ -1001,6 +2174,15 @@ an_io_connection_preread(struct an_io_connection *conn)
 	 */
 	ret = ioctl(io->fd, FIONREAD, &ready_bytes);
 	assert(ret == 0);
+	if (ready_bytes == 0 && conn->tls && an_io_readable(io)) {
+		/*
+		 * kTLS may already have pulled records off the TCP receive
+		 * queue, where FIONREAD doesn't see them. We'll grow the
+		 * buffer if needed.
+		 */
+		ready_bytes = TLS_MIN_READ;
+	}
+
 	if (ready_bytes == 0) {
 		if (conn->remote_closed) {
 			an_io_connection_close(conn);
@@ -1014,8 +2196,10 @@ an_io_connection_preread(struct an_io_connection *conn)
 	iotd = conn->iotd;
 
 	ts = an_rtbr_prepare();
-	conn->inbuf = an_pool_get(&input, need);
-	if (AN_CC_UNLIKELY(conn->inbuf == NULL)) {
+	conn->inbuf = an_io_inbuf_get(iotd, need);
+	if (AN_CC_UNLIKELY(conn->inbuf == NULL ||
+	    !an_io_connection_active_get(conn) ||
+	    !an_io_pipeline_alloc(conn))) {
 		an_syslog(LOG_CRIT, "Inqueue allocation failure, "
 		    "failed to allocate %zu bytes.", need);
 		an_io_connection_close(conn);
@@ -1023,60 +2207,337 @@ an_io_connection_preread(struct an_io_connection *conn)
 		return false;
 	}
 
-	an_rtbr_begin(&conn->rtbr_section, ts, "an_io_server");
+	an_rtbr_begin(&conn->active->rtbr_section, ts, "an_io_server");
 	an_io_stat_inc(iotd, AN_IO_ACTIVE_CONNS);
 	LIST_REMOVE(conn, idle_next);
 	AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_READING);
-	conn->request_start = an_md_rdtsc();
+	conn->active->request_start = an_md_rdtsc();
+	an_io_connection_arm(conn);
 	LIST_INSERT_HEAD(&iotd->active_conns, conn, active_next);
 	return true;
 }
 
+/* Whether we have a batch of pipelined requests ready to go. */
+static inline bool
+an_io_pipeline_ready(const struct an_io_connection *conn)
+{
+
+	return conn->pipeline_len > 0 &&
+	    (conn->pipeline_len == conn->iotd->pipeline_depth ||
+	    !conn->keepalive);
+}
+
 /*
- * Try to read more data from this connection.
- *
- * This is called whenever epoll notifies us that there is data to be
- * read, but also right after we accept a new connection: in that case,
- * it is quite possible that there already is data to be read, so we
- * want to give it a try. If there actually was no data, we will just
- * register this socket for reads in epoll.
+ * Stash the complete request in the pipeline; it ends at @a end in the
+ * input buffer. Messages are contiguous in the input buffer, so the
+ * request spans from the end of the previous one. Offsets are rebased
+ * in an_io_connection_dispatch().
  */
 static void
-an_io_connection_read(struct an_io_connection *conn)
+an_io_pipeline_push(struct an_io_connection *conn, const char *end)
 {
-	struct an_io_server *server;
-	struct an_io_thread *iotd;
 	struct an_http_request *req;
-	struct an_io *io;
-	struct an_buffer *buf;
-	ssize_t nbytes, nparsed, left;
-	http_parser *parser;
-	char *data;
-	int ret;
-	bool success;
 
-	iotd = conn->iotd;
-	server = iotd->server;
-	io = &conn->io;
+	req = &conn->active->pipeline[conn->pipeline_len++];
+	*req = conn->active->request;
+	conn->active->pipeline_end = end - conn->inbuf->data;
+	req->total_len = conn->active->pipeline_end;
+	memset(&conn->active->request, 0, sizeof(conn->active->request));
+}
 
-	if (an_io_connection_preread(conn) == false) {
-		return;
+/*
+ * Try to parse a simple request at the start of @a data without
+ * http_parser; see an_http_scan.h. This only works at a message
+ * boundary, and without pipelining, only if @a data holds exactly one
+ * request, like http_parser would leave things.
+ *
+ * Returns the number of bytes consumed, 0 to fall back to http_parser.
+ */
+static size_t
+an_io_connection_scan(struct an_io_connection *conn, const char *data,
+    size_t len)
+{
+	struct an_http_scan scan;
+	struct an_http_request *req;
+
+	if (data != conn->inbuf->data + conn->active->pipeline_end) {
+		return 0;
 	}
 
-	assert(conn->state == HTTP_CONNECTION_READING);
-	buf = conn->inbuf;
-	assert(buf != NULL);
+	if (an_http_scan_request(data, len, &scan) == false) {
+		return 0;
+	}
 
-again:
-	if (buf->in == buf->size) {
-		success = an_pool_grow(buf);
-		if (success == false) {
-			an_syslog(LOG_CRIT, "Cannot grow buffer per policy. "
-			    "Dropping request.");
-			an_io_connection_close(conn);
-			an_io_stat_inc(iotd, AN_IO_OOM_FAILURES);
+	if (conn->active->pipeline == NULL && scan.total_len != len) {
+		return 0;
+	}
+
+	req = &conn->active->request;
+	req->uri_offset = (data + scan.uri_offset) - conn->inbuf->data;
+	req->uri_len = scan.uri_len;
+	if (scan.keepalive == false) {
+		conn->keepalive = false;
+	}
+
+	if (conn->active->pipeline != NULL) {
+		an_io_pipeline_push(conn, data + scan.total_len);
+	} else {
+		AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_PROCESSING);
+	}
+
+	an_io_stat_inc(conn->iotd, AN_IO_SCANNED_REQUESTS);
+	return scan.total_len;
+}
+
+/*
+ * Feed freshly read bytes to the HTTP parser.
+ *
+ * Without pipelining, on_message_complete() transitions the connection
+ * to the processing state. With pipelining, the parser pauses after
+ * every message, and we stash the complete request in the pipeline
+ * until the batch is dispatched by an_io_connection_dispatch().
+ *
+ * Returns false if the request is malformed, in which case the
+ * connection has been closed.
+ */
+static bool
+an_io_connection_parse(struct an_io_connection *conn, const char *data,
+    size_t len)
+{
+	struct an_io_server *server;
+	struct an_io_thread *iotd;
+	http_parser *parser;
+	size_t nparsed;
+
+	iotd = conn->iotd;
+	server = iotd->server;
+	parser = &conn->active->parser;
+
+	while (len > 0) {
+		nparsed = an_io_connection_scan(conn, data, len);
+		if (nparsed > 0) {
+			data += nparsed;
+			len -= nparsed;
+			if (an_io_pipeline_ready(conn)) {
+				return true;
+			}
+
+			continue;
+		}
+
+		nparsed = http_parser_execute(parser, &server->parser_settings,
+		    data, len);
+		if (HTTP_PARSER_ERRNO(parser) == HPE_PAUSED) {
+			http_parser_pause(parser, 0);
+			an_io_pipeline_push(conn, data + nparsed);
+		} else if (nparsed != len) {
+			break;
+		}
+
+		if (parser->upgrade) {
+			break;
+		}
+
+		data += nparsed;
+		len -= nparsed;
+		if (an_io_pipeline_ready(conn)) {
+			/* Leave the rest for the next batch. */
+			return true;
+		}
+	}
+
+	if (len == 0 && !parser->upgrade) {
+		return true;
+	}
+
+	if (parser->upgrade) {
+		an_syslog(LOG_CRIT, "Invalid HTTP request: "
+		    "unexpected upgrade request");
+	} else {
+		an_syslog(LOG_CRIT, "Invalid HTTP request: %s",
+		    http_errno_description(parser->http_errno));
+	}
+	an_io_connection_close(conn);
+	an_io_stat_inc(iotd, AN_IO_MALFORMED_REQS);
+	return false;
+}
+
+/* Parse the URL of a request, which must at least have a path. */
+static bool
+an_io_request_parse_url(struct an_http_request *req)
+{
+	int ret;
+
+	ret = http_parser_parse_url(req->buffer + req->uri_offset,
+	    req->uri_len, 0, &req->url);
+	if (ret != 0 || (req->url.field_set & (1U << UF_PATH)) == 0) {
+		an_syslog(LOG_CRIT, "Malformed request: Invalid URL: %.*s",
+		    (int)req->uri_len, req->buffer + req->uri_offset);
+		return false;
+	}
+
+	return true;
+}
+
+/* Finalize a parsed request and validate its URL. */
+static bool
+an_io_request_finalize(struct an_io_connection *conn,
+    struct an_http_request *req, uint32_t slot)
+{
+	struct an_io_thread *iotd;
+
+	iotd = conn->iotd;
+	an_request_id_encode(&req->id, iotd, conn, slot);
+	req->start = conn->active->request_start;
+	if (!an_io_request_parse_url(req)) {
+		an_io_connection_close(conn);
+		an_io_stat_inc(iotd, AN_IO_MALFORMED_REQS);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Hand over every request read so far to worker threads.
+ *
+ * Without pipelining, this is the single request embedded in the
+ * connection. With pipelining, this is the batch of complete requests
+ * in the pipeline; any trailing bytes past the last complete request
+ * are parsed again once we are done writing the responses for this
+ * batch, see an_io_connection_carry_over().
+ */
+static void
+an_io_connection_dispatch(struct an_io_connection *conn)
+{
+	struct an_io_thread *iotd;
+	struct an_http_request *req;
+	struct an_buffer *buf;
+	uint32_t i, start, end;
+	uint64_t now;
+	bool success;
+
+	iotd = conn->iotd;
+	buf = conn->inbuf;
+
+	if (conn->active->pipeline == NULL) {
+		assert(conn->state == HTTP_CONNECTION_PROCESSING);
+		req = &conn->active->request;
+		req->buffer = buf->data;
+		req->total_len = buf->in;
+		if (!an_io_request_finalize(conn, req, 0)) {
+			return;
+		}
+
+		an_io_subscribe(iotd, &conn->io, 0);
+		conn->pending = 1;
+		conn->active->times.enqueued = an_md_rdtsc();
+		an_io_latency_add(iotd, AN_IO_PHASE_READ,
+		    conn->active->request_start, conn->active->times.enqueued);
+		success = CK_RING_ENQUEUE_SPMC(requests, &iotd->requests_fifo,
+		    iotd->requests_buffer, req);
+		assert(success == true);
+		an_io_stat_inc(iotd, AN_IO_NUM_REQUESTS);
+		return;
+	}
+
+	assert(conn->state == HTTP_CONNECTION_READING);
+	assert(conn->pipeline_len > 0);
+
+	start = 0;
+	for (i = 0; i < conn->pipeline_len; i++) {
+		req = &conn->active->pipeline[i];
+		end = req->total_len;
+		req->buffer = buf->data + start;
+		req->total_len = end - start;
+		req->uri_offset -= start;
+		if (req->body_offset != 0) {
+			req->body_offset -= start;
+		}
+		if (!an_io_request_finalize(conn, req, i)) {
 			return;
 		}
+		start = end;
+	}
+
+	AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_PROCESSING);
+	an_io_subscribe(iotd, &conn->io, 0);
+	conn->pending = conn->pipeline_len;
+	conn->active->pipeline_written = 0;
+	now = an_md_rdtsc();
+	an_io_latency_add(iotd, AN_IO_PHASE_READ,
+	    conn->active->request_start, now);
+	for (i = 0; i < conn->pipeline_len; i++) {
+		conn->active->pipeline_times[i].enqueued = now;
+		success = CK_RING_ENQUEUE_SPMC(requests, &iotd->requests_fifo,
+		    iotd->requests_buffer, &conn->active->pipeline[i]);
+		assert(success == true);
+		an_io_stat_inc(iotd, AN_IO_NUM_REQUESTS);
+	}
+}
+
+/*
+ * Try to read more data from this connection.
+ *
+ * This is called whenever epoll notifies us that there is data to be
+ * read, but also right after we accept a new connection: in that case,
+ * it is quite possible that there already is data to be read, so we
+ * want to give it a try. If there actually was no data, we will just
+ * register this socket for reads in epoll.
+ */
+static void
+an_io_connection_read(struct an_io_connection *conn)
+{
+	struct an_io_thread *iotd;
+	struct an_io *io;
+	struct an_buffer *buf;
+	ssize_t nbytes, left;
+	size_t want, prefix;
+	char *data;
+	bool success;
+
+	iotd = conn->iotd;
+	io = &conn->io;
+
+#ifdef AN_IO_KTLS
+	if (AN_CC_UNLIKELY(conn->ssl != NULL)) {
+		an_io_connection_handshake(conn);
+		return;
+	}
+#endif
+
+	if (an_io_connection_preread(conn) == false) {
+		return;
+	}
+
+	assert(conn->state == HTTP_CONNECTION_READING);
+	buf = conn->inbuf;
+	assert(buf != NULL);
+
+again:
+	if (an_io_pipeline_ready(conn)) {
+		an_io_connection_dispatch(conn);
+		return;
+	}
+
+	/*
+	 * Size the buffer for the whole body when we know how long it is,
+	 * rather than doubling it (and copying) as it trickles in.
+	 */
+	success = true;
+	want = an_io_connection_body_end(conn);
+	if (want > buf->size) {
+		success = an_pool_grow_to(buf, want);
+	} else if (buf->in == buf->size) {
+		success = an_pool_grow(buf);
+	}
+
+	if (success == false) {
+		an_syslog(LOG_CRIT, "Cannot grow buffer per policy. "
+		    "Dropping request.");
+		an_io_connection_close(conn);
+		an_io_stat_inc(iotd, AN_IO_OOM_FAILURES);
+		return;
 	}
 	data = buf->data + buf->in;
 	left = buf->size - buf->in;
@@ -1086,8 +2547,28 @@ again:
 		nbytes = read(io->fd, data, left);
 	} while (nbytes == -1 && errno == EINTR);
 
+	if (nbytes == -1 && errno == EIO && conn->tls) {
+		/*
+		 * kTLS fails reads on records that aren't application
+		 * data; the only ones we expect are alerts, i.e., the
+		 * client going away. That's only fine between requests.
+		 */
+		if (buf->in == 0 && conn->pipeline_len == 0) {
+			an_io_connection_close(conn);
+			return;
+		}
+
+		nbytes = 0;
+	}
+
 	if (nbytes == -1) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			if (conn->pipeline_len > 0) {
+				/* Don't hold complete requests hostage. */
+				an_io_connection_dispatch(conn);
+				return;
+			}
+
 			an_io_subscribe(iotd, &conn->io, EPOLLIN);
 			return;
 		}
@@ -1105,6 +2586,16 @@ again:
 	}
 
 	if (nbytes == 0) {
+		if (conn->pipeline_len > 0) {
+			/*
+			 * The client is done sending requests; answer
+			 * the complete ones and close the connection.
+			 */
+			conn->remote_closed = true;
+			an_io_connection_dispatch(conn);
+			return;
+		}
+
 		/*
 		 * An HTTP parser always knows whether it has fully read an
 		 * HTTP request or not: if the request doesn't have a body,
@@ -1125,133 +2616,1750 @@ again:
 		return;
 	}
 
-	buf->in += nbytes;
+	buf->in += nbytes;
+
+	if (AN_CC_UNLIKELY(conn->h2_candidate)) {
+		/* Everything read so far may be part of the h2 preface. */
+		prefix = min(buf->in, AN_H2_PREFACE_LEN);
+		if (memcmp(buf->data, AN_H2_PREFACE, prefix) == 0) {
+			if (prefix < AN_H2_PREFACE_LEN) {
+				goto again;
+			}
+
+			conn->h2_candidate = false;
+			an_io_h2_start(conn);
+			return;
+		}
+
+		/* HTTP/1.x after all: parse what we held back too. */
+		conn->h2_candidate = false;
+		data = buf->data;
+		nbytes = buf->in;
+	}
+
+	if (!an_io_connection_parse(conn, data, nbytes)) {
+		return;
+	}
+
+	/*
+	 * If the request has been read entirely, state transition will happen
+	 * within the on_message_complete callback of the HTTP parser.
+	 */
+	if (conn->state == HTTP_CONNECTION_READING) {
+		/* Not done; try to read some more bytes. */
+		goto again;
+	}
+
+	an_io_connection_dispatch(conn);
+}
+
+#ifdef AN_IO_KTLS
+/*
+ * Drive the TLS handshake of an idle connection as the socket becomes
+ * readable or writable, and hand the session over to the kernel once
+ * it is done. From then on, the connection is just like any other.
+ */
+static void
+an_io_connection_handshake(struct an_io_connection *conn)
+{
+	struct an_io_thread *iotd;
+	SSL *ssl;
+	int ret;
+
+	iotd = conn->iotd;
+	ssl = conn->ssl;
+	assert(conn->state == HTTP_CONNECTION_IDLE);
+
+	ERR_clear_error();
+	ret = SSL_accept(ssl);
+	if (ret != 1) {
+		switch (SSL_get_error(ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			an_io_subscribe(iotd, &conn->io, EPOLLIN);
+			return;
+		case SSL_ERROR_WANT_WRITE:
+			an_io_subscribe(iotd, &conn->io, EPOLLOUT);
+			return;
+		default:
+			/* Most likely a client going away or a scanner. */
+			goto fail;
+		}
+	}
+
+	/* OpenSSL quietly stays in user space when it can't offload. */
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)) == 0 ||
+	    BIO_get_ktls_recv(SSL_get_rbio(ssl)) == 0) {
+		an_syslog(LOG_CRIT, "Failed to offload TLS connection "
+		    "to the kernel, cipher: %s", SSL_get_cipher_name(ssl));
+		goto fail;
+	}
+
+	/* The socket BIO doesn't own the file descriptor. */
+	SSL_free(ssl);
+	conn->ssl = NULL;
+	an_io_connection_read(conn);
+	return;
+
+fail:
+	an_io_connection_close(conn);
+	an_io_stat_inc(iotd, AN_IO_TLS_FAILURES);
+}
+#endif
+
+/*
+ * Start a new batch of pipelined requests with the bytes we read past
+ * the end of the previous batch. We copy them over to a fresh input
+ * buffer and parse them again, as the old buffer and parser state
+ * can't outlive the previous batch.
+ */
+static void
+an_io_connection_carry_over(struct an_io_connection *conn)
+{
+	struct an_rtbr_timestamp ts;
+	struct an_io_thread *iotd;
+	struct an_buffer *old;
+	size_t len;
+
+	iotd = conn->iotd;
+	old = conn->inbuf;
+	len = old->in - conn->active->pipeline_end;
+
+	ts = an_rtbr_prepare();
+	conn->inbuf = an_io_inbuf_get(iotd, next_power_of_2(len));
+	if (AN_CC_UNLIKELY(conn->inbuf == NULL)) {
+		an_syslog(LOG_CRIT, "Inqueue allocation failure, "
+		    "failed to allocate %zu bytes.", len);
+		conn->inbuf = old;
+		an_io_connection_close(conn);
+		an_io_stat_inc(iotd, AN_IO_OOM_FAILURES);
+		return;
+	}
+
+	memcpy(conn->inbuf->data, old->data + conn->active->pipeline_end, len);
+	conn->inbuf->in = len;
+	an_io_inbuf_put(iotd, old);
+
+	/* Everything else belongs to the previous batch. */
+	an_rtbr_end(&conn->active->rtbr_section);
+	an_rtbr_begin(&conn->active->rtbr_section, ts, "an_io_server");
+	memset(&conn->active->request, 0, sizeof(conn->active->request));
+	conn->timeout = 0;
+	conn->pipeline_len = 0;
+	conn->active->pipeline_written = 0;
+	conn->active->pipeline_end = 0;
+	if (!an_io_pipeline_alloc(conn)) {
+		an_io_connection_close(conn);
+		an_io_stat_inc(iotd, AN_IO_OOM_FAILURES);
+		return;
+	}
+	conn->active->reading_body = false;
+	http_parser_init(&conn->active->parser, HTTP_REQUEST);
+
+	AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_READING);
+	conn->active->request_start = an_md_rdtsc();
+	an_io_connection_arm(conn);
+	if (!an_io_connection_parse(conn, conn->inbuf->data, len)) {
+		return;
+	}
+
+	an_io_connection_read(conn);
+}
+
+/*
+ * Move on to the next pipelined response once the current one has
+ * been written. Returns true if there is more work left in this batch.
+ */
+static bool
+an_io_pipeline_advance(struct an_io_connection *conn)
+{
+	struct an_buffer *next;
+
+	an_io_buffer_release(conn->outbuf);
+	conn->outbuf = NULL;
+	conn->active->responses[conn->active->pipeline_written++] = NULL;
+	if (conn->active->pipeline_written == conn->pipeline_len) {
+		return false;
+	}
+
+	next = conn->active->responses[conn->active->pipeline_written];
+	if (next == NULL) {
+		/* Wait for the worker threads to catch up. */
+		AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_PROCESSING);
+		an_io_subscribe(conn->iotd, &conn->io, 0);
+		return true;
+	}
+
+	conn->outbuf = next;
+	return true;
+}
+
+/*
+ * Gather the unwritten fragments of the current response and, with
+ * pipelining, of the responses ready to go right after it. If @a msg
+ * is not NULL, it also gets one message per response, over @a iov, and
+ * @a nmsg their number.
+ */
+static int
+an_io_connection_gather(const struct an_io_connection *conn,
+    struct iovec *iov, int max, struct msghdr *msg, int *nmsg)
+{
+	const struct an_buffer *buf;
+	uint32_t i;
+	int first, n;
+
+	n = 0;
+	buf = conn->outbuf;
+	i = conn->active->pipeline_written;
+	if (nmsg != NULL) {
+		*nmsg = 0;
+	}
+	while (buf != NULL && n < max) {
+		first = n;
+		for (; buf != NULL && n < max; buf = buf->next) {
+			if (buf->out == buf->in) {
+				continue;
+			}
+
+			iov[n].iov_base = buf->data + buf->out;
+			iov[n].iov_len = buf->in - buf->out;
+			n++;
+		}
+
+		if (msg != NULL && n > first) {
+			memset(&msg[*nmsg], 0, sizeof(*msg));
+			msg[*nmsg].msg_iov = &iov[first];
+			msg[*nmsg].msg_iovlen = n - first;
+			(*nmsg)++;
+		}
+
+		if (conn->active->pipeline == NULL ||
+		    ++i >= conn->pipeline_len) {
+			break;
+		}
+		buf = conn->active->responses[i];
+	}
+
+	return n;
+}
+
+/*
+ * Account for @a nbytes written from the response chain @a buf.
+ * Returns true if the whole response has been written, and updates
+ * @a nbytes to the number of bytes left for the next response.
+ */
+static bool
+an_io_response_consume(struct an_buffer *buf, size_t *nbytes)
+{
+	size_t len;
+
+	for (; buf != NULL; buf = buf->next) {
+		len = min(*nbytes, buf->in - buf->out);
+		buf->out += len;
+		*nbytes -= len;
+		if (buf->out < buf->in) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Account for @a nbytes written, and move on once the response is out.
+ * Returns false if there is more to write.
+ */
+static bool
+an_io_connection_written(struct an_io_connection *conn, size_t nbytes)
+{
+	struct an_io_thread *iotd;
+	size_t left;
+
+	iotd = conn->iotd;
+	left = nbytes;
+	for (;;) {
+		if (!an_io_response_consume(conn->outbuf, &left)) {
+			/* Not done; try to write some more bytes. */
+			return false;
+		}
+
+		if (conn->active->pipeline == NULL ||
+		    !an_io_pipeline_advance(conn)) {
+			break;
+		}
+
+		if (conn->state != HTTP_CONNECTION_WRITING) {
+			/* Waiting on the next response. */
+			assert(left == 0);
+			return true;
+		}
+	}
+
+	/* We're done writing the response. */
+	an_io_latency_add(iotd, AN_IO_PHASE_WRITE, conn->active->responded,
+	    an_md_rdtsc());
+	if (conn->keepalive && !conn->remote_closed && !iotd->quiesce) {
+		if (conn->active->pipeline != NULL &&
+		    conn->active->pipeline_end < conn->inbuf->in) {
+			an_io_connection_carry_over(conn);
+			return true;
+		}
+
+		LIST_REMOVE(conn, active_next);
+		an_io_stat_dec(iotd, AN_IO_ACTIVE_CONNS);
+		an_io_connection_recycle(conn);
+		AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_IDLE);
+		LIST_INSERT_HEAD(&iotd->idle_conns, conn, idle_next);
+		an_io_connection_arm_idle(conn);
+		an_io_connection_read(conn);
+	} else {
+		an_io_connection_close(conn);
+	}
+
+	return true;
+}
+
+/* The counterpart of an_io_connection_read(). */
+static void
+an_io_connection_write(struct an_io_connection *conn)
+{
+	struct iovec iov[MAX_WRITE_IOVECS];
+	struct an_io_thread *iotd;
+	struct an_io *io;
+	ssize_t nbytes;
+	int niov;
+
+	iotd = conn->iotd;
+	io = &conn->io;
+
+	assert(conn->state == HTTP_CONNECTION_WRITING);
+
+#ifdef AN_IO_URING
+	if (iotd->uring) {
+		an_io_uring_send(conn);
+		return;
+	}
+#endif
+
+again:
+	niov = an_io_connection_gather(conn, iov, ARRAY_SIZE(iov), NULL, NULL);
+	do {
+		nbytes = writev(io->fd, iov, niov);
+	} while (nbytes == -1 && errno == EINTR);
+
+	if (nbytes == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			an_io_subscribe(conn->iotd,
+			    &conn->io, EPOLLOUT);
+			return;
+		}
+
+		if (errno != EPIPE) {
+			an_syslog(LOG_CRIT, "Unexpected write error: %d (%s)",
+			    errno, an_strerror(errno));
+			an_io_stat_inc(iotd, AN_IO_WRITE_ERRORS);
+		} else {
+			an_io_stat_inc(iotd, AN_IO_RESET_BY_PEER);
+		}
+
+		an_io_connection_close(conn);
+		return;
+	}
+
+	if (!an_io_connection_written(conn, nbytes)) {
+		goto again;
+	}
+}
+
+/* Make room for @a n more bytes past @a len in a growable h2 buffer. */
+static void *
+an_io_h2_grow(void *data, size_t *size, size_t len, size_t n)
+{
+	size_t want;
+
+	want = len + n;
+	if (want <= *size) {
+		return data;
+	}
+
+	want = next_power_of_2(want);
+	data = an_realloc_region(an_io_h2_buffer_token, data, *size, want);
+	*size = want;
+	return data;
+}
+
+static inline size_t
+an_io_h2_output(const struct an_io_h2 *h2)
+{
+
+	return h2->wlen - h2->wout;
+}
+
+/* Append a frame to the output buffer. */
+static void
+an_io_h2_queue(struct an_io_h2 *h2, enum an_h2_frame_type type,
+    uint8_t flags, uint32_t stream, const void *payload, size_t len)
+{
+	uint8_t *p;
+
+	if (h2->wout > 0 && h2->wsize - h2->wlen < AN_H2_FRAME_HEADER_LEN + len) {
+		memmove(h2->wbuf, h2->wbuf + h2->wout, an_io_h2_output(h2));
+		h2->wlen -= h2->wout;
+		h2->wout = 0;
+	}
+
+	h2->wbuf = an_io_h2_grow(h2->wbuf, &h2->wsize, h2->wlen,
+	    AN_H2_FRAME_HEADER_LEN + len);
+	p = h2->wbuf + h2->wlen;
+	an_h2_frame_write(p, len, type, flags, stream);
+	if (len > 0) {
+		memcpy(p + AN_H2_FRAME_HEADER_LEN, payload, len);
+	}
+	h2->wlen += AN_H2_FRAME_HEADER_LEN + len;
+}
+
+static void
+an_io_h2_window_update(struct an_io_h2 *h2, uint32_t stream, uint32_t increment)
+{
+	uint8_t payload[4];
+
+	an_h2_write32(payload, increment);
+	an_io_h2_queue(h2, AN_H2_WINDOW_UPDATE, 0, stream, payload,
+	    sizeof(payload));
+}
+
+/* Stop accepting new streams, letting the client know. */
+static void
+an_io_h2_goaway(struct an_io_h2 *h2, enum an_h2_error code)
+{
+	uint8_t payload[8];
+
+	h2->goaway = true;
+	if (h2->goaway_sent) {
+		return;
+	}
+
+	an_h2_write32(payload, h2->last_stream);
+	an_h2_write32(payload + 4, code);
+	an_io_h2_queue(h2, AN_H2_GOAWAY, 0, 0, payload, sizeof(payload));
+	h2->goaway_sent = true;
+}
+
+static struct an_io_h2_stream *
+an_io_h2_stream_find(struct an_io_h2 *h2, uint32_t id)
+{
+	uint32_t i;
+
+	for (i = 0; i < h2->max_streams; i++) {
+		if (h2->streams[i].id == id) {
+			return &h2->streams[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Arm the connection's timer: request deadline from the oldest open
+ * stream, or idle timeout once there are none.
+ */
+static void
+an_io_h2_arm(struct an_io_connection *conn)
+{
+	struct an_io_h2 *h2;
+	uint64_t start;
+	uint32_t i;
+
+	h2 = conn->h2;
+	if (h2->active == 0) {
+		conn->timeout = 0;
+		an_wheel_remove(&conn->iotd->wheel, &conn->timer);
+		an_io_connection_arm_idle(conn);
+		return;
+	}
+
+	start = UINT64_MAX;
+	for (i = 0; i < h2->max_streams; i++) {
+		if (h2->streams[i].state != H2_STREAM_FREE) {
+			start = min(start, h2->streams[i].start);
+		}
+	}
+
+	conn->active->request_start = start;
+	an_io_connection_arm(conn);
+}
+
+static void
+an_io_h2_stream_close(struct an_io_connection *conn,
+    struct an_io_h2_stream *stream)
+{
+	struct an_io_h2 *h2;
+
+	h2 = conn->h2;
+	assert(stream->state != H2_STREAM_FREE);
+	if (stream->queued) {
+		TAILQ_REMOVE(&h2->sendq, stream, send_next);
+		stream->queued = false;
+	}
+
+	/* As in an_io_connection_recycle(), cache before leaving RTBR. */
+	an_io_inbuf_put(conn->iotd, stream->inbuf);
+	stream->inbuf = NULL;
+	an_io_buffer_release(stream->response);
+	stream->response = NULL;
+	stream->cursor = NULL;
+	an_rtbr_end(&stream->rtbr_section);
+	stream->state = H2_STREAM_FREE;
+	stream->id = 0;
+	stream->reset = false;
+	h2->active--;
+	an_io_h2_arm(conn);
+}
+
+/*
+ * Reset a stream, which may be closed already. A stream a worker is
+ * processing keeps its slot until we get (and drop) the response.
+ */
+static void
+an_io_h2_reset(struct an_io_connection *conn, uint32_t id,
+    enum an_h2_error code)
+{
+	struct an_io_h2_stream *stream;
+	uint8_t payload[4];
+
+	an_h2_write32(payload, code);
+	an_io_h2_queue(conn->h2, AN_H2_RST_STREAM, 0, id, payload,
+	    sizeof(payload));
+	stream = an_io_h2_stream_find(conn->h2, id);
+	if (stream == NULL) {
+		return;
+	}
+
+	if (stream->state == H2_STREAM_DISPATCHED) {
+		stream->reset = true;
+		return;
+	}
+
+	an_io_h2_stream_close(conn, stream);
+}
+
+/* Connection error: say goodbye, close, and return false. */
+static bool
+an_io_h2_fail(struct an_io_connection *conn, enum an_h2_error code)
+{
+	struct an_io_h2 *h2;
+	ssize_t nbytes;
+
+	h2 = conn->h2;
+	an_io_h2_goaway(h2, code);
+	/* Best effort, we are closing anyway. */
+	nbytes = write(conn->io.fd, h2->wbuf + h2->wout, an_io_h2_output(h2));
+	(void)nbytes;
+	an_io_connection_close(conn);
+	if (code != AN_H2_NO_ERROR) {
+		an_io_stat_inc(conn->iotd, AN_IO_MALFORMED_REQS);
+	}
+
+	return false;
+}
+
+static void
+an_io_h2_send_queue(struct an_io_h2 *h2, struct an_io_h2_stream *stream)
+{
+
+	if (stream->state == H2_STREAM_SENDING && !stream->queued &&
+	    stream->send_window > 0) {
+		TAILQ_INSERT_TAIL(&h2->sendq, stream, send_next);
+		stream->queued = true;
+	}
+}
+
+/*
+ * Copy response bodies into DATA frames, round-robin across streams,
+ * until the output buffer or the connection's send window is full.
+ */
+static void
+an_io_h2_fill(struct an_io_connection *conn)
+{
+	struct an_io_h2_stream *stream;
+	struct an_buffer *buf;
+	struct an_io_h2 *h2;
+	size_t len;
+	uint8_t flags;
+
+	h2 = conn->h2;
+	while (an_io_h2_output(h2) < H2_OUTPUT_LOW && h2->send_window > 0 &&
+	    (stream = TAILQ_FIRST(&h2->sendq)) != NULL) {
+		TAILQ_REMOVE(&h2->sendq, stream, send_next);
+		stream->queued = false;
+		if (stream->send_window <= 0) {
+			/* Queued again by WINDOW_UPDATE. */
+			continue;
+		}
+
+		buf = stream->cursor;
+		while (buf->out == buf->in) {
+			buf = buf->next;
+		}
+
+		len = min(buf->in - buf->out, (size_t)h2->max_frame_size);
+		len = min(len, (size_t)min(h2->send_window, stream->send_window));
+		stream->left -= len;
+		flags = stream->left == 0 ? AN_H2_FLAG_END_STREAM : 0;
+		an_io_h2_queue(h2, AN_H2_DATA, flags, stream->id,
+		    buf->data + buf->out, len);
+		buf->out += len;
+		stream->cursor = buf;
+		h2->send_window -= len;
+		stream->send_window -= len;
+		if (stream->left == 0) {
+			an_io_latency_add(conn->iotd, AN_IO_PHASE_WRITE,
+			    stream->responded, an_md_rdtsc());
+			an_io_h2_stream_close(conn, stream);
+			continue;
+		}
+
+		an_io_h2_send_queue(h2, stream);
+	}
+}
+
+/* Only read frames while the client keeps up with our output. */
+static void
+an_io_h2_subscribe(struct an_io_connection *conn)
+{
+	struct an_io_h2 *h2;
+	uint32_t events;
+
+	h2 = conn->h2;
+	events = 0;
+	if (an_io_h2_output(h2) < H2_OUTPUT_MAX) {
+		events |= EPOLLIN;
+	}
+
+	if (an_io_h2_output(h2) > 0) {
+		events |= EPOLLOUT;
+	}
+
+	an_io_subscribe(conn->iotd, &conn->io, events);
+}
+
+/* Write out queued frames; this may close the connection. */
+static void
+an_io_h2_write(struct an_io_connection *conn)
+{
+	struct an_io_thread *iotd;
+	struct an_io_h2 *h2;
+	ssize_t nbytes;
+
+	iotd = conn->iotd;
+	h2 = conn->h2;
+	for (;;) {
+		an_io_h2_fill(conn);
+		if (an_io_h2_output(h2) == 0) {
+			break;
+		}
+
+		do {
+			nbytes = write(conn->io.fd, h2->wbuf + h2->wout,
+			    an_io_h2_output(h2));
+		} while (nbytes == -1 && errno == EINTR);
+
+		if (nbytes == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+
+			if (errno != EPIPE && errno != ECONNRESET) {
+				an_syslog(LOG_CRIT,
+				    "Unexpected write error: %d (%s)",
+				    errno, an_strerror(errno));
+				an_io_stat_inc(iotd, AN_IO_WRITE_ERRORS);
+			} else {
+				an_io_stat_inc(iotd, AN_IO_RESET_BY_PEER);
+			}
+
+			an_io_connection_close(conn);
+			return;
+		}
+
+		h2->wout += nbytes;
+		if (h2->wout < h2->wlen) {
+			/* The socket buffer is full. */
+			break;
+		}
+
+		h2->wout = 0;
+		h2->wlen = 0;
+	}
+
+	if (h2->goaway && h2->active == 0 && an_io_h2_output(h2) == 0) {
+		an_io_connection_close(conn);
+		return;
+	}
+
+	an_io_h2_subscribe(conn);
+}
+
+/* Strip the padding of a DATA or HEADERS frame. */
+static bool
+an_io_h2_unpad(const struct an_h2_frame *frame, const uint8_t **payload,
+    size_t *len)
+{
+	size_t pad;
+
+	if ((frame->flags & AN_H2_FLAG_PADDED) == 0) {
+		return true;
+	}
+
+	if (*len == 0) {
+		return false;
+	}
+
+	pad = (*payload)[0];
+	if (pad >= *len) {
+		return false;
+	}
+
+	*payload += 1;
+	*len -= 1 + pad;
+	return true;
+}
+
+/* Hop-by-hop headers, which HTTP/2 does without. */
+static bool
+an_io_h2_hop_header(const char *name, size_t len)
+{
+	static const char *const headers[] = {
+		"connection",
+		"keep-alive",
+		"proxy-connection",
+		"transfer-encoding",
+		"upgrade"
+	};
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(headers); i++) {
+		if (len == strlen(headers[i]) &&
+		    strncasecmp(name, headers[i], len) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void
+an_io_h2_head_append(struct an_io_h2_head *head, const char *data, size_t len)
+{
+
+	head->data = an_io_h2_grow(head->data, &head->size, head->len, len);
+	memcpy(head->data + head->len, data, len);
+	head->len += len;
+}
+
+/* Called by the HPACK decoder for each header of a request. */
+static void
+an_io_h2_on_header(void *arg, const char *name, size_t name_len,
+    const char *value, size_t value_len)
+{
+	struct an_io_h2_head *head = arg;
+	size_t *offset, *len;
+	size_t i;
+
+	if (!head->collect || head->malformed) {
+		return;
+	}
+
+	if (name_len == 0 ||
+	    head->len + name_len + value_len + 4 > HTTP_MAX_HEADER_SIZE) {
+		goto malformed;
+	}
+
+	/* Anything that would let a value spill into another line. */
+	for (i = 0; i < value_len; i++) {
+		if (value[i] == '\0' || value[i] == '\r' || value[i] == '\n') {
+			goto malformed;
+		}
+	}
+
+	if (name[0] == ':') {
+		if (head->in_regular) {
+			goto malformed;
+		}
+
+		if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+			offset = &head->method;
+			len = &head->method_len;
+			for (i = 0; i < value_len; i++) {
+				if (value[i] <= ' ' || value[i] >= 0x7f) {
+					goto malformed;
+				}
+			}
+		} else if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+			offset = &head->path;
+			len = &head->path_len;
+		} else if (name_len == 10 &&
+		    memcmp(name, ":authority", 10) == 0) {
+			offset = &head->authority;
+			len = &head->authority_len;
+		} else if (name_len == 7 && memcmp(name, ":scheme", 7) == 0) {
+			return;
+		} else {
+			goto malformed;
+		}
+
+		if (*len > 0 || value_len == 0) {
+			goto malformed;
+		}
+
+		*offset = head->len;
+		*len = value_len;
+		an_io_h2_head_append(head, value, value_len);
+		return;
+	}
+
+	if (!head->in_regular) {
+		head->in_regular = true;
+		head->regular = head->len;
+	}
+
+	for (i = 0; i < name_len; i++) {
+		if (name[i] <= ' ' || name[i] >= 0x7f || name[i] == ':' ||
+		    (name[i] >= 'A' && name[i] <= 'Z')) {
+			goto malformed;
+		}
+	}
+
+	if (an_io_h2_hop_header(name, name_len)) {
+		goto malformed;
+	}
+
+	if (name_len == 14 && memcmp(name, "content-length", 14) == 0) {
+		/* We know better, see an_io_h2_dispatch(). */
+		return;
+	}
+
+	if (name_len == 4 && memcmp(name, "host", 4) == 0) {
+		head->host = true;
+	}
+
+	an_io_h2_head_append(head, name, name_len);
+	an_io_h2_head_append(head, ": ", 2);
+	an_io_h2_head_append(head, value, value_len);
+	an_io_h2_head_append(head, "\r\n", 2);
+	return;
+
+malformed:
+	head->malformed = true;
+	return;
+}
+
+/* Hand over a complete request to worker threads. */
+static void
+an_io_h2_dispatch(struct an_io_connection *conn,
+    struct an_io_h2_stream *stream)
+{
+	struct an_io_thread *iotd;
+	struct an_http_request *req;
+	struct an_buffer *buf;
+	size_t body_len;
+	char *p;
+	bool success;
+
+	iotd = conn->iotd;
+	buf = stream->inbuf;
+	req = &stream->request;
+
+	/* Slide the body right after the headers we now complete. */
+	body_len = buf->in - (stream->head_len + H2_HEAD_RESERVE);
+	p = buf->data + stream->head_len;
+	if (body_len > 0) {
+		p += sprintf(p, "content-length: %zu\r\n", body_len);
+	}
+	memcpy(p, "\r\n", 2);
+	p += 2;
+	memmove(p, buf->data + stream->head_len + H2_HEAD_RESERVE, body_len);
+
+	req->buffer = buf->data;
+	req->total_len = (p - buf->data) + body_len;
+	req->body_offset = body_len > 0 ? p - buf->data : 0;
+	req->body_len = body_len;
+	req->start = stream->start;
+	an_request_id_encode(&req->id, iotd, conn, stream - conn->h2->streams);
+	if (!an_io_request_parse_url(req)) {
+		an_io_h2_reset(conn, stream->id, AN_H2_PROTOCOL_ERROR);
+		an_io_stat_inc(iotd, AN_IO_MALFORMED_REQS);
+		return;
+	}
+
+	stream->state = H2_STREAM_DISPATCHED;
+	conn->pending++;
+	stream->times.enqueued = an_md_rdtsc();
+	an_io_latency_add(iotd, AN_IO_PHASE_READ, stream->start,
+	    stream->times.enqueued);
+	success = CK_RING_ENQUEUE_SPMC(requests, &iotd->requests_fifo,
+	    iotd->requests_buffer, req);
+	assert(success == true);
+	an_io_stat_inc(iotd, AN_IO_NUM_REQUESTS);
+}
+
+/* Open a stream for the request whose headers we just decoded. */
+static void
+an_io_h2_stream_open(struct an_io_connection *conn, uint32_t id,
+    bool end_stream)
+{
+	struct an_io_h2_stream *stream;
+	struct an_io_h2_head *head;
+	struct an_io_thread *iotd;
+	struct an_buffer *buf;
+	struct an_rtbr_timestamp ts;
+	struct an_io_h2 *h2;
+	size_t len, regular;
+	char *p;
+	bool host;
+
+	iotd = conn->iotd;
+	h2 = conn->h2;
+	head = &h2->head;
+	if (head->malformed || head->method_len == 0 || head->path_len == 0) {
+		an_io_h2_reset(conn, id, AN_H2_PROTOCOL_ERROR);
+		an_io_stat_inc(iotd, AN_IO_MALFORMED_REQS);
+		return;
+	}
+
+	stream = an_io_h2_stream_find(h2, 0);
+	assert(stream != NULL);
+
+	regular = head->in_regular ? head->regular : head->len;
+	host = head->authority_len > 0 && !head->host;
+	len = head->method_len + 1 + head->path_len +
+	    sizeof(" HTTP/1.1\r\n") - 1 + head->len - regular;
+	if (host) {
+		len += sizeof("host: \r\n") - 1 + head->authority_len;
+	}
+
+	ts = an_rtbr_prepare();
+	buf = an_io_inbuf_get(iotd, len + H2_HEAD_RESERVE);
+	if (AN_CC_UNLIKELY(buf == NULL)) {
+		an_syslog(LOG_CRIT, "Failed to allocate h2 request buffer.");
+		an_io_h2_reset(conn, id, AN_H2_REFUSED_STREAM);
+		an_io_stat_inc(iotd, AN_IO_OOM_FAILURES);
+		return;
+	}
+
+	an_rtbr_begin(&stream->rtbr_section, ts, "an_io_server h2");
+
+	p = buf->data;
+	memcpy(p, head->data + head->method, head->method_len);
+	p += head->method_len;
+	*p++ = ' ';
+	memcpy(p, head->data + head->path, head->path_len);
+	p += head->path_len;
+	memcpy(p, " HTTP/1.1\r\n", sizeof(" HTTP/1.1\r\n") - 1);
+	p += sizeof(" HTTP/1.1\r\n") - 1;
+	if (host) {
+		memcpy(p, "host: ", sizeof("host: ") - 1);
+		p += sizeof("host: ") - 1;
+		memcpy(p, head->data + head->authority, head->authority_len);
+		p += head->authority_len;
+		memcpy(p, "\r\n", 2);
+		p += 2;
+	}
+	memcpy(p, head->data + regular, head->len - regular);
+	p += head->len - regular;
+
+	stream->state = H2_STREAM_RECEIVING;
+	stream->id = id;
+	stream->send_window = h2->initial_window;
+	stream->recv_window = AN_H2_WINDOW;
+	stream->start = an_md_rdtsc();
+	stream->inbuf = buf;
+	stream->head_len = p - buf->data;
+	buf->in = stream->head_len + H2_HEAD_RESERVE;
+	memset(&stream->request, 0, sizeof(stream->request));
+	stream->request.uri_offset = head->method_len + 1;
+	stream->request.uri_len = head->path_len;
+	if (h2->active++ == 0) {
+		an_io_h2_arm(conn);
+	}
+
+	if (end_stream) {
+		an_io_h2_dispatch(conn, stream);
+	}
+}
+
+/* We have a complete header block, decode it and act on it. */
+static bool
+an_io_h2_block_end(struct an_io_connection *conn)
+{
+	struct an_io_h2_stream *stream;
+	struct an_io_h2_head *head;
+	struct an_io_h2 *h2;
+	uint32_t id;
+	bool end_stream;
+
+	h2 = conn->h2;
+	head = &h2->head;
+	head->len = 0;
+	head->method_len = 0;
+	head->path_len = 0;
+	head->authority_len = 0;
+	head->in_regular = false;
+	head->host = false;
+	head->malformed = false;
+	head->collect = h2->block_new && !h2->goaway &&
+	    h2->active < h2->max_streams;
+	if (!an_hpack_decode(&h2->hpack, h2->block, h2->block_len,
+	    an_io_h2_on_header, head)) {
+		return an_io_h2_fail(conn, AN_H2_COMPRESSION_ERROR);
+	}
+
+	id = h2->block_stream;
+	end_stream = (h2->block_flags & AN_H2_FLAG_END_STREAM) != 0;
+	h2->block_stream = 0;
+	if (h2->block_new) {
+		if (!head->collect) {
+			an_io_h2_reset(conn, id, AN_H2_REFUSED_STREAM);
+			return true;
+		}
+
+		an_io_h2_stream_open(conn, id, end_stream);
+		return true;
+	}
+
+	/* Trailers, which we drop; they must end the stream. */
+	stream = an_io_h2_stream_find(h2, id);
+	if (stream == NULL || stream->state != H2_STREAM_RECEIVING) {
+		an_io_h2_reset(conn, id, AN_H2_STREAM_CLOSED);
+	} else if (!end_stream) {
+		an_io_h2_reset(conn, id, AN_H2_PROTOCOL_ERROR);
+	} else {
+		an_io_h2_dispatch(conn, stream);
+	}
+
+	return true;
+}
+
+static bool
+an_io_h2_block_append(struct an_io_connection *conn, const uint8_t *data,
+    size_t len)
+{
+	struct an_io_h2 *h2;
+
+	h2 = conn->h2;
+	if (h2->block_len + len > HTTP_MAX_HEADER_SIZE) {
+		return an_io_h2_fail(conn, AN_H2_ENHANCE_YOUR_CALM);
+	}
+
+	h2->block = an_io_h2_grow(h2->block, &h2->block_size, h2->block_len,
+	    len);
+	memcpy(h2->block + h2->block_len, data, len);
+	h2->block_len += len;
+	return true;
+}
+
+static bool
+an_io_h2_on_headers(struct an_io_connection *conn,
+    const struct an_h2_frame *frame, const uint8_t *payload)
+{
+	struct an_io_h2 *h2;
+	size_t len;
+
+	h2 = conn->h2;
+	len = frame->length;
+	if (frame->stream == 0 || (frame->stream & 1) == 0 ||
+	    !an_io_h2_unpad(frame, &payload, &len)) {
+		return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+	}
+
+	if ((frame->flags & AN_H2_FLAG_PRIORITY) != 0) {
+		/* We don't do priorities. */
+		if (len < 5) {
+			return an_io_h2_fail(conn, AN_H2_FRAME_SIZE_ERROR);
+		}
+
+		payload += 5;
+		len -= 5;
+	}
+
+	h2->block_new = frame->stream > h2->last_stream;
+	if (h2->block_new) {
+		h2->last_stream = frame->stream;
+	} else if (an_io_h2_stream_find(h2, frame->stream) == NULL) {
+		return an_io_h2_fail(conn, AN_H2_STREAM_CLOSED);
+	}
+
+	h2->block_len = 0;
+	h2->block_stream = frame->stream;
+	h2->block_flags = frame->flags;
+	if (!an_io_h2_block_append(conn, payload, len)) {
+		return false;
+	}
+
+	if ((frame->flags & AN_H2_FLAG_END_HEADERS) != 0) {
+		return an_io_h2_block_end(conn);
+	}
+
+	return true;
+}
+
+static bool
+an_io_h2_on_data(struct an_io_connection *conn,
+    const struct an_h2_frame *frame, const uint8_t *payload)
+{
+	struct an_io_h2_stream *stream;
+	struct an_buffer *buf;
+	struct an_io_h2 *h2;
+	size_t len;
+
+	h2 = conn->h2;
+	len = frame->length;
+	if (frame->stream == 0 || frame->stream > h2->last_stream) {
+		return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+	}
+
+	/* Padding counts against flow control windows too. */
+	if (frame->length > h2->recv_window) {
+		return an_io_h2_fail(conn, AN_H2_FLOW_CONTROL_ERROR);
+	}
+
+	h2->recv_window -= frame->length;
+	if (h2->recv_window <= AN_H2_WINDOW / 2) {
+		an_io_h2_window_update(h2, 0, AN_H2_WINDOW - h2->recv_window);
+		h2->recv_window = AN_H2_WINDOW;
+	}
+
+	if (!an_io_h2_unpad(frame, &payload, &len)) {
+		return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+	}
+
+	stream = an_io_h2_stream_find(h2, frame->stream);
+	if (stream == NULL || stream->state != H2_STREAM_RECEIVING) {
+		an_io_h2_reset(conn, frame->stream, AN_H2_STREAM_CLOSED);
+		return true;
+	}
+
+	if (frame->length > stream->recv_window) {
+		an_io_h2_reset(conn, stream->id, AN_H2_FLOW_CONTROL_ERROR);
+		return true;
+	}
+
+	stream->recv_window -= frame->length;
+	buf = stream->inbuf;
+	if (buf->in + len > buf->size &&
+	    (buf->in + len > UINT32_MAX ||
+	    !an_pool_grow_to(buf, next_power_of_2(buf->in + len)))) {
+		an_syslog(LOG_CRIT, "Cannot grow buffer per policy. "
+		    "Dropping request.");
+		an_io_h2_reset(conn, stream->id, AN_H2_REFUSED_STREAM);
+		an_io_stat_inc(conn->iotd, AN_IO_OOM_FAILURES);
+		return true;
+	}
+
+	memcpy(buf->data + buf->in, payload, len);
+	buf->in += len;
+	if ((frame->flags & AN_H2_FLAG_END_STREAM) != 0) {
+		an_io_h2_dispatch(conn, stream);
+	} else if (stream->recv_window <= AN_H2_WINDOW / 2) {
+		an_io_h2_window_update(h2, stream->id,
+		    AN_H2_WINDOW - stream->recv_window);
+		stream->recv_window = AN_H2_WINDOW;
+	}
+
+	return true;
+}
+
+static bool
+an_io_h2_on_settings(struct an_io_connection *conn,
+    const struct an_h2_frame *frame, const uint8_t *payload)
+{
+	struct an_io_h2_stream *stream;
+	struct an_io_h2 *h2;
+	uint32_t value, i, j;
+	int64_t delta;
+	uint16_t id;
+
+	h2 = conn->h2;
+	if (frame->stream != 0) {
+		return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+	}
+
+	if ((frame->flags & AN_H2_FLAG_ACK) != 0) {
+		if (frame->length != 0) {
+			return an_io_h2_fail(conn, AN_H2_FRAME_SIZE_ERROR);
+		}
+
+		return true;
+	}
+
+	if (frame->length % AN_H2_SETTING_LEN != 0) {
+		return an_io_h2_fail(conn, AN_H2_FRAME_SIZE_ERROR);
+	}
+
+	for (i = 0; i < frame->length; i += AN_H2_SETTING_LEN) {
+		id = ((uint16_t)payload[i] << 8) | payload[i + 1];
+		value = an_h2_read32(payload + i + 2);
+		switch (id) {
+		case AN_H2_SETTINGS_ENABLE_PUSH:
+			if (value > 1) {
+				return an_io_h2_fail(conn,
+				    AN_H2_PROTOCOL_ERROR);
+			}
+			break;
+		case AN_H2_SETTINGS_INITIAL_WINDOW_SIZE:
+			if (value > AN_H2_WINDOW_MAX) {
+				return an_io_h2_fail(conn,
+				    AN_H2_FLOW_CONTROL_ERROR);
+			}
+
+			/* This applies to every open stream. */
+			delta = (int64_t)value - h2->initial_window;
+			h2->initial_window = value;
+			for (j = 0; j < h2->max_streams; j++) {
+				stream = &h2->streams[j];
+				if (stream->state == H2_STREAM_FREE) {
+					continue;
+				}
+
+				stream->send_window += delta;
+				if (stream->send_window > AN_H2_WINDOW_MAX) {
+					return an_io_h2_fail(conn,
+					    AN_H2_FLOW_CONTROL_ERROR);
+				}
+
+				an_io_h2_send_queue(h2, stream);
+			}
+			break;
+		case AN_H2_SETTINGS_MAX_FRAME_SIZE:
+			if (value < AN_H2_FRAME_SIZE ||
+			    value > AN_H2_FRAME_SIZE_MAX) {
+				return an_io_h2_fail(conn,
+				    AN_H2_PROTOCOL_ERROR);
+			}
+
+			h2->max_frame_size = value;
+			break;
+		default:
+			/* Our encoder doesn't index, so no table size. */
+			break;
+		}
+	}
+
+	an_io_h2_queue(h2, AN_H2_SETTINGS, AN_H2_FLAG_ACK, 0, NULL, 0);
+	return true;
+}
+
+static bool
+an_io_h2_on_window_update(struct an_io_connection *conn,
+    const struct an_h2_frame *frame, const uint8_t *payload)
+{
+	struct an_io_h2_stream *stream;
+	struct an_io_h2 *h2;
+	uint32_t increment;
+
+	h2 = conn->h2;
+	if (frame->length != 4) {
+		return an_io_h2_fail(conn, AN_H2_FRAME_SIZE_ERROR);
+	}
+
+	increment = an_h2_read32(payload) & AN_H2_WINDOW_MAX;
+	if (frame->stream == 0) {
+		if (increment == 0) {
+			return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+		}
+
+		h2->send_window += increment;
+		if (h2->send_window > AN_H2_WINDOW_MAX) {
+			return an_io_h2_fail(conn, AN_H2_FLOW_CONTROL_ERROR);
+		}
+
+		return true;
+	}
+
+	stream = an_io_h2_stream_find(h2, frame->stream);
+	if (stream == NULL) {
+		/* Streams we are done with may still get some. */
+		return true;
+	}
+
+	if (increment == 0) {
+		an_io_h2_reset(conn, stream->id, AN_H2_PROTOCOL_ERROR);
+		return true;
+	}
+
+	stream->send_window += increment;
+	if (stream->send_window > AN_H2_WINDOW_MAX) {
+		an_io_h2_reset(conn, stream->id, AN_H2_FLOW_CONTROL_ERROR);
+		return true;
+	}
+
+	an_io_h2_send_queue(h2, stream);
+	return true;
+}
+
+/* Act on a frame; returns false if the connection got closed. */
+static bool
+an_io_h2_frame(struct an_io_connection *conn, const struct an_h2_frame *frame,
+    const uint8_t *payload)
+{
+	struct an_io_h2_stream *stream;
+	struct an_io_h2 *h2;
+
+	h2 = conn->h2;
+	if (h2->block_stream != 0 && frame->type != AN_H2_CONTINUATION) {
+		/* Header blocks may not be interleaved with anything. */
+		return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+	}
+
+	switch (frame->type) {
+	case AN_H2_DATA:
+		return an_io_h2_on_data(conn, frame, payload);
+	case AN_H2_HEADERS:
+		return an_io_h2_on_headers(conn, frame, payload);
+	case AN_H2_CONTINUATION:
+		if (h2->block_stream == 0 ||
+		    frame->stream != h2->block_stream) {
+			return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+		}
+
+		if (!an_io_h2_block_append(conn, payload, frame->length)) {
+			return false;
+		}
+
+		if ((frame->flags & AN_H2_FLAG_END_HEADERS) != 0) {
+			return an_io_h2_block_end(conn);
+		}
+
+		return true;
+	case AN_H2_PRIORITY:
+		if (frame->stream == 0) {
+			return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+		}
+
+		if (frame->length != 5) {
+			an_io_h2_reset(conn, frame->stream,
+			    AN_H2_FRAME_SIZE_ERROR);
+		}
+
+		return true;
+	case AN_H2_RST_STREAM:
+		if (frame->length != 4) {
+			return an_io_h2_fail(conn, AN_H2_FRAME_SIZE_ERROR);
+		}
+
+		if (frame->stream == 0 || frame->stream > h2->last_stream) {
+			return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+		}
+
+		stream = an_io_h2_stream_find(h2, frame->stream);
+		if (stream == NULL) {
+			return true;
+		}
+
+		if (stream->state == H2_STREAM_DISPATCHED) {
+			stream->reset = true;
+		} else {
+			an_io_h2_stream_close(conn, stream);
+		}
+
+		return true;
+	case AN_H2_SETTINGS:
+		return an_io_h2_on_settings(conn, frame, payload);
+	case AN_H2_PING:
+		if (frame->stream != 0) {
+			return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+		}
+
+		if (frame->length != 8) {
+			return an_io_h2_fail(conn, AN_H2_FRAME_SIZE_ERROR);
+		}
+
+		if ((frame->flags & AN_H2_FLAG_ACK) == 0) {
+			an_io_h2_queue(h2, AN_H2_PING, AN_H2_FLAG_ACK, 0,
+			    payload, frame->length);
+		}
+
+		return true;
+	case AN_H2_GOAWAY:
+		if (frame->stream != 0) {
+			return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+		}
+
+		if (frame->length < 8) {
+			return an_io_h2_fail(conn, AN_H2_FRAME_SIZE_ERROR);
+		}
+
+		/* Finish the streams we have, then close. */
+		h2->goaway = true;
+		return true;
+	case AN_H2_WINDOW_UPDATE:
+		return an_io_h2_on_window_update(conn, frame, payload);
+	case AN_H2_PUSH_PROMISE:
+		/* Clients can't push. */
+		return an_io_h2_fail(conn, AN_H2_PROTOCOL_ERROR);
+	default:
+		/* Unknown frame types must be ignored. */
+		return true;
+	}
+}
+
+/* Process every complete frame in the read buffer. */
+static bool
+an_io_h2_process(struct an_io_connection *conn)
+{
+	struct an_h2_frame frame;
+	struct an_io_h2 *h2;
+	size_t pos;
+
+	h2 = conn->h2;
+	pos = 0;
+	while (h2->rlen - pos >= AN_H2_FRAME_HEADER_LEN) {
+		an_h2_frame_read(&frame, h2->rbuf + pos);
+		/* We never raised SETTINGS_MAX_FRAME_SIZE. */
+		if (frame.length > AN_H2_FRAME_SIZE) {
+			return an_io_h2_fail(conn, AN_H2_FRAME_SIZE_ERROR);
+		}
+
+		if (h2->rlen - pos < AN_H2_FRAME_HEADER_LEN + frame.length) {
+			break;
+		}
+
+		if (!an_io_h2_frame(conn, &frame,
+		    h2->rbuf + pos + AN_H2_FRAME_HEADER_LEN)) {
+			return false;
+		}
+
+		pos += AN_H2_FRAME_HEADER_LEN + frame.length;
+	}
+
+	memmove(h2->rbuf, h2->rbuf + pos, h2->rlen - pos);
+	h2->rlen -= pos;
+	return true;
+}
+
+/* Read and process frames; returns false if the connection got closed. */
+static bool
+an_io_h2_read(struct an_io_connection *conn)
+{
+	struct an_io_thread *iotd;
+	struct an_io_h2 *h2;
+	ssize_t nbytes;
+	size_t room;
+
+	iotd = conn->iotd;
+	h2 = conn->h2;
+	while (an_io_h2_output(h2) < H2_OUTPUT_MAX) {
+		room = h2->rsize - h2->rlen;
+		assert(room > 0);
+		do {
+			nbytes = read(conn->io.fd, h2->rbuf + h2->rlen, room);
+		} while (nbytes == -1 && errno == EINTR);
+
+		if (nbytes == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return true;
+			}
+
+			if (errno != ECONNRESET) {
+				an_syslog(LOG_CRIT,
+				    "Unexpected read error: %d (%s)",
+				    errno, an_strerror(errno));
+				an_io_stat_inc(iotd, AN_IO_READ_ERRORS);
+			} else {
+				an_io_stat_inc(iotd, AN_IO_RESET_BY_PEER);
+			}
+
+			an_io_connection_close(conn);
+			return false;
+		}
+
+		if (nbytes == 0) {
+			/* Nobody would read our responses anyway. */
+			an_io_connection_close(conn);
+			return false;
+		}
+
+		h2->rlen += nbytes;
+		if (!an_io_h2_process(conn)) {
+			return false;
+		}
+
+		if ((size_t)nbytes < room) {
+			/* The socket is most likely drained. */
+			return true;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Switch a connection that sent the h2 preface over to HTTP/2. The
+ * connection's own input buffer and RTBR section go away: streams have
+ * their own, for as long as they're open.
+ */
+static void
+an_io_h2_start(struct an_io_connection *conn)
+{
+	uint8_t settings[3 * AN_H2_SETTING_LEN];
+	struct an_io_thread *iotd;
+	struct an_buffer *buf;
+	struct an_io_h2 *h2;
+	size_t extra;
+
+	iotd = conn->iotd;
+	buf = conn->inbuf;
+	h2 = an_calloc_region(an_io_h2_token, 1, sizeof(*h2) +
+	    iotd->h2_max_streams * sizeof(h2->streams[0]));
+	an_hpack_decoder_init(&h2->hpack, 4096);
+	h2->max_streams = iotd->h2_max_streams;
+	h2->max_frame_size = AN_H2_FRAME_SIZE;
+	h2->initial_window = AN_H2_WINDOW;
+	h2->send_window = AN_H2_WINDOW;
+	h2->recv_window = AN_H2_WINDOW;
+	TAILQ_INIT(&h2->sendq);
+
+	extra = buf->in - AN_H2_PREFACE_LEN;
+	h2->rsize = max(H2_READ_SIZE, extra);
+	h2->rbuf = an_malloc_region(an_io_h2_buffer_token, h2->rsize);
+	memcpy(h2->rbuf, buf->data + AN_H2_PREFACE_LEN, extra);
+	h2->rlen = extra;
+
+	an_io_inbuf_put(iotd, buf);
+	conn->inbuf = NULL;
+	conn->active->pipeline = NULL;
+	conn->active->responses = NULL;
+	conn->active->pipeline_times = NULL;
+	an_rtbr_end(&conn->active->rtbr_section);
+	ck_pr_store_32(&conn->pipeline_len, h2->max_streams);
+	conn->h2 = h2;
+	an_io_stat_inc(iotd, AN_IO_H2_CONNECTIONS);
+
+	settings[0] = 0;
+	settings[1] = AN_H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+	an_h2_write32(settings + 2, h2->max_streams);
+	settings[6] = 0;
+	settings[7] = AN_H2_SETTINGS_ENABLE_PUSH;
+	an_h2_write32(settings + 8, 0);
+	settings[12] = 0;
+	settings[13] = AN_H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+	an_h2_write32(settings + 14, HTTP_MAX_HEADER_SIZE);
+	an_io_h2_queue(h2, AN_H2_SETTINGS, 0, 0, settings, sizeof(settings));
+	if (iotd->quiesce) {
+		an_io_h2_goaway(h2, AN_H2_NO_ERROR);
+	}
+	an_io_h2_arm(conn);
+
+	if (an_io_h2_process(conn) && an_io_h2_read(conn)) {
+		an_io_h2_write(conn);
+	}
+}
+
+static void
+an_io_h2_event(struct an_io_connection *conn, uint32_t events)
+{
+
+	if ((events & (EPOLLERR | EPOLLHUP)) != 0) {
+		an_io_connection_close(conn);
+		an_io_stat_inc(conn->iotd, AN_IO_RESET_BY_PEER);
+		return;
+	}
+
+	if ((events & (EPOLLIN | EPOLLRDHUP)) != 0 && !an_io_h2_read(conn)) {
+		return;
+	}
+
+	an_io_h2_write(conn);
+}
+
+/*
+ * Turn the HTTP/1.1 response head in the first fragment into a HEADERS
+ * frame (and CONTINUATION frames if needed).
+ */
+static bool
+an_io_h2_send_headers(struct an_io_connection *conn,
+    struct an_io_h2_stream *stream, struct an_buffer *buf)
+{
+	const char *head, *end, *line, *eol, *colon, *value, *value_end;
+	struct an_io_h2 *h2;
+	struct an_buffer *frag;
+	size_t len, hlen, n;
+	unsigned int status;
+	uint8_t type, flags;
+
+	h2 = conn->h2;
+	head = buf->data + buf->out;
+	len = buf->in - buf->out;
+	end = an_http_scan_headers_end(head, len);
+	if (end == NULL || len < sizeof("HTTP/1.1 200\r\n") - 1 ||
+	    memcmp(head, "HTTP/1.", 7) != 0 || head[8] != ' ' ||
+	    !isdigit((unsigned char)head[9]) ||
+	    !isdigit((unsigned char)head[10]) ||
+	    !isdigit((unsigned char)head[11])) {
+		an_syslog(LOG_CRIT, "Malformed response for h2 stream.");
+		return false;
+	}
+
+	status = (head[9] - '0') * 100 + (head[10] - '0') * 10 +
+	    (head[11] - '0');
+	h2->hbuf = an_io_h2_grow(h2->hbuf, &h2->hsize, 0,
+	    AN_HPACK_HEADER_BOUND(0, 3));
+	hlen = an_hpack_encode_status(h2->hbuf, status);
+
+	line = (const char *)memchr(head, '\n', end - head) + 1;
+	for (; line < end - 2; line = eol + 2) {
+		eol = memchr(line, '\r', end - line);
+		colon = memchr(line, ':', eol - line);
+		if (colon == NULL) {
+			an_syslog(LOG_CRIT, "Malformed response header line.");
+			return false;
+		}
+
+		value = colon + 1;
+		while (value < eol && (*value == ' ' || *value == '\t')) {
+			value++;
+		}
+
+		value_end = eol;
+		while (value_end > value &&
+		    (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+			value_end--;
+		}
 
-	parser = &conn->parser;
-	nparsed = http_parser_execute(parser, &server->parser_settings,
-	    data, nbytes);
-	if (nparsed != nbytes || parser->upgrade) {
-		if (parser->upgrade) {
-			an_syslog(LOG_CRIT, "Invalid HTTP request: "
-			    "unexpected upgrade request");
-		} else {
-			an_syslog(LOG_CRIT, "Invalid HTTP request: %s",
-			    http_errno_description(parser->http_errno));
+		if (an_io_h2_hop_header(line, colon - line)) {
+			if (colon - line == sizeof("transfer-encoding") - 1) {
+				/* We'd have to decode chunks. */
+				an_syslog(LOG_CRIT, "Transfer-Encoding is "
+				    "not supported for h2 responses.");
+				return false;
+			}
+
+			continue;
 		}
-		an_io_connection_close(conn);
-		an_io_stat_inc(iotd, AN_IO_MALFORMED_REQS);
-		return;
+
+		h2->hbuf = an_io_h2_grow(h2->hbuf, &h2->hsize, hlen,
+		    AN_HPACK_HEADER_BOUND(colon - line, value_end - value));
+		hlen += an_hpack_encode_header(h2->hbuf + hlen, line,
+		    colon - line, value, value_end - value);
 	}
 
-	/*
-	 * If the request has been read entirely, state transition will happen
-	 * within the on_message_complete callback of the HTTP parser.
-	 */
-	if (conn->state == HTTP_CONNECTION_READING) {
-		/* Not done; try to read some more bytes. */
-		goto again;
+	buf->out += end - head;
+	stream->left = 0;
+	for (frag = buf; frag != NULL; frag = frag->next) {
+		stream->left += frag->in - frag->out;
 	}
 
-	assert(conn->state == HTTP_CONNECTION_PROCESSING);
-	req = &conn->request;
-	an_request_id_encode(&req->id, iotd, conn);
-	req->buffer = buf->data;
-	req->total_len = buf->in;
+	type = AN_H2_HEADERS;
+	n = 0;
+	do {
+		len = min(hlen - n, (size_t)h2->max_frame_size);
+		flags = 0;
+		if (n + len == hlen) {
+			flags |= AN_H2_FLAG_END_HEADERS;
+		}
 
-	ret = http_parser_parse_url(req->buffer + req->uri_offset,
-	    req->uri_len, 0, &req->url);
-	if (ret != 0 || (req->url.field_set & (1U << UF_PATH)) == 0) {
-		an_syslog(LOG_CRIT, "Malformed request: Invalid URL: %.*s",
-		    (int)req->uri_len, req->buffer + req->uri_offset);
-		an_io_connection_close(conn);
-		an_io_stat_inc(iotd, AN_IO_MALFORMED_REQS);
-		return;
-	}
+		if (type == AN_H2_HEADERS && stream->left == 0) {
+			flags |= AN_H2_FLAG_END_STREAM;
+		}
 
-	an_io_subscribe(iotd, &conn->io, 0);
-	success = CK_RING_ENQUEUE_SPMC(requests, &iotd->requests_fifo,
-	    iotd->requests_buffer, req);
-	assert(success == true);
-	an_io_stat_inc(iotd, AN_IO_NUM_REQUESTS);
+		an_io_h2_queue(h2, type, flags, stream->id, h2->hbuf + n, len);
+		type = AN_H2_CONTINUATION;
+		n += len;
+	} while (n < hlen);
+
+	return true;
 }
 
-/* The counterpart of an_io_connection_read(). */
+/* Start sending the response to a stream, from the I/O thread. */
 static void
-an_io_connection_write(struct an_io_connection *conn)
+an_io_h2_respond(struct an_io_connection *conn, uint32_t slot,
+    struct an_buffer *buf)
 {
+	struct an_io_h2_stream *stream;
 	struct an_io_thread *iotd;
-	struct an_io *io;
-	struct an_buffer *buf;
-	ssize_t nbytes;
+	struct an_io_h2 *h2;
 
 	iotd = conn->iotd;
-	io = &conn->io;
-	buf = conn->outbuf;
-
-	assert(conn->state == HTTP_CONNECTION_WRITING);
-
-again:
-	do {
-		nbytes = write(io->fd, buf->data + buf->out,
-		    buf->in - buf->out);
-	} while (nbytes == -1 && errno == EINTR);
+	h2 = conn->h2;
+	stream = &h2->streams[slot];
+	if (AN_CC_UNLIKELY(stream->state != H2_STREAM_DISPATCHED)) {
+		an_syslog(LOG_CRIT, "Unexpected response for h2 stream "
+		    "slot %"PRIu32", state %d", slot, stream->state);
+		an_io_buffer_release(buf);
+		return;
+	}
 
-	if (nbytes == -1) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			an_io_subscribe(conn->iotd,
-			    &conn->io, EPOLLOUT);
-			return;
-		}
+	stream->response = buf;
+	stream->responded = an_md_rdtsc();
+	if (stream->reset) {
+		/* The client is not interested anymore. */
+		an_io_h2_stream_close(conn, stream);
+		return;
+	}
 
-		if (errno != EPIPE) {
-			an_syslog(LOG_CRIT, "Unexpected write error: %d (%s)",
-			    errno, an_strerror(errno));
-			an_io_stat_inc(iotd, AN_IO_WRITE_ERRORS);
-		} else {
-			an_io_stat_inc(iotd, AN_IO_RESET_BY_PEER);
-		}
+	if (AN_CC_UNLIKELY(buf == NULL)) {
+		/* Failed to produce a response, just fail that stream. */
+		an_io_h2_reset(conn, stream->id, AN_H2_INTERNAL_ERROR);
+		an_io_h2_stream_close(conn, stream);
+		an_io_stat_inc(iotd, AN_IO_OOM_FAILURES);
+		return;
+	}
 
-		an_io_connection_close(conn);
+	if (!an_io_h2_send_headers(conn, stream, buf)) {
+		an_io_h2_reset(conn, stream->id, AN_H2_INTERNAL_ERROR);
+		an_io_h2_stream_close(conn, stream);
 		return;
 	}
 
-	buf->out += nbytes;
-	if (buf->out < buf->in) {
-		/* Not done; try to write some more bytes. */
-		goto again;
+	if (stream->left == 0) {
+		an_io_latency_add(iotd, AN_IO_PHASE_WRITE, stream->responded,
+		    an_md_rdtsc());
+		an_io_h2_stream_close(conn, stream);
+		return;
 	}
 
-	/* We're done writing the response. */
-	if (conn->keepalive && !conn->remote_closed && !iotd->quiesce) {
-		LIST_REMOVE(conn, active_next);
-		an_io_stat_dec(iotd, AN_IO_ACTIVE_CONNS);
-		an_io_connection_recycle(conn);
-		AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_IDLE);
-		LIST_INSERT_HEAD(&iotd->idle_conns, conn, idle_next);
-		an_io_connection_read(conn);
-	} else {
-		an_io_connection_close(conn);
+	stream->state = H2_STREAM_SENDING;
+	stream->cursor = buf;
+	an_io_h2_send_queue(h2, stream);
+}
+
+/* Release everything h2 when recycling the connection. */
+static void
+an_io_h2_destroy(struct an_io_connection *conn)
+{
+	struct an_io_h2_stream *stream;
+	struct an_io_h2 *h2;
+	uint32_t i;
+
+	h2 = conn->h2;
+	for (i = 0; i < h2->max_streams; i++) {
+		stream = &h2->streams[i];
+		if (stream->state == H2_STREAM_FREE) {
+			continue;
+		}
+
+		an_io_inbuf_put(conn->iotd, stream->inbuf);
+		an_io_buffer_release(stream->response);
+		an_rtbr_end(&stream->rtbr_section);
 	}
+
+	an_hpack_decoder_deinit(&h2->hpack);
+	an_free(an_io_h2_buffer_token, h2->rbuf);
+	an_free(an_io_h2_buffer_token, h2->wbuf);
+	an_free(an_io_h2_buffer_token, h2->hbuf);
+	an_free(an_io_h2_buffer_token, h2->block);
+	an_free(an_io_h2_buffer_token, h2->head.data);
+	an_free(an_io_h2_token, h2);
+	conn->h2 = NULL;
 }
 
-/* Accept a new connection from a listening file descriptor. */
+/* Set up a connection for a socket we just accepted. */
 static void
-an_io_connection_accept(struct an_io_listener *listener)
+an_io_connection_open(struct an_io_listener *listener, int fd)
 {
 	struct an_io_connection *conn;
 	struct an_io_thread *iotd;
-	struct an_io *io;
-	int fd;
 
 	iotd = listener->iotd;
-	io = &listener->io;
-	fd = accept4(io->fd, NULL, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
-	if (fd == -1) {
-		an_syslog(LOG_CRIT, "Failed to accept new connection: %d (%s)",
-		    errno, an_strerror(errno));
-		return;
-	}
-
 	conn = an_io_connection_get(iotd);
 	if (conn == NULL) {
 		/* Connection array is full. */
@@ -1276,61 +4384,140 @@ an_io_connection_accept(struct an_io_listener *listener)
 	an_io_setopt(&conn->io, IPPROTO_TCP, TCP_NODELAY);
 	an_io_setopt(&conn->io, IPPROTO_TCP, TCP_QUICKACK);
 
-	http_parser_init(&conn->parser, HTTP_REQUEST);
-	conn->parser.data = conn;
-
 	an_io_stat_inc(iotd, AN_IO_NUM_CONNS);
+	an_io_connection_arm_idle(conn);
+
+	conn->tls = false;
+#ifdef AN_IO_KTLS
+	if (iotd->server->tls != NULL) {
+		conn->tls = true;
+		conn->ssl = SSL_new(iotd->server->tls);
+		if (AN_CC_UNLIKELY(conn->ssl == NULL ||
+		    SSL_set_fd(conn->ssl, fd) != 1)) {
+			an_syslog(LOG_CRIT, "Failed to set up TLS connection.");
+			an_io_connection_close(conn);
+			an_io_stat_inc(iotd, AN_IO_OOM_FAILURES);
+			return;
+		}
+	}
+#endif
+
+	/* h2c only; HTTP/2 over TLS would need ALPN. */
+	conn->h2_candidate = iotd->h2_max_streams > 0 && !conn->tls;
+
+	/* This also kicks off the TLS handshake, if any. */
 	an_io_connection_read(conn);
 }
 
+/* Accept a new connection from a listening file descriptor. */
+static void
+an_io_connection_accept(struct an_io_listener *listener)
+{
+	struct an_io *io;
+	int fd;
+
+#ifdef AN_IO_URING
+	if (listener->iotd->uring) {
+		/* The multishot accept request did the work. */
+		AN_ARRAY_FOREACH_VAL(&listener->accepted, fd) {
+			an_io_connection_open(listener, fd);
+		}
+		AN_ARRAY_RESET(fd_list, &listener->accepted);
+		return;
+	}
+#endif
+
+	io = &listener->io;
+	fd = accept4(io->fd, NULL, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1) {
+		an_syslog(LOG_CRIT, "Failed to accept new connection: %d (%s)",
+		    errno, an_strerror(errno));
+		return;
+	}
+
+	an_io_connection_open(listener, fd);
+}
+
+/* Re-arm the timers of connections whose deadline got shortened. */
+static void
+an_io_thread_process_deadlines(struct an_io_thread *iotd)
+{
+	struct an_io_connection *conn, *next;
+
+	if (ck_pr_load_ptr(&iotd->deadlines_head) == NULL) {
+		return;
+	}
+
+	conn = ck_pr_fas_ptr(&iotd->deadlines_head, NULL);
+	for (; conn != NULL; conn = next) {
+		next = conn->deadline_next;
+
+		/*
+		 * Clear the flag before reading the deadline so that we
+		 * cannot miss an update; the connection may also have
+		 * moved on to another request since, which is harmless.
+		 */
+		ck_pr_fas_8(&conn->deadline_queued, 0);
+		if (conn->state > HTTP_CONNECTION_IDLE &&
+		    conn->state != HTTP_CONNECTION_CLOSING &&
+		    (conn->h2 == NULL || conn->h2->active > 0)) {
+			an_io_connection_arm(conn);
+		}
+	}
+}
+
 /*
- * Returns the next request timeout in milliseconds, or -1.
- *
- * We just iterate over the active connections as we never have
- * a large enough number of those for it to matter.
+ * Close the connections whose timer expired, and return the next
+ * timeout in milliseconds, or -1.
  */
 static int
 an_io_thread_next_timeout(struct an_io_thread *iotd)
 {
 	struct an_io_connection *conn;
-	uint64_t next, deadline, timeout, now, when;
+	struct an_wheel_timer *timer;
+	uint64_t next, deadline, now;
+	double ms;
 
-	if (iotd->request_timeout == 0 || LIST_EMPTY(&iotd->active_conns)) {
-		return -1;
-	}
+	an_io_thread_process_deadlines(iotd);
 
 	now = an_md_rdtsc();
-
-	next = 0;
-	LIST_FOREACH(conn, &iotd->active_conns, active_next) {
-		assert(conn->state > HTTP_CONNECTION_IDLE);
-
-		if (conn->state == HTTP_CONNECTION_CLOSING) {
+	while ((timer = an_wheel_expire(&iotd->wheel,
+	    now >> AN_IO_TICK_SHIFT)) != NULL) {
+		conn = container_of(timer, struct an_io_connection, timer);
+		if (conn->state == HTTP_CONNECTION_IDLE ||
+		    (conn->h2 != NULL && conn->h2->active == 0)) {
+			an_io_connection_close(conn);
+			an_io_stat_inc(iotd, AN_IO_IDLE_TIMEOUT);
 			continue;
 		}
 
-		timeout = ck_pr_load_64(&conn->timeout);
-		if (AN_CC_LIKELY(timeout == 0)) {
-			timeout = iotd->request_timeout;
-		}
-		deadline = conn->request_start + timeout;
-		if (deadline <= now) {
-			an_io_connection_close(conn);
-			an_io_stat_inc(iotd, AN_IO_REQUEST_TIMEOUT);
+		assert(conn->state > HTTP_CONNECTION_IDLE &&
+		    conn->state != HTTP_CONNECTION_CLOSING);
+		deadline = an_io_connection_deadline(conn);
+		if (deadline > now) {
+			/* The handler pushed its deadline back. */
+			an_wheel_add(&iotd->wheel, &conn->timer,
+			    an_io_ticks(deadline));
 			continue;
 		}
 
-		when = deadline - now;
-		if (next == 0 || when < next) {
-			next = when;
-		}
+		an_io_connection_close(conn);
+		an_io_stat_inc(iotd, AN_IO_REQUEST_TIMEOUT);
 	}
 
-	if (next == 0) {
+	next = an_wheel_next(&iotd->wheel);
+	if (next == UINT64_MAX) {
 		return -1;
 	}
 
-	return an_md_rdtsc_scale(next) / 1000.0;
+	next = (iotd->wheel.now + next) << AN_IO_TICK_SHIFT;
+	if (next <= now) {
+		return 0;
+	}
+
+	/* Round up, there is no point in waking up early. */
+	ms = ceil(an_md_rdtsc_scale(next - now) / 1000.0);
+	return ms < INT_MAX ? (int)ms : INT_MAX;
 }
 
 static void
@@ -1344,8 +4531,23 @@ an_io_thread_process_event(struct an_io_thread *iotd, struct epoll_event *event)
 
 	io = event->data.ptr;
 
+#ifdef AN_IO_URING
+	if (event->events == URING_EVENT_SENT) {
+		an_io_uring_sent(AN_IO_PARENT(io, struct an_io_connection));
+		return;
+	}
+#endif
+
 	assert((event->events & ~(io->events | EPOLLERR | EPOLLHUP)) == 0);
 
+	if (io->kind == AN_IO_CONNECTION &&
+	    AN_IO_PARENT(io, struct an_io_connection)->h2 != NULL) {
+		/* h2 connections read and write at the same time. */
+		an_io_h2_event(AN_IO_PARENT(io, struct an_io_connection),
+		    event->events);
+		return;
+	}
+
 	if (event->events & EPOLLRDHUP) {
 		/*
 		 * Remote closed his writing side of the connection.
@@ -1409,6 +4611,12 @@ an_io_thread_process_event(struct an_io_thread *iotd, struct epoll_event *event)
 		/* We can write some data */
 		assert(io->kind == AN_IO_CONNECTION);
 		conn = AN_IO_PARENT(io, struct an_io_connection);
+#ifdef AN_IO_KTLS
+		if (conn->ssl != NULL) {
+			an_io_connection_handshake(conn);
+			return;
+		}
+#endif
 		assert(conn->state == HTTP_CONNECTION_WRITING);
 
 		an_io_connection_write(conn);
@@ -1422,29 +4630,51 @@ static void
 an_io_thread_process_response(struct an_io_thread *iotd,
     struct an_http_response *resp)
 {
+	struct an_io_request_times *times;
 	struct an_io_connection *conn;
+	uint64_t now, dequeued;
+	uint32_t slot;
 
 	conn = an_io_thread_connection_select(iotd, resp->id);
 	if (AN_CC_UNLIKELY(conn == NULL)) {
 		return;
 	}
 
+	if (AN_CC_UNLIKELY(conn->pending == 0)) {
+		an_syslog(LOG_CRIT, "Invalid connection state %d, conn = %p, "
+		    "response ID = %#"PRIx64, conn->state, conn, resp->id.id);
+		return;
+	}
+
+	conn->pending--;
 	if (conn->state == HTTP_CONNECTION_CLOSING) {
 		/*
 		 * The socket has been forcibly closed asynchronously.
 		 */
-		an_io_connection_put(conn);
+		an_io_buffer_release(resp->buf);
+		if (conn->pending == 0 && !an_io_connection_sending(conn)) {
+			an_io_connection_put(conn);
+		}
 		return;
 	}
 
-	if (AN_CC_UNLIKELY(conn->state != HTTP_CONNECTION_PROCESSING)) {
-		an_syslog(LOG_CRIT, "Invalid connection state %d, conn = %p, "
-		    "response ID = %#"PRIx64, conn->state, conn, resp->id.id);
+	now = an_md_rdtsc();
+	times = an_io_connection_times(conn, an_io_connection_slot(conn,
+	    resp->id));
+	dequeued = ck_pr_load_64(&times->dequeued);
+	an_io_latency_add(iotd, AN_IO_PHASE_QUEUE, times->enqueued, dequeued);
+	an_io_latency_add(iotd, AN_IO_PHASE_HANDLER, dequeued, now);
+
+	if (conn->h2 != NULL) {
+		an_io_h2_respond(conn, an_io_connection_slot(conn, resp->id),
+		    resp->buf);
+		if (conn->flush_queued == false) {
+			conn->flush_queued = true;
+			STAILQ_INSERT_TAIL(&iotd->flush_conns, conn, flush_next);
+		}
 		return;
 	}
 
-	AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_WRITING);
-
 	if (resp->buf == NULL) {
 		/*
 		 * This signals us that the worker thread failed to allocate
@@ -1455,19 +4685,68 @@ an_io_thread_process_response(struct an_io_thread *iotd,
 		return;
 	}
 
+	if (conn->active->pipeline != NULL) {
+		/* Responses must go out in the order requests came in. */
+		slot = an_io_connection_slot(conn, resp->id);
+		conn->active->responses[slot] = resp->buf;
+		if (conn->state != HTTP_CONNECTION_PROCESSING ||
+		    slot != conn->active->pipeline_written) {
+			return;
+		}
+	}
+
+	assert(conn->state == HTTP_CONNECTION_PROCESSING);
+	AN_IO_CONNECTION_STATE(conn, HTTP_CONNECTION_WRITING);
 	conn->outbuf = resp->buf;
-	an_io_connection_write(conn);
+	conn->active->responded = now;
+
+	/*
+	 * Defer the actual write until we have gone through every
+	 * response, so that all the responses ready for a connection
+	 * go out in a single writev().
+	 */
+	if (conn->flush_queued == false) {
+		conn->flush_queued = true;
+		STAILQ_INSERT_TAIL(&iotd->flush_conns, conn, flush_next);
+	}
 }
 
+/* Write out the responses collected by an_io_thread_process_response(). */
 static void
-an_io_thread_process_responses(struct an_io_thread *iotd)
+an_io_thread_flush(struct an_io_thread *iotd)
+{
+	struct an_io_connection *conn;
+
+	while ((conn = STAILQ_FIRST(&iotd->flush_conns)) != NULL) {
+		STAILQ_REMOVE_HEAD(&iotd->flush_conns, flush_next);
+		conn->flush_queued = false;
+
+		/* The connection may have been closed in the meantime. */
+		if (conn->h2 != NULL) {
+			if (conn->state == HTTP_CONNECTION_READING) {
+				an_io_h2_write(conn);
+			}
+		} else if (conn->state == HTTP_CONNECTION_WRITING) {
+			an_io_connection_write(conn);
+		}
+	}
+}
+
+/*
+ * Process up to limit responses, oldest first, and return how many we
+ * did. Whatever is left stays in the backlog for the next call.
+ */
+static unsigned int
+an_io_thread_process_responses(struct an_io_thread *iotd, unsigned int limit)
 {
-	struct an_http_response *resp, *next, *head;
+	struct an_http_response *resp, *next, *head, *tail;
+	unsigned int n;
 
 	resp = ck_pr_fas_ptr(&iotd->responses_head, NULL);
 
 	/* Reverse the list to preserve FIFO ordering. */
 	head = NULL;
+	tail = resp;
 	while (resp != NULL) {
 		next = resp->next;
 		resp->next = head;
@@ -1475,20 +4754,36 @@ an_io_thread_process_responses(struct an_io_thread *iotd)
 		resp = next;
 	}
 
-	resp = head;
-	while (resp != NULL) {
+	/* Older responses may still be waiting in the backlog. */
+	if (head != NULL) {
+		*iotd->responses_backlog_tail = head;
+		iotd->responses_backlog_tail = &tail->next;
+	}
+
+	n = 0;
+	resp = iotd->responses_backlog;
+	while (resp != NULL && n < limit) {
 		an_io_thread_process_response(iotd, resp);
 		next = resp->next;
-		an_free(an_http_response_token, resp);
+		an_http_response_put(resp);
 		resp = next;
+		n++;
+	}
+
+	iotd->responses_backlog = resp;
+	if (resp == NULL) {
+		iotd->responses_backlog_tail = &iotd->responses_backlog;
 	}
+
+	an_io_thread_flush(iotd);
+	return n;
 }
 
 static void
 an_io_thread_quiesce(struct an_io_thread *iotd)
 {
 	struct an_io_listener *listener;
-	struct an_io_connection *conn;
+	struct an_io_connection *conn, *next;
 	size_t num_active_conns;
 
 	if (iotd->quiesce) {
@@ -1514,10 +4809,90 @@ an_io_thread_quiesce(struct an_io_thread *iotd)
 		an_io_deinit(iotd, &listener->io);
 	}
 
-	/* Now go over all idle connections and close them. */
-	LIST_FOREACH(conn, &iotd->idle_conns, idle_next) {
-		an_io_connection_close(conn);
-	}
+	/* Now go over all idle connections and close them. */
+	LIST_FOREACH(conn, &iotd->idle_conns, idle_next) {
+		an_io_connection_close(conn);
+	}
+
+	/*
+	 * h2 connections never go idle: let them finish their streams
+	 * without accepting new ones. That may close them right away.
+	 */
+	for (conn = LIST_FIRST(&iotd->active_conns); conn != NULL;
+	    conn = next) {
+		next = LIST_NEXT(conn, active_next);
+		if (conn->h2 != NULL && conn->state == HTTP_CONNECTION_READING) {
+			an_io_h2_goaway(conn->h2, AN_H2_NO_ERROR);
+			an_io_h2_write(conn);
+		}
+	}
+}
+
+/*
+ * Whether workers handed us anything since we last looked, or we have
+ * responses left over from the last iteration.
+ */
+static bool
+an_io_thread_has_work(const struct an_io_thread *iotd)
+{
+
+	return iotd->responses_backlog != NULL ||
+	    ck_pr_load_ptr(&iotd->responses_head) != NULL ||
+	    ck_pr_load_ptr(&iotd->deadlines_head) != NULL;
+}
+
+/*
+ * Like an_io_thread_wait(), but busy poll for up to busy_poll cycles
+ * before blocking, for lower wakeup latency on dedicated cores. Workers
+ * don't signal our eventfd meanwhile, so we return 0 early when they
+ * hand us responses or deadlines.
+ */
+static int
+an_io_thread_poll(struct an_io_thread *iotd, int timeout)
+{
+	uint64_t end;
+	int ret;
+
+	if (iotd->busy_poll == 0 || timeout == 0) {
+		return an_io_thread_wait(iotd, timeout);
+	}
+
+	ck_pr_store_8(&iotd->polling, 1);
+	end = an_md_rdtsc() + iotd->busy_poll;
+	do {
+		ret = an_io_thread_wait(iotd, 0);
+		if (ret != 0 || an_io_thread_has_work(iotd)) {
+			ck_pr_store_8(&iotd->polling, 0);
+			return ret;
+		}
+
+		ck_pr_stall();
+	} while (an_md_rdtsc() < end);
+
+	/*
+	 * Workers may have skipped the wakeup right before we cleared
+	 * the flag; pairs with the fence in an_io_thread_notify().
+	 */
+	ck_pr_store_8(&iotd->polling, 0);
+	ck_pr_fence_memory();
+	if (an_io_thread_has_work(iotd)) {
+		return 0;
+	}
+
+	return an_io_thread_wait(iotd, timeout);
+}
+
+/*
+ * Idle time housekeeping: move freelist regions RTBR is done with to
+ * their reuse stack, and fault in the next region of our pools, so
+ * that allocation slow paths don't have to.
+ */
+static void
+an_io_thread_maintain(struct an_io_thread *iotd)
+{
+
+	an_pool_private_maintain(&input, true);
+	an_pool_shared_maintain(&output[iotd->numa_node % OUTPUT_POOLS], true);
 }
 
 /* Main loop of the I/O threads. */
@@ -1529,23 +4904,45 @@ an_io_thread_loop(struct an_io_thread *iotd)
 	struct an_io_connection *conn;
 	struct an_io *io;
 	struct epoll_event *event;
-	unsigned int i, nevents, n_jobs;
+	unsigned int budget, i, nevents, n_jobs;
+	bool maintained;
 	int ret, timeout;
 
 	server = iotd->server;
 
+	nevents = 0;
 	for (;;) {
-		an_io_thread_process_responses(iotd);
+		/*
+		 * Bound the responses we process per iteration by the number
+		 * of events we got last time, so that a burst of responses
+		 * doesn't hold back reads (and more responses) on other
+		 * connections. The rest carries over, oldest first.
+		 */
+		budget = max(RESPONSE_BATCH, nevents);
+		budget -= an_io_thread_process_responses(iotd, budget);
 
 		assert(iotd->nevents > 0);
+		maintained = false;
 		do {
 			timeout = an_io_thread_next_timeout(iotd);
-			ret = epoll_wait(iotd->epollfd, iotd->events,
-			    iotd->nevents, timeout);
-		} while (ret == 0 || (ret == -1 && errno == EINTR));
+			if (iotd->responses_backlog != NULL) {
+				timeout = 0;
+			} else if (timeout != 0 && maintained == false) {
+				/*
+				 * We're about to block: get our pools ready
+				 * for the next burst, then check for events
+				 * that came in meanwhile before blocking.
+				 */
+				an_io_thread_maintain(iotd);
+				maintained = true;
+				timeout = 0;
+			}
+			ret = an_io_thread_poll(iotd, timeout);
+		} while ((ret == 0 && !an_io_thread_has_work(iotd)) ||
+		    (ret == -1 && errno == EINTR));
 
 		if (ret < 0) {
-			an_syslog(LOG_CRIT, "Failed to wait on epoll fd: "
+			an_syslog(LOG_CRIT, "Failed to wait for I/O events: "
 			    "%d (%s)", errno, an_strerror(errno));
 			return;
 		}
@@ -1583,7 +4980,7 @@ an_io_thread_loop(struct an_io_thread *iotd)
 			}
 		}
 
-		an_io_thread_process_responses(iotd);
+		(void)an_io_thread_process_responses(iotd, budget);
 
 		for (i = 0; i < ARRAY_SIZE(events); i++) {
 			AN_ARRAY_FOREACH_VAL(&events[i], event) {
@@ -1592,6 +4989,12 @@ an_io_thread_loop(struct an_io_thread *iotd)
 			AN_ARRAY_DEINIT(events_list, &events[i]);
 		}
 
+#ifdef AN_IO_URING
+		if (iotd->uring) {
+			an_io_uring_rearm(iotd, nevents);
+		}
+#endif
+
 		/* Wake worker threads. */
 		n_jobs = ck_ring_size(&iotd->requests_fifo);
 		if (n_jobs > 0) {
@@ -1601,8 +5004,14 @@ an_io_thread_loop(struct an_io_thread *iotd)
 			 * don't care if we wake up too many threads; it
 			 * only matters that we wake up enough.
 			 */
-			ret = eventfd_write(server->workers_eventfd, n_jobs);
-			assert(ret == 0);
+			n_jobs -= an_io_server_wake_workers(server,
+			    iotd->numa_node, n_jobs);
+			if (n_jobs > 0 &&
+			    ck_pr_load_8(&server->notify_fd_used) != 0) {
+				ret = eventfd_write(server->workers_eventfd,
+				    n_jobs);
+				assert(ret == 0);
+			}
 		}
 
 		if ((unsigned)nevents == iotd->nevents) {
@@ -1614,7 +5023,8 @@ an_io_thread_loop(struct an_io_thread *iotd)
 
 		if (ck_pr_load_8(&server->quiesce)) {
 			an_io_thread_quiesce(iotd);
-			if (LIST_EMPTY(&iotd->active_conns)) {
+			if (LIST_EMPTY(&iotd->active_conns) &&
+			    iotd->responses_backlog == NULL) {
 				an_syslog(LOG_NOTICE, "Finished draining all "
 				    "active requests of I/O thread #%d",
 				    (int)(iotd - iotd->server->threads));
@@ -1632,26 +5042,62 @@ static void *
 an_io_thread(void *arg)
 {
 	struct an_io_thread *iotd;
+	struct an_io_server *server;
 	cpu_set_t set;
-	unsigned int n_cpu, i;
+	unsigned int n_cpu, i, idx;
 	int ret;
 
 	iotd = arg;
+	server = iotd->server;
+	idx = iotd - server->threads;
 
+	/*
+	 * When steering connections, the I/O thread must run on the
+	 * CPUs whose connections land on its listeners. Otherwise, spread
+	 * I/O threads over NUMA nodes and keep each on its own.
+	 */
 	CPU_ZERO(&set);
 	n_cpu = numa_num_configured_cpus();
 	for (i = 0; i < n_cpu; i++) {
-		CPU_SET(i, &set);
+		if (server->steer_connections) {
+			if (i % server->num_threads == idx) {
+				CPU_SET(i, &set);
+			}
+		} else if (server->num_nodes == 1 ||
+		    (unsigned int)numa_node_of_cpu(i) ==
+		    idx % server->num_nodes) {
+			CPU_SET(i, &set);
+		}
+	}
+	if (CPU_COUNT(&set) == 0) {
+		/* More I/O threads than CPUs; nothing will be steered here. */
+		for (i = 0; i < n_cpu; i++) {
+			CPU_SET(i, &set);
+		}
 	}
 	ret = sched_setaffinity(0, sizeof(set), &set);
 	if (ret != 0) {
 		an_syslog(LOG_CRIT, "Failed to set affinity for I/O thread: "
 		    "%d (%s)", errno, an_strerror(errno));
 	}
+	iotd->numa_node = an_io_current_node(server);
+	if (server->num_nodes > 1) {
+		an_pool_private_set_node(&input, iotd->numa_node);
+	}
+	if (server->huge_pages) {
+		an_pool_private_set_hugepage(&input, AN_MEMORY_HUGEPAGE_HUGETLB);
+	}
 
+	ck_spinlock_fas_lock(&iotd->input_lock);
+	iotd->input = &input;
+	ck_spinlock_fas_unlock(&iotd->input_lock);
 	sem_post(&iotd->server->startup);
 
 	an_io_thread_loop(iotd);
+	ck_spinlock_fas_lock(&iotd->input_lock);
+	iotd->input = NULL;
+	ck_spinlock_fas_unlock(&iotd->input_lock);
+	an_slab_flush(&responses);
 	return NULL;
 }
 
@@ -1659,14 +5105,22 @@ static void
 an_io_thread_init(struct an_io_thread *iotd, struct an_io_server *server,
     struct an_server_config *config)
 {
-	unsigned int i, ring_buffer_size;
+	unsigned int ring_buffer_size;
 	int epollfd, evfd;
 
-	epollfd = epoll_create1(EPOLL_CLOEXEC);
-	if (epollfd == -1) {
-		an_syslog(LOG_CRIT, "Failed to create epoll instance: %d (%s)",
-		    errno, an_strerror(errno));
-		abort();
+	ck_spinlock_fas_init(&iotd->input_lock);
+	epollfd = -1;
+#ifdef AN_IO_URING
+	iotd->uring = config->io_uring && an_io_uring_init(iotd);
+	if (!iotd->uring)
+#endif
+	{
+		epollfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epollfd == -1) {
+			an_syslog(LOG_CRIT, "Failed to create epoll "
+			    "instance: %d (%s)", errno, an_strerror(errno));
+			abort();
+		}
 	}
 
 	/* For notifications from worker threads. */
@@ -1682,36 +5136,62 @@ an_io_thread_init(struct an_io_thread *iotd, struct an_io_server *server,
 	iotd->quiesce = false;
 	iotd->max_total_connections = config->max_total_connections;
 	iotd->max_active_connections = config->max_active_connections;
+	iotd->pipeline_depth = config->pipeline_depth;
+	iotd->h2_max_streams = 0;
+	if (config->h2c) {
+		iotd->h2_max_streams = config->h2_max_streams > 0 ?
+		    config->h2_max_streams : H2_MAX_STREAMS;
+	}
 	if (config->request_timeout_ms <= 0) {
 		iotd->request_timeout = 0;
 	} else {
 		iotd->request_timeout = an_md_us_to_rdtsc(config->request_timeout_ms * 1000);
 	}
+	if (config->idle_timeout_ms <= 0) {
+		iotd->idle_timeout = 0;
+	} else {
+		iotd->idle_timeout = an_md_us_to_rdtsc(config->idle_timeout_ms * 1000ULL);
+	}
+	an_wheel_init(&iotd->wheel, an_md_rdtsc() >> AN_IO_TICK_SHIFT);
+	iotd->deadlines_head = NULL;
+	iotd->busy_poll = server->busy_poll;
+	iotd->polling = 0;
+
+	memset(&iotd->codel, 0, sizeof(iotd->codel));
+	if (config->codel_target_us > 0) {
+		iotd->codel.target = an_md_us_to_rdtsc(config->codel_target_us);
+		iotd->codel.interval = an_md_us_to_rdtsc(
+		    max(config->codel_interval_us, config->codel_target_us));
+		iotd->codel.min_sojourn = UINT64_MAX;
+	}
 
 	/*
 	 * We need max_active_connections + 1 entries in the ck_ring as you
-	 * can only enqueue capacity - 1 elements at most. Also, the size must
-	 * be a power of 2.
+	 * can only enqueue capacity - 1 elements at most, times the number
+	 * of requests each connection may pipeline (or h2 streams it may
+	 * have open). Also, the size must be a power of 2.
 	 */
-	ring_buffer_size = next_power_of_2(config->max_active_connections + 1);
+	ring_buffer_size = next_power_of_2(config->max_active_connections *
+	    max(max(config->pipeline_depth, 1U), iotd->h2_max_streams) + 1);
 
 	ck_ring_init(&iotd->requests_fifo, ring_buffer_size);
 	iotd->requests_buffer = an_calloc_region(an_io_ring_buffer_token,
 	    ring_buffer_size, sizeof(struct an_http_request));
 
 	iotd->responses_head = NULL;
+	iotd->responses_backlog = NULL;
+	iotd->responses_backlog_tail = &iotd->responses_backlog;
 
 	iotd->connections = an_calloc_region(an_io_connection_token,
 	    config->max_total_connections, sizeof(struct an_io_connection));
 
-	/* Initialize the connections free list */
+	/* Slots are initialized on first use, see an_io_connection_get(). */
 	SLIST_INIT(&iotd->free_conns);
+	iotd->num_conns_used = 0;
+	SLIST_INIT(&iotd->free_actives);
 	LIST_INIT(&iotd->idle_conns);
 	LIST_INIT(&iotd->active_conns);
-	for (i = config->max_total_connections; i > 0; i--) {
-		SLIST_INSERT_HEAD(&iotd->free_conns,
-		    &iotd->connections[i - 1], free_next);
-	}
+	STAILQ_INIT(&iotd->flush_conns);
 
 	iotd->epollfd = epollfd;
 	iotd->nevents = INITIAL_NUM_EVENTS;
@@ -1727,10 +5207,18 @@ an_io_thread_init(struct an_io_thread *iotd, struct an_io_server *server,
 static void
 an_io_thread_deinit(struct an_io_thread *iotd)
 {
+	struct an_io_connection_active *active;
 	struct an_io_listener *listener;
 
 	an_io_deinit(iotd, &iotd->io);
-	close(iotd->epollfd);
+#ifdef AN_IO_URING
+	if (iotd->uring) {
+		io_uring_queue_exit(&iotd->ring);
+	}
+#endif
+	if (iotd->epollfd != -1) {
+		close(iotd->epollfd);
+	}
 
 	AN_ARRAY_FOREACH_VAL(&iotd->listeners, listener) {
 		an_io_listener_destroy(listener);
@@ -1740,10 +5228,22 @@ an_io_thread_deinit(struct an_io_thread *iotd)
 	assert(LIST_EMPTY(&iotd->active_conns));
 	assert(LIST_EMPTY(&iotd->idle_conns));
 
+	while ((active = SLIST_FIRST(&iotd->free_actives)) != NULL) {
+		SLIST_REMOVE_HEAD(&iotd->free_actives, free_next);
+		an_free(an_io_connection_active_token, active);
+	}
+
+#ifdef AN_IO_URING
+	for (uint32_t i = 0; i < iotd->num_conns_used; i++) {
+		an_free(an_io_uring_vec_token, iotd->connections[i].send_vec);
+	}
+#endif
+
 	an_free(an_io_event_token, iotd->events);
 	an_free(an_io_connection_token, iotd->connections);
 	an_free(an_io_ring_buffer_token, iotd->requests_buffer);
 	assert(iotd->responses_head == NULL);
+	assert(iotd->responses_backlog == NULL);
 }
 
 static void
@@ -1755,9 +5255,431 @@ an_io_thread_spawn(struct an_io_thread *iotd)
 	assert(ret == 0);
 }
 
+#ifdef AN_IO_URING
+/*
+ * io_uring backend.
+ *
+ * We keep the readiness model of the epoll backend for reads, and
+ * emulate level-triggered epoll with one-shot poll requests: every I/O
+ * object with a non-empty subscription has a poll request in flight,
+ * which we re-arm after processing its completion. Subscription changes
+ * and re-arms are only queued, and submitted in the same io_uring_enter()
+ * call that waits for completions, instead of costing an epoll_ctl()
+ * system call each.
+ *
+ * Listeners instead have a multishot accept request in flight, whose
+ * completions carry the new sockets, and HTTP/1 responses are written
+ * with a chain of linked sends, one per response, that only completes
+ * once (see an_io_uring_send()). Both need Linux 5.19.
+ */
+static bool
+an_io_uring_init(struct an_io_thread *iotd)
+{
+	struct io_uring_probe *probe;
+	bool recent;
+	int ret;
+
+	ret = io_uring_queue_init(URING_ENTRIES, &iotd->ring, 0);
+	if (ret != 0) {
+		an_syslog(LOG_WARNING, "Failed to set up io_uring, "
+		    "falling back to epoll: %d (%s)", -ret, an_strerror(-ret));
+		return false;
+	}
+
+	/* IORING_OP_SOCKET came with multishot accept, in 5.19. */
+	probe = io_uring_get_probe_ring(&iotd->ring);
+	recent = probe != NULL &&
+	    io_uring_opcode_supported(probe, IORING_OP_SOCKET) &&
+	    (iotd->ring.features & IORING_FEAT_CQE_SKIP) != 0;
+	if (probe != NULL) {
+		io_uring_free_probe(probe);
+	}
+
+	if (recent == false) {
+		an_syslog(LOG_WARNING, "Kernel io_uring is too old, "
+		    "falling back to epoll");
+		io_uring_queue_exit(&iotd->ring);
+		return false;
+	}
+
+	return true;
+}
+
+static struct io_uring_sqe *
+an_io_uring_sqe(struct an_io_thread *iotd)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&iotd->ring);
+	while (AN_CC_UNLIKELY(sqe == NULL)) {
+		/* The submission queue is full, flush it. */
+		(void)io_uring_submit(&iotd->ring);
+		sqe = io_uring_get_sqe(&iotd->ring);
+	}
+
+	return sqe;
+}
+
+_Static_assert(_Alignof(struct an_io) > URING_TAG_MASK,
+    "Completion kinds must fit in the low bits of an an_io pointer");
+
+static inline uint64_t
+an_io_uring_tag(const struct an_io *io, unsigned int kind)
+{
+
+	return (uint64_t)(uintptr_t)io | kind |
+	    ((uint64_t)io->generation << URING_GEN_SHIFT);
+}
+
+/* Listeners get a multishot accept request, everything else a poll. */
+static inline unsigned int
+an_io_uring_kind(const struct an_io *io)
+{
+
+	return io->kind == AN_IO_LISTENER ? URING_TAG_ACCEPT : URING_TAG_POLL;
+}
+
+static void
+an_io_uring_arm(struct an_io_thread *iotd, struct an_io *io)
+{
+	struct io_uring_sqe *sqe;
+
+	io->generation++;
+	sqe = an_io_uring_sqe(iotd);
+	if (io->kind == AN_IO_LISTENER) {
+		io_uring_prep_multishot_accept(sqe, io->fd, NULL, NULL,
+		    SOCK_NONBLOCK | SOCK_CLOEXEC);
+	} else {
+		io_uring_prep_poll_add(sqe, io->fd, io->events);
+	}
+	io_uring_sqe_set_data64(sqe, an_io_uring_tag(io, an_io_uring_kind(io)));
+	io->armed = true;
+}
+
+static void
+an_io_uring_update(struct an_io_thread *iotd, struct an_io *io,
+    uint32_t events)
+{
+	struct io_uring_sqe *sqe;
+
+	if (io->armed) {
+		sqe = an_io_uring_sqe(iotd);
+		io_uring_prep_cancel64(sqe,
+		    an_io_uring_tag(io, an_io_uring_kind(io)), 0);
+		/* We don't care about the removal's own completion. */
+		io_uring_sqe_set_data64(sqe, 0);
+		io->generation++;
+		io->armed = false;
+	}
+
+	io->events = events;
+	if (events != 0) {
+		an_io_uring_arm(iotd, io);
+	}
+}
+
+/*
+ * Queue the socket a multishot accept completion carries. Returns true
+ * if the listener needs an event to have its queue processed.
+ */
+static bool
+an_io_uring_accepted(struct an_io_thread *iotd, struct an_io *io,
+    const struct io_uring_cqe *cqe)
+{
+	struct an_io_listener *listener;
+	bool queued;
+
+	listener = AN_IO_PARENT(io, struct an_io_listener);
+	queued = AN_ARRAY_LENGTH(fd_list, &listener->accepted) > 0;
+	if (cqe->res >= 0) {
+		AN_ARRAY_PUSH(fd_list, &listener->accepted, &cqe->res);
+	} else {
+		an_syslog(LOG_CRIT, "Failed to accept new connection: %d (%s)",
+		    -cqe->res, an_strerror(-cqe->res));
+	}
+
+	if ((cqe->flags & IORING_CQE_F_MORE) == 0) {
+		/* The request is over (e.g., on error); start another. */
+		io->armed = false;
+		if (io->events != 0) {
+			an_io_uring_arm(iotd, io);
+		}
+	}
+
+	return cqe->res >= 0 && queued == false;
+}
+
+/* The io_uring counterpart of epoll_wait(). */
+static int
+an_io_uring_wait(struct an_io_thread *iotd, int timeout)
+{
+	struct io_uring_cqe *cqes[INITIAL_NUM_EVENTS];
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	struct an_io_connection *conn;
+	struct epoll_event *event;
+	struct an_io *io;
+	unsigned int i, n, nevents, kind;
+	uint64_t tag;
+	int ret;
+
+	if (timeout < 0) {
+		ret = io_uring_submit_and_wait(&iotd->ring, 1);
+	} else {
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000LL;
+		ret = io_uring_submit_and_wait_timeout(&iotd->ring, &cqe, 1,
+		    &ts, NULL);
+	}
+
+	if (ret < 0 && ret != -ETIME) {
+		errno = -ret;
+		return -1;
+	}
+
+	nevents = 0;
+	do {
+		n = io_uring_peek_batch_cqe(&iotd->ring, cqes,
+		    min(ARRAY_SIZE(cqes), iotd->nevents - nevents));
+		for (i = 0; i < n; i++) {
+			cqe = cqes[i];
+			tag = io_uring_cqe_get_data64(cqe);
+			if (tag == 0) {
+				continue;
+			}
+
+			kind = tag & URING_TAG_MASK;
+			io = (struct an_io *)(uintptr_t)(tag &
+			    ((1ULL << URING_GEN_SHIFT) - 1) & ~(uint64_t)URING_TAG_MASK);
+			if (kind == URING_TAG_SEND || kind == URING_TAG_SENT) {
+				/*
+				 * Only failed sends complete in the middle of
+				 * a chain; we keep the first failure, or the
+				 * length of the last send.
+				 */
+				conn = AN_IO_PARENT(io, struct an_io_connection);
+				if (conn->send_result >= 0 &&
+				    (cqe->res < 0 || kind == URING_TAG_SENT)) {
+					conn->send_result = cqe->res;
+				}
+
+				if (kind == URING_TAG_SENT) {
+					event = &iotd->events[nevents++];
+					event->data.ptr = io;
+					event->events = URING_EVENT_SENT;
+				}
+				continue;
+			}
+
+			if ((uint16_t)(tag >> URING_GEN_SHIFT) !=
+			    io->generation) {
+				/* Completion for a removed request. */
+				if (kind == URING_TAG_ACCEPT && cqe->res >= 0) {
+					close(cqe->res);
+				}
+				continue;
+			}
+
+			if (kind == URING_TAG_ACCEPT) {
+				if (an_io_uring_accepted(iotd, io, cqe)) {
+					event = &iotd->events[nevents++];
+					event->data.ptr = io;
+					event->events = EPOLLIN;
+				}
+				continue;
+			}
+
+			io->armed = false;
+			event = &iotd->events[nevents++];
+			event->data.ptr = io;
+			if (cqe->res < 0 || (cqe->res & POLLNVAL)) {
+				event->events = EPOLLERR;
+			} else {
+				event->events = cqe->res;
+			}
+		}
+		io_uring_cq_advance(&iotd->ring, n);
+	} while (n > 0 && nevents < iotd->nevents);
+
+	return nevents;
+}
+
+/* Re-arm the poll requests that fired, if still subscribed. */
+static void
+an_io_uring_rearm(struct an_io_thread *iotd, unsigned int nevents)
+{
+	struct an_io *io;
+	unsigned int i;
+
+	for (i = 0; i < nevents; i++) {
+		io = iotd->events[i].data.ptr;
+		if (io->events != 0 && io->armed == false) {
+			an_io_uring_arm(iotd, io);
+		}
+	}
+}
+
+/* Sends are tracked by their connection, not by generation. */
+static inline uint64_t
+an_io_uring_send_tag(const struct an_io *io, unsigned int kind)
+{
+
+	return (uint64_t)(uintptr_t)io | kind;
+}
+
+/*
+ * Write out the responses of @a conn with one sendmsg per response,
+ * linked so that they go out in order. MSG_WAITALL makes a short send
+ * fail the rest of the chain, and only the last send completes when
+ * all goes well: a batch of pipelined responses costs no system call
+ * of its own, and a single completion.
+ */
+static void
+an_io_uring_send(struct an_io_connection *conn)
+{
+	struct an_io_thread *iotd;
+	struct io_uring_sqe *sqe;
+	struct msghdr *msg;
+	size_t j, len;
+	int i, nmsg;
+
+	if (conn->sending > 0) {
+		/* Flushed again; the chain in flight goes first. */
+		return;
+	}
+
+	/*
+	 * The kernel reads the lists until the chain completes; there is
+	 * only ever one chain per connection, so we reuse them.
+	 */
+	iotd = conn->iotd;
+	if (conn->send_vec == NULL) {
+		conn->send_vec = an_calloc_object(an_io_uring_vec_token);
+		if (AN_CC_UNLIKELY(conn->send_vec == NULL)) {
+			an_io_connection_close(conn);
+			an_io_stat_inc(iotd, AN_IO_OOM_FAILURES);
+			return;
+		}
+	}
+
+	msg = conn->send_vec->msg;
+	(void)an_io_connection_gather(conn, conn->send_vec->iov,
+	    MAX_WRITE_IOVECS, msg, &nmsg);
+	if (nmsg == 0) {
+		/* Only empty buffers left. */
+		(void)an_io_connection_written(conn, 0);
+		return;
+	}
+
+	/* A chain split across submissions would lose its ordering. */
+	if (io_uring_sq_space_left(&iotd->ring) < (unsigned int)nmsg) {
+		(void)io_uring_submit(&iotd->ring);
+	}
+
+	len = 0;
+	for (i = 0; i < nmsg; i++) {
+		len = 0;
+		for (j = 0; j < msg[i].msg_iovlen; j++) {
+			len += msg[i].msg_iov[j].iov_len;
+		}
+		conn->sending += len;
+
+		sqe = an_io_uring_sqe(iotd);
+		io_uring_prep_sendmsg(sqe, conn->io.fd, &msg[i],
+		    MSG_WAITALL | MSG_NOSIGNAL);
+		if (i + 1 < nmsg) {
+			io_uring_sqe_set_flags(sqe,
+			    IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+			io_uring_sqe_set_data64(sqe,
+			    an_io_uring_send_tag(&conn->io, URING_TAG_SEND));
+		} else {
+			io_uring_sqe_set_data64(sqe,
+			    an_io_uring_send_tag(&conn->io, URING_TAG_SENT));
+		}
+	}
+
+	conn->send_tail = len;
+	conn->send_result = 0;
+}
+
+/*
+ * Cancel the send chain of a connection we are closing; it still
+ * completes, with -ECANCELED, through an_io_uring_sent().
+ */
+static void
+an_io_uring_cancel_send(struct an_io_connection *conn)
+{
+	static const unsigned int kinds[] = { URING_TAG_SEND, URING_TAG_SENT };
+	struct io_uring_sqe *sqe;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(kinds); i++) {
+		sqe = an_io_uring_sqe(conn->iotd);
+		io_uring_prep_cancel64(sqe,
+		    an_io_uring_send_tag(&conn->io, kinds[i]),
+		    IORING_ASYNC_CANCEL_ALL);
+		io_uring_sqe_set_data64(sqe, 0);
+	}
+}
+
+/* The send chain of @a conn is over: the counterpart of writev(). */
+static void
+an_io_uring_sent(struct an_io_connection *conn)
+{
+	struct an_io_thread *iotd;
+	size_t nbytes;
+	int result;
+
+	iotd = conn->iotd;
+	result = conn->send_result;
+	nbytes = conn->sending - conn->send_tail;
+	conn->sending = 0;
+
+	if (conn->state == HTTP_CONNECTION_CLOSING) {
+		/* Closed meanwhile, see an_io_connection_close(). */
+		an_io_deinit(iotd, &conn->io);
+		if (conn->pending == 0) {
+			an_io_connection_put(conn);
+		}
+		return;
+	}
+
+	if (result < 0) {
+		if (result != -EPIPE) {
+			an_syslog(LOG_CRIT, "Unexpected write error: %d (%s)",
+			    -result, an_strerror(-result));
+			an_io_stat_inc(iotd, AN_IO_WRITE_ERRORS);
+		} else {
+			an_io_stat_inc(iotd, AN_IO_RESET_BY_PEER);
+		}
+
+		an_io_connection_close(conn);
+		return;
+	}
+
+	/* The last send may come up short, e.g. on a signal. */
+	if (!an_io_connection_written(conn, nbytes + result)) {
+		an_io_uring_send(conn);
+	}
+}
+#endif /* AN_IO_URING */
+
+/* Wait for I/O events, filling iotd->events. */
+static int
+an_io_thread_wait(struct an_io_thread *iotd, int timeout)
+{
+
+#ifdef AN_IO_URING
+	if (iotd->uring) {
+		return an_io_uring_wait(iotd, timeout);
+	}
+#endif
+	return epoll_wait(iotd->epollfd, iotd->events, iotd->nevents, timeout);
+}
+
 /* Change the events we're subscribed to for this I/O object */
 static void
-an_io_subscribe(const struct an_io_thread *iotd, struct an_io *io, uint32_t events)
+an_io_subscribe(struct an_io_thread *iotd, struct an_io *io, uint32_t events)
 {
 	struct epoll_event event;
 	struct epoll_event *ev;
@@ -1798,19 +5720,75 @@ an_io_subscribe(const struct an_io_thread *iotd, struct an_io *io, uint32_t even
 		}
 	}
 
+#ifdef AN_IO_URING
+	if (iotd->uring) {
+		an_io_uring_update(iotd, io, events);
+		return;
+	}
+#endif
+
 	ret = epoll_ctl(iotd->epollfd, op, io->fd, ev);
 	assert(ret == 0);
 
 	io->events = events;
 }
 
+#ifdef AN_IO_KTLS
+static SSL_CTX *
+an_io_tls_create(const struct an_server_config *config)
+{
+	SSL_CTX *ctx;
+
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == NULL) {
+		goto fail;
+	}
+
+	/*
+	 * Stick to what the kernel can offload, and avoid any message
+	 * after the handshake: nobody is left to handle them in user
+	 * space.
+	 */
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+	    SSL_OP_CIPHER_SERVER_PREFERENCE);
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_num_tickets(ctx, 0);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	if (SSL_CTX_set_ciphersuites(ctx,
+	    "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384") != 1 ||
+	    SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM") != 1) {
+		goto fail;
+	}
+
+	if (SSL_CTX_use_certificate_chain_file(ctx,
+	    config->tls_certificate) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, config->tls_key,
+	    SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(ctx) != 1) {
+		goto fail;
+	}
+
+	return ctx;
+
+fail:
+	an_syslog(LOG_CRIT, "Failed to set up TLS with certificate %s: %s",
+	    config->tls_certificate,
+	    ERR_error_string(ERR_get_error(), NULL));
+	SSL_CTX_free(ctx);
+	return NULL;
+}
+#endif
+
 struct an_io_server *
 an_io_server_create(struct an_server_config *config)
 {
 	struct an_server_config_listener *listener;
 	config_cb_t conf_cb;
-	int evfd;
+	int evfd, error;
 	unsigned int i;
+#ifdef AN_IO_KTLS
+	SSL_CTX *tls = NULL;
+#endif
 
 	assert(server == NULL);
 	assert(config->max_active_connections <= config->max_total_connections);
@@ -1823,11 +5801,28 @@ an_io_server_create(struct an_server_config *config)
 		return NULL;
 	}
 
+	if (config->tls_certificate != NULL) {
+#ifdef AN_IO_KTLS
+		tls = an_io_tls_create(config);
+		if (tls == NULL) {
+			return NULL;
+		}
+#else
+		/* Better not to start than to serve TLS clients plaintext. */
+		an_syslog(LOG_CRIT, "TLS requested, but an_io_server was "
+		    "built without AN_IO_KTLS.");
+		return NULL;
+#endif
+	}
+
 	/* For notifications to the worker threads. */
 	evfd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE | EFD_NONBLOCK);
 	if (evfd == -1) {
 		an_syslog(LOG_CRIT, "Failed to create eventfd: %d (%s)",
 		    errno, an_strerror(errno));
+#ifdef AN_IO_KTLS
+		SSL_CTX_free(tls);
+#endif
 		return NULL;
 	}
 
@@ -1835,11 +5830,45 @@ an_io_server_create(struct an_server_config *config)
 	server->ready = false;
 	server->quiesce = false;
 	server->workers_eventfd = evfd;
+	server->notify_fd_used = 0;
 	server->max_response_size = config->max_response_size;
+	server->steer_connections = config->steer_connections;
+	server->busy_poll_us = min(config->busy_poll_us, (unsigned int)INT_MAX);
+	server->busy_poll = an_md_us_to_rdtsc(config->busy_poll_us);
+	server->huge_pages = config->huge_pages;
+#ifdef AN_IO_KTLS
+	server->tls = tls;
+#endif
+
+	server->num_nodes = 1;
+	if (numa_available() >= 0) {
+		server->num_nodes = numa_max_node() + 1;
+	}
+	server->idle = an_calloc_region(an_io_idle_list_token,
+	    server->num_nodes, sizeof(struct an_io_idle_list));
+	for (i = 0; i < server->num_nodes; i++) {
+		ck_spinlock_fas_init(&server->idle[i].lock);
+		LIST_INIT(&server->idle[i].workers);
+	}
+
+	if (server->num_nodes > 1 && server->num_nodes <= OUTPUT_POOLS) {
+		for (i = 0; i < server->num_nodes; i++) {
+			an_pool_shared_set_node(&output[i], i);
+		}
+	}
+	if (server->huge_pages) {
+		for (i = 0; i < OUTPUT_POOLS; i++) {
+			an_pool_shared_set_hugepage(&output[i],
+			    AN_MEMORY_HUGEPAGE_HUGETLB);
+		}
+	}
+	error = pthread_key_create(&server->worker_key, an_io_worker_destroy);
+	assert(error == 0);
 
 	/* Initialize parser settings with our callbacks */
 	http_parser_settings_init(&server->parser_settings);
 	server->parser_settings.on_url = on_url;
+	server->parser_settings.on_headers_complete = on_headers_complete;
 	server->parser_settings.on_body = on_body;
 	server->parser_settings.on_message_complete = on_message_complete;
 
@@ -1889,12 +5918,20 @@ an_io_server_destroy(struct an_io_server *server)
 
 	close(server->workers_eventfd);
 
+	/* Workers outliving the server keep their eventfd. */
+	pthread_key_delete(server->worker_key);
+
 	for (i = 0; i < server->num_threads; i++) {
 		iotd = &server->threads[i];
 		pthread_join(iotd->thread, NULL);
 		an_io_thread_deinit(iotd);
 	}
 	an_free(an_io_thread_token, server->threads);
+	an_free(an_io_idle_list_token, server->idle);
+
+#ifdef AN_IO_KTLS
+	SSL_CTX_free(server->tls);
+#endif
 
 #ifdef AN_IO_DEBUG
 	close(server->tracefd);
@@ -1940,6 +5977,150 @@ an_io_server_ready(const struct an_io_server *server)
 
 /* Worker threads API */
 
+static unsigned int
+an_io_current_node(const struct an_io_server *server)
+{
+	int cpu, node;
+
+	if (server->num_nodes == 1) {
+		return 0;
+	}
+
+	cpu = sched_getcpu();
+	if (cpu < 0) {
+		return 0;
+	}
+
+	node = numa_node_of_cpu(cpu);
+	if (node < 0) {
+		return 0;
+	}
+
+	return (unsigned int)node % server->num_nodes;
+}
+
+static void
+an_io_worker_destroy(void *arg)
+{
+	struct an_io_worker *worker = arg;
+	struct an_io_idle_list *idle;
+
+	/*
+	 * I/O threads only write to our eventfd with the idle list's
+	 * lock held, so once we get it nobody can still be using it.
+	 */
+	idle = &server->idle[worker->node];
+	ck_spinlock_fas_lock(&idle->lock);
+	assert(worker->parked == false);
+	ck_spinlock_fas_unlock(&idle->lock);
+
+	close(worker->fd);
+	an_free(an_io_worker_token, worker);
+	an_slab_flush(&responses);
+}
+
+static struct an_io_worker *
+an_io_worker_get(struct an_io_server *server)
+{
+	struct an_io_worker *worker;
+	int ret;
+
+	worker = an_io_worker_self;
+	if (AN_CC_LIKELY(worker != NULL)) {
+		return worker;
+	}
+
+	worker = an_calloc_object(an_io_worker_token);
+	worker->fd = eventfd(0, EFD_CLOEXEC);
+	if (worker->fd == -1) {
+		an_syslog(LOG_CRIT, "Failed to create eventfd: %d (%s)",
+		    errno, an_strerror(errno));
+		abort();
+	}
+
+	ret = pthread_setspecific(server->worker_key, worker);
+	assert(ret == 0);
+	an_io_worker_self = worker;
+	return worker;
+}
+
+static void
+an_io_worker_park(struct an_io_server *server, struct an_io_worker *worker)
+{
+	struct an_io_idle_list *idle;
+
+	worker->node = an_io_current_node(server);
+	idle = &server->idle[worker->node];
+
+	ck_spinlock_fas_lock(&idle->lock);
+	worker->parked = true;
+	LIST_INSERT_HEAD(&idle->workers, worker, idle_entry);
+	ck_pr_store_uint(&idle->count, idle->count + 1);
+	ck_spinlock_fas_unlock(&idle->lock);
+
+	/* Pairs with the fence in an_io_server_wake_workers(). */
+	ck_pr_fence_memory();
+}
+
+static void
+an_io_worker_unpark(struct an_io_server *server, struct an_io_worker *worker)
+{
+	struct an_io_idle_list *idle;
+
+	idle = &server->idle[worker->node];
+
+	ck_spinlock_fas_lock(&idle->lock);
+	if (worker->parked == true) {
+		worker->parked = false;
+		LIST_REMOVE(worker, idle_entry);
+		ck_pr_store_uint(&idle->count, idle->count - 1);
+	}
+	ck_spinlock_fas_unlock(&idle->lock);
+}
+
+/*
+ * Wake up to n parked workers, preferring those on the given NUMA node.
+ * Returns the number of workers woken up.
+ */
+static unsigned int
+an_io_server_wake_workers(struct an_io_server *server, unsigned int node,
+    unsigned int n)
+{
+	struct an_io_idle_list *idle;
+	struct an_io_worker *worker;
+	unsigned int i, woken;
+	int ret;
+
+	/*
+	 * Make sure our enqueued requests are visible before we look
+	 * for idle workers; pairs with the fence in an_io_worker_park().
+	 */
+	ck_pr_fence_memory();
+
+	woken = 0;
+	for (i = 0; i < server->num_nodes && woken < n; i++) {
+		idle = &server->idle[(node + i) % server->num_nodes];
+		if (ck_pr_load_uint(&idle->count) == 0) {
+			continue;
+		}
+
+		ck_spinlock_fas_lock(&idle->lock);
+		while (woken < n &&
+		    (worker = LIST_FIRST(&idle->workers)) != NULL) {
+			worker->parked = false;
+			LIST_REMOVE(worker, idle_entry);
+			ck_pr_store_uint(&idle->count, idle->count - 1);
+
+			ret = eventfd_write(worker->fd, 1);
+			assert(ret == 0);
+			woken++;
+		}
+		ck_spinlock_fas_unlock(&idle->lock);
+	}
+
+	return woken;
+}
+
 /*
  * Return the notification eventfd for worker threads.
  *
@@ -1950,53 +6131,288 @@ int
 an_io_server_notify_fd(struct an_io_server *server)
 {
 
+	ck_pr_store_8(&server->notify_fd_used, 1);
 	return server->workers_eventfd;
 }
 
-/* Attempt to steal a request off the FIFO. */
-int
-an_io_server_tryread(struct an_io_server *server, struct an_http_request *req)
+static const char an_io_503[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+/*
+ * Whether we should answer a request we just dequeued with a 503
+ * rather than hand it over, see struct an_io_codel.
+ */
+static bool
+an_io_codel_shed(struct an_io_thread *iotd, const struct an_http_request *req,
+    uint64_t now)
+{
+	struct an_io_codel *codel;
+	uint64_t sojourn, min_sojourn, end;
+
+	codel = &iotd->codel;
+	if (AN_CC_LIKELY(codel->target == 0)) {
+		return false;
+	}
+
+	sojourn = now > req->start ? now - req->start : 0;
+
+	min_sojourn = ck_pr_load_64(&codel->min_sojourn);
+	while (sojourn < min_sojourn &&
+	    !ck_pr_cas_64_value(&codel->min_sojourn, min_sojourn, sojourn,
+	    &min_sojourn));
+
+	/* Whoever wins the CAS closes the interval. */
+	end = ck_pr_load_64(&codel->interval_end);
+	if (now >= end &&
+	    ck_pr_cas_64(&codel->interval_end, end, now + codel->interval)) {
+		min_sojourn = ck_pr_fas_64(&codel->min_sojourn, UINT64_MAX);
+		ck_pr_store_8(&codel->overloaded,
+		    min_sojourn > codel->target);
+	}
+
+	return ck_pr_load_8(&codel->overloaded) != 0 &&
+	    sojourn > codel->target;
+}
+
+static void
+an_io_server_reject(struct an_io_server *server, struct an_io_thread *iotd,
+    an_request_id_t id)
+{
+	struct an_buffer *buf;
+
+	/* NULL on failure, which closes the connection instead. */
+	buf = an_io_get_refbuf(server, id, an_io_503, sizeof(an_io_503) - 1,
+	    NULL, NULL);
+	an_io_server_write(server, id, buf);
+	an_io_stat_inc(iotd, AN_IO_SHED_REQUESTS);
+}
+
+/*
+ * CK_RING_DEQUEUE_SPMC for up to @a n requests at once: like ck_ring's
+ * multi-consumer dequeue, but we claim every slot we copy with a single
+ * CAS on the consumer head, rather than one CAS per request.
+ */
+static unsigned int
+an_io_requests_dequeue(struct ck_ring *ring,
+    const struct an_http_request *buffer, struct an_http_request *reqs,
+    unsigned int n)
+{
+	const unsigned int mask = ring->mask;
+	unsigned int consumer, producer, count, i;
+
+	consumer = ck_pr_load_uint(&ring->c_head);
+	do {
+		ck_pr_fence_load();
+		producer = ck_pr_load_uint(&ring->p_tail);
+		count = min(n, producer - consumer);
+		if (count == 0) {
+			return 0;
+		}
+
+		ck_pr_fence_load();
+		for (i = 0; i < count; i++) {
+			reqs[i] = buffer[(consumer + i) & mask];
+		}
+
+		ck_pr_fence_store_atomic();
+	} while (ck_pr_cas_uint_value(&ring->c_head, consumer,
+	    consumer + count, &consumer) == false);
+
+	return count;
+}
+
+/* Dequeue up to n requests off the FIFO of a single I/O thread. */
+static size_t
+an_io_server_dequeue_batch(struct an_io_server *server,
+    struct an_io_thread *iotd, struct an_http_request *reqs, size_t n,
+    uint64_t *now)
+{
+	struct an_io_request_times *times;
+	struct an_io_connection *conn;
+	unsigned int got, i;
+	size_t base, count;
+
+	count = 0;
+	while (count < n) {
+		got = an_io_requests_dequeue(&iotd->requests_fifo,
+		    iotd->requests_buffer, &reqs[count],
+		    (unsigned int)min(n - count, (size_t)UINT_MAX));
+		if (got == 0) {
+			break;
+		}
+
+		if (*now == 0) {
+			*now = an_md_rdtsc();
+		}
+
+		/* Compact the batch over the requests we shed. */
+		base = count;
+		for (i = 0; i < got; i++) {
+			struct an_http_request *req = &reqs[base + i];
+
+			/* For the I/O thread's latency histograms. */
+			conn = an_io_thread_connection_select(iotd, req->id);
+			if (AN_CC_LIKELY(conn != NULL)) {
+				times = an_io_connection_times(conn,
+				    an_io_connection_slot(conn, req->id));
+				ck_pr_store_64(&times->dequeued, *now);
+			}
+
+			if (AN_CC_UNLIKELY(an_io_codel_shed(iotd, req,
+			    *now))) {
+				an_io_server_reject(server, iotd, req->id);
+				continue;
+			}
+
+			reqs[count++] = *req;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Attempt to steal up to n requests off the FIFOs. Once we find a
+ * non-empty FIFO, we only dequeue from that one. FIFOs of I/O threads
+ * on our NUMA node come first, as their buffers are local to us.
+ */
+size_t
+an_io_server_tryread_batch(struct an_io_server *server,
+    struct an_http_request *reqs, size_t n)
 {
 	struct an_io_thread *iotd;
-	bool success;
-	unsigned int i, start;
+	unsigned int i, node, pass, start;
+	uint64_t now;
+	size_t count;
+	bool local;
+
+	if (n == 0) {
+		return 0;
+	}
 
+	now = 0;
+	local = server->num_nodes > 1;
+	node = local ? an_io_current_node(server) : 0;
 	start = an_random_below(server->num_threads);
-	i = start;
+	for (pass = local ? 0 : 1; pass < 2; pass++) {
+		i = start;
+		do {
+			iotd = &server->threads[i];
+			i = (i + 1) % server->num_threads;
+			if (local && (iotd->numa_node == node) != (pass == 0)) {
+				continue;
+			}
+
+			count = an_io_server_dequeue_batch(server, iotd, reqs,
+			    n, &now);
+			if (count > 0) {
+				return count;
+			}
+		} while (i != start);
+	}
+
+	return 0;
+}
+
+/*
+ * Keep trying to steal requests for up to busy_poll cycles, before
+ * an_io_server_read_batch() parks us.
+ */
+static size_t
+an_io_server_spin_batch(struct an_io_server *server,
+    struct an_http_request *reqs, size_t n)
+{
+	uint64_t end;
+	size_t count;
+
+	if (server->busy_poll == 0) {
+		return 0;
+	}
+
+	end = an_md_rdtsc() + server->busy_poll;
 	do {
-		iotd = &server->threads[i];
-		success = CK_RING_DEQUEUE_SPMC(requests, &iotd->requests_fifo,
-		    iotd->requests_buffer, req);
-		if (success == true) {
-			return 0;
+		ck_pr_stall();
+		count = an_io_server_tryread_batch(server, reqs, n);
+		if (count > 0) {
+			return count;
 		}
-		i = (i + 1) % server->num_threads;
-	} while (i != start);
+	} while (an_md_rdtsc() < end);
 
-	return -1;
+	return 0;
 }
 
-void
-an_io_server_read(struct an_io_server *server, struct an_http_request *req)
+/* Attempt to steal a request off the FIFO. */
+int
+an_io_server_tryread(struct an_io_server *server, struct an_http_request *req)
 {
+
+	return an_io_server_tryread_batch(server, req, 1) == 1 ? 0 : -1;
+}
+
+size_t
+an_io_server_read_batch(struct an_io_server *server,
+    struct an_http_request *reqs, size_t n)
+{
+	struct an_io_worker *worker;
 	eventfd_t value;
+	size_t count;
 	int ret;
 
+	assert(n > 0);
+	worker = NULL;
 	for (;;) {
 		/* We always try to grab items before blocking on eventfd. */
-		ret = an_io_server_tryread(server, req);
-		if (ret == 0) {
-			return;
+		count = an_io_server_tryread_batch(server, reqs, n);
+		if (count > 0) {
+			return count;
+		}
+
+		if (worker == NULL) {
+			count = an_io_server_spin_batch(server, reqs, n);
+			if (count > 0) {
+				return count;
+			}
+
+			worker = an_io_worker_get(server);
+		}
+
+		/*
+		 * Check the FIFOs once more after parking, or we could
+		 * miss a request enqueued right before we showed up on
+		 * the idle list.
+		 */
+		an_io_worker_park(server, worker);
+		count = an_io_server_tryread_batch(server, reqs, n);
+		if (count > 0) {
+			/*
+			 * If an I/O thread beat us to it, its wakeup will
+			 * only cost us one extra pass next time.
+			 */
+			an_io_worker_unpark(server, worker);
+			return count;
 		}
 
-		ret = eventfd_read(server->workers_eventfd, &value);
+		ret = eventfd_read(worker->fd, &value);
 		assert(ret == 0);
 	}
 }
 
+void
+an_io_server_read(struct an_io_server *server, struct an_http_request *req)
+{
+
+	(void)an_io_server_read_batch(server, req, 1);
+}
+
+/*
+ * Push the chain of responses from head to tail (newest first) onto
+ * the response stack.
+ */
 static void
-an_io_thread_push_response(struct an_io_thread *iotd,
-    struct an_http_response *resp)
+an_io_thread_push_responses(struct an_io_thread *iotd,
+    struct an_http_response *head, struct an_http_response *tail)
 {
 	struct an_http_response *orig;
 
@@ -2005,17 +6421,48 @@ an_io_thread_push_response(struct an_io_thread *iotd,
 	 * is empty, in order to avoid acquiring the cache line for reads,
 	 * only to acquire it for writes shortly after.
 	 */
-	resp->next = NULL;
+	tail->next = NULL;
 	ck_pr_fence_store();
-	if (ck_pr_cas_ptr_value(&iotd->responses_head, NULL, resp, &orig)) {
+	if (ck_pr_cas_ptr_value(&iotd->responses_head, NULL, head, &orig)) {
 		return;
 	}
 
 	do {
-		resp->next = orig;
+		tail->next = orig;
 		ck_pr_fence_store();
 	} while (!ck_pr_cas_ptr_value(&iotd->responses_head,
-	    resp->next, resp, &orig));
+	    tail->next, head, &orig));
+}
+
+/*
+ * Let the I/O thread know the deadline of a connection moved closer.
+ * A connection is only queued once until the I/O thread pops it.
+ */
+static void
+an_io_thread_push_deadline(struct an_io_thread *iotd,
+    struct an_io_connection *conn)
+{
+	struct an_io_connection *orig;
+
+	if (ck_pr_fas_8(&conn->deadline_queued, 1) != 0) {
+		return;
+	}
+
+	do {
+		orig = ck_pr_load_ptr(&iotd->deadlines_head);
+		conn->deadline_next = orig;
+		ck_pr_fence_store();
+	} while (!ck_pr_cas_ptr(&iotd->deadlines_head, orig, conn));
+
+	an_io_thread_notify(iotd);
+}
+
+static void
+an_io_thread_push_response(struct an_io_thread *iotd,
+    struct an_http_response *resp)
+{
+
+	an_io_thread_push_responses(iotd, resp, resp);
 }
 
 static void
@@ -2024,14 +6471,25 @@ an_io_thread_send(struct an_io_thread *iotd, an_request_id_t id,
 {
 	struct an_http_response *resp;
 
-	resp = an_calloc_object(an_http_response_token);
-	resp->id = id;
-	resp->buf = buf;
-
+	resp = an_http_response_get(id, buf);
 	an_io_thread_push_response(iotd, resp);
 
 	/* Notify the I/O thread. */
-	an_io_thread_wakeup(iotd);
+	an_io_thread_notify(iotd);
+}
+
+/* The output pool local to the I/O thread that will write the response. */
+static struct an_pool_shared *
+an_io_output_pool(const struct an_io_server *server, an_request_id_t id)
+{
+	struct an_request_location loc;
+
+	loc = an_request_id_decode(id);
+	if (AN_CC_UNLIKELY(loc.iotd_idx >= server->num_threads)) {
+		return &output[0];
+	}
+
+	return &output[server->threads[loc.iotd_idx].numa_node % OUTPUT_POOLS];
 }
 
 struct an_buffer *
@@ -2061,13 +6519,16 @@ an_io_get_outbuf(struct an_io_server *server, an_request_id_t id, size_t want)
 		buf->in = 0;
 		buf->out = 0;
 		buf->size = want;
+		buf->next = NULL;
 		buf->external_allocation = true;
+		buf->release = NULL;
+		buf->release_arg = NULL;
 		ck_pr_add_64(&an_server_large_allocations,
 		    malloc_usable_size(buf->data));
 		return buf;
 	}
 
-	buf = an_pool_get(&output, want);
+	buf = an_pool_get(an_io_output_pool(server, id), want);
 	if (AN_CC_UNLIKELY(buf == NULL)) {
 		goto fail;
 	}
@@ -2080,6 +6541,39 @@ fail:
 	return NULL;
 }
 
+struct an_buffer *
+an_io_get_refbuf(struct an_io_server *server, an_request_id_t id,
+    const void *data, size_t len, void (*release)(void *), void *arg)
+{
+	struct an_buffer *buf;
+
+	if (AN_CC_UNLIKELY(len > server->max_response_size)) {
+		goto fail;
+	}
+
+	/* Only the descriptor comes from the pool, the data stays put. */
+	buf = an_pool_alloc(an_io_output_pool(server, id),
+	    sizeof(struct an_buffer), false, 8);
+	if (AN_CC_UNLIKELY(buf == NULL)) {
+		goto fail;
+	}
+
+	buf->data = (char *)data;
+	buf->in = len;
+	buf->out = 0;
+	buf->size = len;
+	buf->next = NULL;
+	buf->external_allocation = false;
+	buf->release = release;
+	buf->release_arg = arg;
+	return buf;
+
+fail:
+	an_syslog(LOG_CRIT, "Outqueue allocation failure, "
+	    "failed to reference %zu bytes.", len);
+	return NULL;
+}
+
 void
 an_io_server_write(struct an_io_server *server, an_request_id_t id,
     struct an_buffer *buf)
@@ -2094,12 +6588,53 @@ an_io_server_write(struct an_io_server *server, an_request_id_t id,
 	an_rtbr_poll(false);
 }
 
+void
+an_io_server_write_batch(struct an_io_server *server,
+    const an_request_id_t *ids, struct an_buffer **bufs, size_t n)
+{
+	struct an_http_response *head, *tail, *resp;
+	struct an_io_thread *iotd, *current;
+	size_t i;
+
+	current = NULL;
+	head = tail = NULL;
+	for (i = 0; i < n; i++) {
+		iotd = an_io_thread_select(server, ids[i]);
+		if (AN_CC_UNLIKELY(iotd == NULL)) {
+			continue;
+		}
+
+		if (iotd != current && head != NULL) {
+			an_io_thread_push_responses(current, head, tail);
+			an_io_thread_notify(current);
+			head = tail = NULL;
+		}
+		current = iotd;
+
+		resp = an_http_response_get(ids[i], bufs[i]);
+
+		/* Newest first, like the response stack itself. */
+		resp->next = head;
+		head = resp;
+		if (tail == NULL) {
+			tail = resp;
+		}
+	}
+
+	if (head != NULL) {
+		an_io_thread_push_responses(current, head, tail);
+		an_io_thread_notify(current);
+	}
+
+	an_rtbr_poll(false);
+}
+
 int
 an_io_set_deadline(an_request_id_t id, unsigned int deadline_us)
 {
 	struct an_io_server *server;
 	struct an_io_connection *conn;
-	uint64_t timeout;
+	uint64_t timeout, old;
 
 	server = server_config->server;
 	conn = an_io_connection_select(server, id);
@@ -2107,12 +6642,24 @@ an_io_set_deadline(an_request_id_t id, unsigned int deadline_us)
 		return -1;
 	}
 
-	if (conn->state != HTTP_CONNECTION_PROCESSING) {
+	if (ck_pr_load_32(&conn->pending) == 0) {
 		return -1;
 	}
 
 	timeout = an_md_us_to_rdtsc(deadline_us);
-	ck_pr_store_64(&conn->timeout, timeout);
+	old = ck_pr_fas_64(&conn->timeout, timeout);
+	if (old == 0) {
+		old = conn->iotd->request_timeout;
+	}
+
+	/*
+	 * The I/O thread re-checks deadlines when their timer fires, so
+	 * it only needs to hear about deadlines moving closer.
+	 */
+	if (timeout < old && conn->iotd->request_timeout != 0) {
+		an_io_thread_push_deadline(conn->iotd, conn);
+	}
+
 	return 0;
 }
 
@@ -2130,7 +6677,7 @@ an_io_get_tcp_info(an_request_id_t id, struct tcp_info *tcpi)
 		return -1;
 	}
 
-	if (conn->state != HTTP_CONNECTION_PROCESSING) {
+	if (ck_pr_load_32(&conn->pending) == 0) {
 		return -1;
 	}
 
@@ -23,19 +23,84 @@ struct an_server_config {
 	size_t max_response_size;
 	unsigned int num_threads;
 	int request_timeout_ms;
+	/* Close connections idle for that long; 0 or less to disable. */
+	int idle_timeout_ms;
+	/*
+	 * CoDel-style admission control: when requests keep waiting more
+	 * than codel_target_us before a worker picks them up, for at least
+	 * codel_interval_us, those waiting longer than the target get a
+	 * 503 instead. A target of 0 disables it.
+	 */
+	unsigned int codel_target_us;
+	unsigned int codel_interval_us;
+	/*
+	 * Maximum number of pipelined requests we accept from a single
+	 * connection at once. 0 or 1 disables HTTP pipelining.
+	 */
+	unsigned int pipeline_depth;
+	/*
+	 * Drive I/O threads with io_uring instead of epoll. Only effective
+	 * when built with AN_IO_URING; we fall back to epoll on kernels
+	 * older than Linux 5.19.
+	 */
+	bool io_uring;
+	/*
+	 * Steer new connections to the I/O thread whose listener shares
+	 * the CPU that received them, and pin I/O threads accordingly.
+	 */
+	bool steer_connections;
+	/*
+	 * Terminate TLS on every listener, with this PEM certificate chain
+	 * and private key. Only the handshake is done in user space; the
+	 * session is then handed over to kernel TLS. This requires a build
+	 * with AN_IO_KTLS, and the tls kernel module.
+	 */
+	char *tls_certificate;
+	char *tls_key;
+	/*
+	 * Also speak HTTP/2 to cleartext clients that open with the h2
+	 * connection preface (prior knowledge, no Upgrade), with up to
+	 * h2_max_streams concurrent requests each (100 if 0). Handlers see
+	 * those requests as HTTP/1.1, and respond the same way; chunked
+	 * responses are not supported over HTTP/2.
+	 */
+	bool h2c;
+	unsigned int h2_max_streams;
+	/*
+	 * Busy poll for up to that many microseconds before blocking: I/O
+	 * threads for socket events and responses, workers for requests.
+	 * Sockets also get SO_BUSY_POLL with the same budget. This burns
+	 * CPU for lower wakeup latency, and is meant for dedicated cores.
+	 * 0 to always block right away.
+	 */
+	unsigned int busy_poll_us;
+	/*
+	 * Back input and output buffers with 2MB pages: hugetlbfs pages
+	 * when the kernel has some reserved (vm.nr_hugepages), transparent
+	 * huge pages otherwise.
+	 */
+	bool huge_pages;
 	AN_ARRAY_INSTANCE(an_server_config_listener) listeners;
 };
 
 /*
  * Internal HTTP buffers. Do not use directly; wrap it
  * in an an_wbuf using an_buf_http_wrap() instead.
+ *
+ * A response may be made of several buffers chained through the next
+ * field (e.g., headers and body), which are written out with a single
+ * writev() call.
  */
 struct an_buffer {
 	char *data;
 	size_t size;
 	size_t in;	/* Offset for reads (from socket to buffer) */
 	size_t out;	/* Offset for writes (from buffer to socket) */
+	struct an_buffer *next;	/* Next fragment of the same response */
 	bool external_allocation;	/* Allocated using plain malloc() */
+	/* Set for fragments referencing memory we do not own. */
+	void (*release)(void *);
+	void *release_arg;
 };
 
 struct tcp_info;
@@ -53,6 +118,7 @@ struct an_http_request {
 	uint32_t uri_len;
 	uint32_t body_offset;
 	uint32_t body_len;
+	uint64_t start;		/* an_md_rdtsc() when we started reading it */
 };
 
 struct an_io_server;
@@ -109,12 +175,46 @@ int an_io_server_notify_fd(struct an_io_server *);
 void an_io_server_read(struct an_io_server *, struct an_http_request *);
 int an_io_server_tryread(struct an_io_server *, struct an_http_request *);
 
-/* Low-level API for handlers, use an_http instead. */
+/*
+ * Batched variants of the above: dequeue up to n requests at once, all
+ * from the same I/O thread. an_io_server_read_batch() blocks until at
+ * least one request is available; both return the number of requests
+ * stored in the array.
+ */
+size_t an_io_server_read_batch(struct an_io_server *,
+    struct an_http_request *, size_t);
+size_t an_io_server_tryread_batch(struct an_io_server *,
+    struct an_http_request *, size_t);
+
+/*
+ * Low-level API for handlers, use an_http instead.
+ *
+ * The request buffer must not be accessed anymore once the response
+ * has been submitted, as the I/O thread may reuse it right away.
+ */
 struct an_buffer *an_io_get_outbuf(struct an_io_server *,
     an_request_id_t, size_t);
 void an_io_server_write(struct an_io_server *, an_request_id_t,
     struct an_buffer *);
 
+/*
+ * Return a response fragment referencing @a len bytes of immutable
+ * memory at @a data, to be chained after an output buffer instead of
+ * copying the data into it. The memory must stay valid until
+ * @a release (if non-NULL) is called with @a arg, from the I/O thread,
+ * once the fragment has been written out or dropped.
+ */
+struct an_buffer *an_io_get_refbuf(struct an_io_server *, an_request_id_t,
+    const void *, size_t, void (*)(void *), void *);
+
+/*
+ * Submit n responses at once. Responses for the same I/O thread are
+ * handed over together, with a single wakeup, so callers should keep
+ * them grouped as returned by an_io_server_read_batch().
+ */
+void an_io_server_write_batch(struct an_io_server *, const an_request_id_t *,
+    struct an_buffer **, size_t);
+
 /* API for handlers. */
 int an_io_set_deadline(an_request_id_t, unsigned int);
 int an_io_get_tcp_info(an_request_id_t, struct tcp_info *);
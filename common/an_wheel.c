@@ -0,0 +1,257 @@
+#include <assert.h>
+#include <string.h>
+
+#include <acf/an_util.h>
+
+#include "common/an_cc.h"
+#include "common/an_wheel.h"
+
+#define AN_WHEEL_MASK		((uint64_t)AN_WHEEL_SLOTS - 1)
+#define AN_WHEEL_RANGE		(1ULL << (AN_WHEEL_BITS * AN_WHEEL_LEVELS))
+/* Level of the timers sitting on the expired list. */
+#define AN_WHEEL_EXPIRED	AN_WHEEL_LEVELS
+
+_Static_assert(AN_WHEEL_SLOTS == 64,
+    "Slot occupancy is tracked with one uint64_t bitmap per level");
+
+static inline uint64_t
+rotate_right(uint64_t x, unsigned int n)
+{
+
+	n &= 63;
+	return n == 0 ? x : (x >> n) | (x << (64 - n));
+}
+
+void
+an_wheel_init(struct an_wheel *wheel, uint64_t now)
+{
+	unsigned int i, j;
+
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = now;
+	for (i = 0; i < AN_WHEEL_LEVELS; i++) {
+		for (j = 0; j < AN_WHEEL_SLOTS; j++) {
+			LIST_INIT(&wheel->slots[i][j]);
+		}
+	}
+	LIST_INIT(&wheel->expired);
+}
+
+void
+an_wheel_timer_init(struct an_wheel_timer *timer)
+{
+
+	memset(timer, 0, sizeof(*timer));
+	timer->armed = false;
+}
+
+/*
+ * Insert an armed timer in the slot matching its deadline. Deadlines
+ * in the past go to the current slot, and deadlines beyond the range
+ * of the wheel to the last slot we can represent.
+ */
+static void
+an_wheel_place(struct an_wheel *wheel, struct an_wheel_timer *timer)
+{
+	uint64_t delta, when;
+	unsigned int level, slot;
+
+	when = max(timer->deadline, wheel->now);
+	delta = when - wheel->now;
+	if (AN_CC_UNLIKELY(delta >= AN_WHEEL_RANGE)) {
+		delta = AN_WHEEL_RANGE - 1;
+		when = wheel->now + delta;
+	}
+
+	level = 0;
+	if (delta >= AN_WHEEL_SLOTS) {
+		level = (63 - __builtin_clzll(delta)) / AN_WHEEL_BITS;
+	}
+
+	slot = (when >> (AN_WHEEL_BITS * level)) & AN_WHEEL_MASK;
+	timer->level = level;
+	timer->slot = slot;
+	LIST_INSERT_HEAD(&wheel->slots[level][slot], timer, next);
+	wheel->occupied[level] |= 1ULL << slot;
+}
+
+static void
+an_wheel_unlink(struct an_wheel *wheel, struct an_wheel_timer *timer)
+{
+
+	LIST_REMOVE(timer, next);
+	if (timer->level == AN_WHEEL_EXPIRED) {
+		return;
+	}
+
+	if (LIST_EMPTY(&wheel->slots[timer->level][timer->slot])) {
+		wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+	}
+}
+
+void
+an_wheel_add(struct an_wheel *wheel, struct an_wheel_timer *timer,
+    uint64_t deadline)
+{
+
+	if (timer->armed == true) {
+		an_wheel_unlink(wheel, timer);
+	} else {
+		timer->armed = true;
+		wheel->count++;
+	}
+
+	timer->deadline = deadline;
+	an_wheel_place(wheel, timer);
+}
+
+void
+an_wheel_remove(struct an_wheel *wheel, struct an_wheel_timer *timer)
+{
+
+	if (timer->armed == false) {
+		return;
+	}
+
+	an_wheel_unlink(wheel, timer);
+	timer->armed = false;
+	assert(wheel->count > 0);
+	wheel->count--;
+}
+
+/*
+ * Redistribute the timers of an upper level slot, now that its span
+ * starts at the current tick. They always land in lower levels.
+ */
+static void
+an_wheel_cascade(struct an_wheel *wheel, unsigned int level, unsigned int slot)
+{
+	struct an_wheel_list *list;
+	struct an_wheel_timer *timer;
+
+	list = &wheel->slots[level][slot];
+	wheel->occupied[level] &= ~(1ULL << slot);
+	while ((timer = LIST_FIRST(list)) != NULL) {
+		LIST_REMOVE(timer, next);
+		an_wheel_place(wheel, timer);
+	}
+}
+
+/* Called whenever the current tick wraps level 0 around. */
+static void
+an_wheel_turn(struct an_wheel *wheel)
+{
+	unsigned int level, slot;
+
+	for (level = 1; level < AN_WHEEL_LEVELS; level++) {
+		slot = (wheel->now >> (AN_WHEEL_BITS * level)) & AN_WHEEL_MASK;
+		an_wheel_cascade(wheel, level, slot);
+		if (slot != 0) {
+			break;
+		}
+	}
+}
+
+/* Move the timers in the current level 0 slot to the expired list. */
+static void
+an_wheel_drain(struct an_wheel *wheel)
+{
+	struct an_wheel_list *list;
+	struct an_wheel_timer *timer;
+	unsigned int slot;
+
+	slot = wheel->now & AN_WHEEL_MASK;
+	list = &wheel->slots[0][slot];
+	wheel->occupied[0] &= ~(1ULL << slot);
+	while ((timer = LIST_FIRST(list)) != NULL) {
+		LIST_REMOVE(timer, next);
+		if (AN_CC_UNLIKELY(timer->deadline > wheel->now)) {
+			/* Clamped deadline, not there yet. */
+			an_wheel_place(wheel, timer);
+			continue;
+		}
+
+		timer->level = AN_WHEEL_EXPIRED;
+		LIST_INSERT_HEAD(&wheel->expired, timer, next);
+	}
+}
+
+struct an_wheel_timer *
+an_wheel_expire(struct an_wheel *wheel, uint64_t now)
+{
+	struct an_wheel_timer *timer;
+	uint64_t next;
+
+	for (;;) {
+		timer = LIST_FIRST(&wheel->expired);
+		if (timer != NULL) {
+			LIST_REMOVE(timer, next);
+			timer->armed = false;
+			wheel->count--;
+			return timer;
+		}
+
+		an_wheel_drain(wheel);
+		if (!LIST_EMPTY(&wheel->expired)) {
+			continue;
+		}
+
+		if (wheel->now >= now) {
+			return NULL;
+		}
+
+		if (wheel->count == 0) {
+			wheel->now = now;
+			return NULL;
+		}
+
+		/* Skip ahead to the next tick with anything to do. */
+		next = an_wheel_next(wheel);
+		wheel->now += min(next, now - wheel->now);
+		if ((wheel->now & AN_WHEEL_MASK) == 0) {
+			an_wheel_turn(wheel);
+		}
+	}
+}
+
+uint64_t
+an_wheel_next(const struct an_wheel *wheel)
+{
+	uint64_t best, bits, when;
+	unsigned int level, shift, current, distance;
+
+	if (!LIST_EMPTY(&wheel->expired)) {
+		return 0;
+	}
+
+	if (wheel->count == 0) {
+		return UINT64_MAX;
+	}
+
+	/* Level 0 slots expire at their own tick... */
+	best = UINT64_MAX;
+	current = wheel->now & AN_WHEEL_MASK;
+	bits = rotate_right(wheel->occupied[0], current);
+	if (bits != 0) {
+		best = __builtin_ctzll(bits);
+	}
+
+	/*
+	 * ...and upper level slots are cascaded when their span starts,
+	 * which is always after the current tick.
+	 */
+	for (level = 1; level < AN_WHEEL_LEVELS; level++) {
+		bits = wheel->occupied[level];
+		if (bits == 0) {
+			continue;
+		}
+
+		shift = AN_WHEEL_BITS * level;
+		current = (wheel->now >> shift) & AN_WHEEL_MASK;
+		distance = __builtin_ctzll(rotate_right(bits, current + 1)) + 1;
+		when = ((wheel->now >> shift) + distance) << shift;
+		best = min(best, when - wheel->now);
+	}
+
+	return best;
+}
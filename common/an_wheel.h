@@ -0,0 +1,89 @@
+/* Hierarchical timing wheel */
+
+#ifndef AN_WHEEL_H
+#define AN_WHEEL_H
+#include <sys/queue.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Timers are keyed on an arbitrary monotonic tick count (e.g.,
+ * an_md_rdtsc() shifted down to the resolution we care about), and
+ * the wheel only ever moves forward.
+ *
+ * Each level has AN_WHEEL_SLOTS slots, and every slot of level n
+ * spans a full rotation of level n - 1; timers are cascaded down as
+ * the wheel turns. Arming, cancelling and expiring a timer are O(1),
+ * and cascading is amortised O(1) per timer and level. Deadlines
+ * further than the wheel's range are clamped and re-checked when
+ * they come due.
+ *
+ * The wheel is not thread-safe.
+ */
+#define AN_WHEEL_BITS	6
+#define AN_WHEEL_SLOTS	(1U << AN_WHEEL_BITS)
+#define AN_WHEEL_LEVELS	5
+
+/**
+ * @brief A timer, to be embedded in the object it times out.
+ */
+struct an_wheel_timer {
+	uint64_t deadline;
+	LIST_ENTRY(an_wheel_timer) next;
+	uint8_t level;
+	uint8_t slot;
+	bool armed;
+};
+
+LIST_HEAD(an_wheel_list, an_wheel_timer);
+
+struct an_wheel {
+	uint64_t now;
+	size_t count;	/* Armed timers, including expired ones */
+	uint64_t occupied[AN_WHEEL_LEVELS];
+	struct an_wheel_list slots[AN_WHEEL_LEVELS][AN_WHEEL_SLOTS];
+	/* Expired timers not yet returned by an_wheel_expire(). */
+	struct an_wheel_list expired;
+};
+
+/**
+ * @brief Initialise an empty wheel, starting at tick @a now.
+ */
+void an_wheel_init(struct an_wheel *, uint64_t now);
+
+/**
+ * @brief Initialise a timer, before its first an_wheel_add().
+ */
+void an_wheel_timer_init(struct an_wheel_timer *);
+
+static inline bool
+an_wheel_timer_armed(const struct an_wheel_timer *timer)
+{
+
+	return timer->armed;
+}
+
+/**
+ * @brief Arm @a timer to expire at tick @a deadline, re-arming it if needed.
+ */
+void an_wheel_add(struct an_wheel *, struct an_wheel_timer *, uint64_t deadline);
+
+/**
+ * @brief Disarm @a timer. It is fine to call this on a disarmed timer.
+ */
+void an_wheel_remove(struct an_wheel *, struct an_wheel_timer *);
+
+/**
+ * @brief Advance the wheel to tick @a now, and return an expired
+ * (and now disarmed) timer, or NULL if there is none left.
+ */
+struct an_wheel_timer *an_wheel_expire(struct an_wheel *, uint64_t now);
+
+/**
+ * @brief Returns a lower bound on the number of ticks until the next
+ * timer expires, or UINT64_MAX if no timer is armed.
+ */
+uint64_t an_wheel_next(const struct an_wheel *);
+
+#endif /* AN_WHEEL_H */
@@ -0,0 +1,719 @@
+/*
+ * End-to-end benchmark for an_io_server.
+ *
+ * We serve a fixed response from loopback with a pool of workers, and
+ * drive the server with an embedded HTTP/1.1 load generator: each
+ * client thread owns a share of the keep-alive connections, and keeps
+ * exactly one request in flight on each of them (closed loop). Once
+ * the warmup is over, we count responses and record their latency as
+ * seen by the clients, in a log-linear (HdrHistogram-style) histogram.
+ *
+ * Usage: bench_an_server [-t io_threads] [-w workers] [-g client_threads]
+ *     [-c connections] [-W warmup_s] [-d duration_s] [-s request_bytes]
+ *     [-r response_bytes] [-b busy_poll_us] [-u] [-H] [-p port]
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ck_pr.h>
+
+#include "common/an_md.h"
+#include "common/an_server.h"
+#include "common/an_thread.h"
+#include "common/log_linear_bin.h"
+#include "common/server_config.h"
+#include "common/util.h"
+
+#define WORKER_BATCH		16
+#define CLIENT_EVENTS		64
+#define CLIENT_POLL_MS		100
+
+/* Latencies are binned in ns, within 1/2^LATENCY_SUBRANGE_LB (~3%). */
+#define LATENCY_LINEAR_LB	5
+#define LATENCY_SUBRANGE_LB	5
+#define LATENCY_BINS		((65 - LATENCY_LINEAR_LB) << LATENCY_SUBRANGE_LB)
+
+enum bench_phase {
+	BENCH_WARMUP,
+	BENCH_MEASURE,
+	BENCH_STOP
+};
+
+struct latency_histogram {
+	uint64_t counts[LATENCY_BINS];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+};
+
+struct client_connection {
+	int fd;
+	size_t sent;		/* Bytes of the request written so far */
+	size_t received;	/* Bytes of the response buffered so far */
+	size_t expected;	/* Length of the response, 0 until known */
+	bool success;		/* Whether the response is a 200 */
+	bool writing;		/* Waiting for EPOLLOUT */
+	uint64_t start;		/* an_md_rdtsc() when the request went out */
+	char *buffer;
+	size_t capacity;
+};
+
+struct client {
+	pthread_t thread;
+	int epoll_fd;
+	struct client_connection *connections;
+	unsigned int n_connections;
+	uint64_t bytes;
+	uint64_t errors;
+	struct latency_histogram latency;
+};
+
+static struct an_io_server *server;
+static struct sockaddr_in server_address;
+static int phase = BENCH_WARMUP;
+
+static char *request;
+static size_t request_len;
+static char *response;
+static size_t response_len;
+
+static void
+latency_record(struct latency_histogram *h, uint64_t ns)
+{
+	size_t bin;
+
+	bin = log_linear_bin_down_of(ns, NULL, NULL,
+	    LATENCY_LINEAR_LB, LATENCY_SUBRANGE_LB);
+	h->counts[bin]++;
+	if (h->total == 0 || ns < h->min) {
+		h->min = ns;
+	}
+	if (ns > h->max) {
+		h->max = ns;
+	}
+	h->total++;
+	h->sum += ns;
+}
+
+static void
+latency_merge(struct latency_histogram *dst, const struct latency_histogram *src)
+{
+	size_t i;
+
+	if (src->total == 0) {
+		return;
+	}
+
+	for (i = 0; i < LATENCY_BINS; i++) {
+		dst->counts[i] += src->counts[i];
+	}
+	if (dst->total == 0 || src->min < dst->min) {
+		dst->min = src->min;
+	}
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+	dst->total += src->total;
+	dst->sum += src->sum;
+}
+
+/*
+ * Inverse of log_linear_bin_down_of(): the largest value in a bin. The
+ * first 2^(SUBRANGE_LB + 1) bins are linear; after that, each group of
+ * 2^SUBRANGE_LB bins covers a power of two.
+ */
+static uint64_t
+latency_bin_max(size_t bin)
+{
+	size_t range, sub;
+	unsigned int shift;
+
+	if (bin < (1ULL << LATENCY_SUBRANGE_LB)) {
+		shift = LATENCY_LINEAR_LB - LATENCY_SUBRANGE_LB;
+		return ((bin + 1) << shift) - 1;
+	}
+
+	range = (bin >> LATENCY_SUBRANGE_LB) - 1;
+	sub = (bin & ((1ULL << LATENCY_SUBRANGE_LB) - 1)) |
+	    (1ULL << LATENCY_SUBRANGE_LB);
+	shift = range + LATENCY_LINEAR_LB - LATENCY_SUBRANGE_LB;
+	return ((sub + 1) << shift) - 1;
+}
+
+static uint64_t
+latency_percentile(const struct latency_histogram *h, double percentile)
+{
+	uint64_t rank, seen;
+	size_t i;
+
+	rank = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+	if (rank == 0) {
+		return h->min;
+	}
+
+	seen = 0;
+	for (i = 0; i < LATENCY_BINS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			return min(latency_bin_max(i), h->max);
+		}
+	}
+
+	return h->max;
+}
+
+static void
+worker_handle(struct an_http_request *reqs, size_t n)
+{
+	struct an_buffer *bufs[WORKER_BATCH];
+	an_request_id_t ids[WORKER_BATCH];
+	struct an_buffer *buf;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		ids[i] = reqs[i].id;
+		/* A NULL response closes the connection. */
+		buf = an_io_get_outbuf(server, reqs[i].id, response_len);
+		if (buf != NULL) {
+			memcpy(buf->data, response, response_len);
+			buf->in = response_len;
+		}
+		bufs[i] = buf;
+	}
+
+	an_io_server_write_batch(server, ids, bufs, n);
+}
+
+/* Workers never return: we exit with them blocked in the server. */
+static void *
+worker_main(void *arg)
+{
+	struct an_http_request reqs[WORKER_BATCH];
+	struct an_thread *thread;
+	size_t n;
+
+	thread = an_thread_create();
+	an_thread_put(thread);
+
+	for (;;) {
+		n = an_io_server_read_batch(server, reqs, WORKER_BATCH);
+		worker_handle(reqs, n);
+	}
+
+	return NULL;
+}
+
+static int
+client_connect(struct client *client, struct client_connection *conn)
+{
+	struct epoll_event event;
+	int fd, one;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&server_address,
+	    sizeof(server_address)) != 0) {
+		goto fail;
+	}
+
+	one = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0 ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+		goto fail;
+	}
+
+	conn->fd = fd;
+	conn->sent = 0;
+	conn->received = 0;
+	conn->expected = 0;
+	conn->writing = false;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = conn;
+	if (epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	close(fd);
+	conn->fd = -1;
+	return -1;
+}
+
+static void
+client_close(struct client *client, struct client_connection *conn)
+{
+
+	if (conn->fd == -1) {
+		return;
+	}
+
+	close(conn->fd);
+	conn->fd = -1;
+}
+
+static void
+client_interest(struct client *client, struct client_connection *conn,
+    bool writing)
+{
+	struct epoll_event event;
+
+	if (conn->writing == writing) {
+		return;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+	event.data.ptr = conn;
+	if (epoll_ctl(client->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == 0) {
+		conn->writing = writing;
+	}
+}
+
+/* Write out (the rest of) the request; false on connection errors. */
+static bool
+client_send(struct client *client, struct client_connection *conn)
+{
+	ssize_t r;
+
+	if (conn->sent == 0) {
+		conn->start = an_md_rdtsc();
+	}
+
+	while (conn->sent < request_len) {
+		r = write(conn->fd, request + conn->sent,
+		    request_len - conn->sent);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno == EAGAIN) {
+				client_interest(client, conn, true);
+				return true;
+			}
+
+			return false;
+		}
+
+		conn->sent += r;
+	}
+
+	client_interest(client, conn, false);
+	return true;
+}
+
+/*
+ * Find the end of the headers, and the Content-Length of the response.
+ * Returns false on malformed responses.
+ */
+static bool
+client_parse(struct client_connection *conn)
+{
+	static const char header[] = "\r\ncontent-length:";
+	const char *end, *p;
+	size_t header_len;
+
+	end = memmem(conn->buffer, conn->received, "\r\n\r\n", 4);
+	if (end == NULL) {
+		return conn->received < conn->capacity;
+	}
+
+	header_len = end + 4 - conn->buffer;
+	for (p = conn->buffer; p + sizeof(header) - 1 <= end; p++) {
+		if (strncasecmp(p, header, sizeof(header) - 1) == 0) {
+			break;
+		}
+	}
+	if (p + sizeof(header) - 1 > end) {
+		return false;
+	}
+
+	conn->expected = header_len +
+	    strtoull(p + sizeof(header) - 1, NULL, 10);
+	/* Anything else is still a complete response, e.g., a 503. */
+	conn->success = strncmp(conn->buffer, "HTTP/1.1 200 ", 13) == 0;
+	return true;
+}
+
+/* Read what we can of the response; false on connection errors. */
+static bool
+client_receive(struct client *client, struct client_connection *conn)
+{
+	uint64_t elapsed;
+	ssize_t r;
+
+	for (;;) {
+		r = read(conn->fd, conn->buffer + conn->received,
+		    conn->capacity - conn->received);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return errno == EAGAIN;
+		}
+
+		if (r == 0) {
+			return false;
+		}
+
+		conn->received += r;
+		if (conn->expected == 0 && client_parse(conn) == false) {
+			return false;
+		}
+
+		if (conn->expected == 0 || conn->received < conn->expected) {
+			if (conn->received == conn->capacity) {
+				return false;
+			}
+
+			continue;
+		}
+
+		/* We never pipeline, so there can't be anything else. */
+		if (conn->received > conn->expected) {
+			return false;
+		}
+
+		elapsed = an_md_rdtsc() - conn->start;
+		if (ck_pr_load_int(&phase) == BENCH_MEASURE) {
+			if (conn->success == false) {
+				client->errors++;
+			} else {
+				client->bytes += conn->expected;
+				latency_record(&client->latency,
+				    an_md_rdtsc_scale(elapsed) * 1000);
+			}
+		}
+
+		conn->sent = 0;
+		conn->received = 0;
+		conn->expected = 0;
+		if (ck_pr_load_int(&phase) == BENCH_STOP) {
+			return true;
+		}
+
+		return client_send(client, conn);
+	}
+}
+
+static void *
+client_main(void *arg)
+{
+	struct epoll_event events[CLIENT_EVENTS];
+	struct client_connection *conn;
+	struct client *client = arg;
+	unsigned int i;
+	bool ok;
+	int n;
+
+	for (i = 0; i < client->n_connections; i++) {
+		conn = &client->connections[i];
+		if (client_connect(client, conn) != 0 ||
+		    client_send(client, conn) == false) {
+			fprintf(stderr, "Failed to connect: %s\n",
+			    strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	while (ck_pr_load_int(&phase) != BENCH_STOP) {
+		n = epoll_wait(client->epoll_fd, events, CLIENT_EVENTS,
+		    CLIENT_POLL_MS);
+		for (i = 0; i < (unsigned int)max(n, 0); i++) {
+			conn = events[i].data.ptr;
+			ok = true;
+			if ((events[i].events & EPOLLOUT) != 0 && conn->writing) {
+				ok = client_send(client, conn);
+			}
+			if (ok && (events[i].events & ~EPOLLOUT) != 0) {
+				ok = client_receive(client, conn);
+			}
+			if (ok) {
+				continue;
+			}
+
+			/* Reconnect, so the offered load stays the same. */
+			if (ck_pr_load_int(&phase) == BENCH_MEASURE) {
+				client->errors++;
+			}
+			client_close(client, conn);
+			if (client_connect(client, conn) == 0) {
+				client_send(client, conn);
+			}
+		}
+	}
+
+	for (i = 0; i < client->n_connections; i++) {
+		client_close(client, &client->connections[i]);
+	}
+
+	return NULL;
+}
+
+static void
+build_messages(size_t request_size, size_t body_size)
+{
+	static const char request_head[] =
+	    "GET /bench HTTP/1.1\r\nHost: 127.0.0.1\r\n";
+	static const char padding[] = "X-Padding: \r\n";
+	size_t header_len, len;
+
+	/* Pad the request with a header, if it isn't already that large. */
+	len = sizeof(request_head) - 1 + 2;
+	request_size = max(request_size, len);
+	request = malloc(request_size + 1);
+	memcpy(request, request_head, sizeof(request_head) - 1);
+	request_len = sizeof(request_head) - 1;
+	if (request_size >= len + sizeof(padding) - 1) {
+		len = request_size - len - (sizeof(padding) - 1);
+		memcpy(request + request_len, padding, sizeof(padding) - 3);
+		request_len += sizeof(padding) - 3;
+		memset(request + request_len, 'x', len);
+		request_len += len;
+		memcpy(request + request_len, "\r\n", 2);
+		request_len += 2;
+	}
+	memcpy(request + request_len, "\r\n", 2);
+	request_len += 2;
+
+	header_len = snprintf(NULL, 0,
+	    "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", body_size);
+	response_len = header_len + body_size;
+	response = malloc(response_len + 1);
+	snprintf(response, header_len + 1,
+	    "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n", body_size);
+	memset(response + header_len, 'x', body_size);
+}
+
+static double
+now_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+sleep_seconds(unsigned int seconds)
+{
+	struct timespec ts = { .tv_sec = seconds };
+
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+		continue;
+	}
+}
+
+static void
+report(const struct latency_histogram *h, uint64_t bytes, uint64_t errors,
+    double elapsed)
+{
+	static const double percentiles[] = {
+		50.0, 75.0, 90.0, 99.0, 99.9, 99.99, 99.999, 100.0
+	};
+	uint64_t total;
+	size_t i;
+
+	printf("%"PRIu64" responses in %.2fs: %.1f req/s, %.2f MB/s, "
+	    "%"PRIu64" errors\n", h->total, elapsed, h->total / elapsed,
+	    bytes / elapsed / 1e6, errors);
+	if (h->total == 0) {
+		return;
+	}
+
+	printf("latency (us): min %.1f, mean %.1f, max %.1f\n",
+	    h->min / 1e3, (double)h->sum / h->total / 1e3, h->max / 1e3);
+	printf("%12s %12s %12s\n", "value (us)", "percentile", "count");
+	for (i = 0; i < ARRAY_SIZE(percentiles); i++) {
+		total = (uint64_t)(percentiles[i] / 100.0 * h->total + 0.5);
+		printf("%12.1f %12.3f %12"PRIu64"\n",
+		    latency_percentile(h, percentiles[i]) / 1e3,
+		    percentiles[i], total);
+	}
+
+}
+
+static void
+usage(const char *name)
+{
+
+	fprintf(stderr, "Usage: %s [-t io_threads] [-w workers] "
+	    "[-g client_threads] [-c connections] [-W warmup_s] "
+	    "[-d duration_s] [-s request_bytes] [-r response_bytes] "
+	    "[-b busy_poll_us] [-u] [-H] [-p port]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct an_server_config config;
+	struct latency_histogram latency;
+	struct client *clients;
+	unsigned int num_workers, num_clients, num_connections;
+	unsigned int duration, warmup, i, j;
+	size_t request_size, body_size;
+	uint64_t bytes, errors;
+	double start, elapsed;
+	in_port_t port;
+	pthread_t thread;
+	int c;
+
+	memset(&config, 0, sizeof(config));
+	config.num_threads = 2;
+	num_workers = 2;
+	num_clients = 2;
+	num_connections = 64;
+	warmup = 1;
+	duration = 10;
+	request_size = 0;
+	body_size = 64;
+	port = 18080;
+
+	while ((c = getopt(argc, argv, "t:w:g:c:W:d:s:r:b:uHp:")) != -1) {
+		switch (c) {
+		case 't':
+			config.num_threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			num_workers = strtoul(optarg, NULL, 10);
+			break;
+		case 'g':
+			num_clients = strtoul(optarg, NULL, 10);
+			break;
+		case 'c':
+			num_connections = strtoul(optarg, NULL, 10);
+			break;
+		case 'W':
+			warmup = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			duration = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			request_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'r':
+			body_size = strtoull(optarg, NULL, 10);
+			break;
+		case 'b':
+			config.busy_poll_us = strtoul(optarg, NULL, 10);
+			break;
+		case 'u':
+			config.io_uring = true;
+			break;
+		case 'H':
+			config.huge_pages = true;
+			break;
+		case 'p':
+			port = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (config.num_threads == 0 || num_workers == 0 || num_clients == 0 ||
+	    num_connections < num_clients || duration == 0) {
+		usage(argv[0]);
+	}
+
+	/* Our options aren't server_config's. */
+	server_config_init("bench_an_server", 1, argv);
+	an_md_probe();
+
+	build_messages(request_size, body_size);
+
+	/* Limits are per I/O thread, and connections may all land on one. */
+	config.max_total_connections = num_connections;
+	config.max_active_connections = num_connections;
+	config.max_response_size = max(response_len, 1024 * 1024UL);
+	config.request_timeout_ms = 1000;
+	server = an_io_server_create(&config);
+	if (server == NULL ||
+	    an_io_server_listen(server, "127.0.0.1", port) != 0) {
+		fprintf(stderr, "Failed to listen on 127.0.0.1:%u\n", port);
+		return EXIT_FAILURE;
+	}
+	an_io_server_start(server);
+
+	for (i = 0; i < num_workers; i++) {
+		if (pthread_create(&thread, NULL, worker_main, NULL) != 0 ||
+		    pthread_detach(thread) != 0) {
+			fprintf(stderr, "Failed to start worker\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	memset(&server_address, 0, sizeof(server_address));
+	server_address.sin_family = AF_INET;
+	server_address.sin_port = htons(port);
+	server_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	clients = calloc(num_clients, sizeof(*clients));
+	for (i = 0; i < num_clients; i++) {
+		struct client *client = &clients[i];
+
+		client->n_connections = num_connections / num_clients +
+		    (i < num_connections % num_clients);
+		client->connections = calloc(client->n_connections,
+		    sizeof(*client->connections));
+		for (j = 0; j < client->n_connections; j++) {
+			client->connections[j].fd = -1;
+			client->connections[j].capacity = response_len + 4096;
+			client->connections[j].buffer =
+			    malloc(client->connections[j].capacity);
+		}
+
+		client->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (client->epoll_fd == -1 ||
+		    pthread_create(&client->thread, NULL, client_main,
+		    client) != 0) {
+			fprintf(stderr, "Failed to start client\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	sleep_seconds(warmup);
+	start = now_seconds();
+	ck_pr_store_int(&phase, BENCH_MEASURE);
+	sleep_seconds(duration);
+	ck_pr_store_int(&phase, BENCH_STOP);
+	elapsed = now_seconds() - start;
+
+	memset(&latency, 0, sizeof(latency));
+	bytes = 0;
+	errors = 0;
+	for (i = 0; i < num_clients; i++) {
+		pthread_join(clients[i].thread, NULL);
+		latency_merge(&latency, &clients[i].latency);
+		bytes += clients[i].bytes;
+		errors += clients[i].errors;
+	}
+
+	report(&latency, bytes, errors, elapsed);
+	return EXIT_SUCCESS;
+}
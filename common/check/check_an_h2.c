@@ -0,0 +1,405 @@
+#include <check.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "common/an_h2.h"
+#include "common/an_rand.h"
+
+#define MAX_HEADERS 16
+
+struct headers {
+	size_t count;
+	char fields[MAX_HEADERS][256];
+};
+
+static void
+on_header(void *arg, const char *name, size_t name_len, const char *value,
+    size_t value_len)
+{
+	struct headers *headers = arg;
+
+	fail_if(headers->count >= MAX_HEADERS);
+	snprintf(headers->fields[headers->count++], sizeof(headers->fields[0]),
+	    "%.*s: %.*s", (int)name_len, name, (int)value_len, value);
+	return;
+}
+
+static size_t
+unhex(uint8_t *dst, const char *hex)
+{
+	size_t i;
+
+	for (i = 0; hex[2 * i] != '\0'; i++) {
+		unsigned int byte;
+
+		sscanf(hex + 2 * i, "%2x", &byte);
+		dst[i] = byte;
+	}
+
+	return i;
+}
+
+static bool
+decode_hex(struct an_hpack_decoder *dec, const char *hex, struct headers *headers)
+{
+	uint8_t block[512];
+	size_t len;
+
+	len = unhex(block, hex);
+	memset(headers, 0, sizeof(*headers));
+	return an_hpack_decode(dec, block, len, on_header, headers);
+}
+
+static void
+check_headers(const struct headers *headers, const char **expected)
+{
+	size_t i;
+
+	for (i = 0; expected[i] != NULL; i++) {
+		fail_if(i >= headers->count);
+		fail_if(strcmp(headers->fields[i], expected[i]) != 0,
+		    "%s != %s", headers->fields[i], expected[i]);
+	}
+
+	fail_if(i != headers->count);
+}
+
+START_TEST(test_frame)
+{
+	struct an_h2_frame frame;
+	uint8_t buf[AN_H2_FRAME_HEADER_LEN];
+
+	an_h2_frame_write(buf, 0x123456, AN_H2_HEADERS,
+	    AN_H2_FLAG_END_STREAM | AN_H2_FLAG_END_HEADERS, 0x7654321);
+	an_h2_frame_read(&frame, buf);
+	fail_if(frame.length != 0x123456);
+	fail_if(frame.type != AN_H2_HEADERS);
+	fail_if(frame.flags != (AN_H2_FLAG_END_STREAM | AN_H2_FLAG_END_HEADERS));
+	fail_if(frame.stream != 0x7654321);
+
+	/* The reserved bit is ignored. */
+	buf[5] |= 0x80;
+	an_h2_frame_read(&frame, buf);
+	fail_if(frame.stream != 0x7654321);
+
+	fail_if(memcmp(AN_H2_PREFACE, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n",
+	    AN_H2_PREFACE_LEN) != 0);
+	fail_if(AN_H2_PREFACE_LEN != 24);
+}
+END_TEST
+
+/* RFC 7541 C.3 and C.4, with and without Huffman coding. */
+START_TEST(test_requests)
+{
+	static const char *first[] = {
+		":method: GET",
+		":scheme: http",
+		":path: /",
+		":authority: www.example.com",
+		NULL
+	};
+	static const char *second[] = {
+		":method: GET",
+		":scheme: http",
+		":path: /",
+		":authority: www.example.com",
+		"cache-control: no-cache",
+		NULL
+	};
+	static const char *third[] = {
+		":method: GET",
+		":scheme: https",
+		":path: /index.html",
+		":authority: www.example.com",
+		"custom-key: custom-value",
+		NULL
+	};
+	struct an_hpack_decoder dec;
+	struct headers headers;
+
+	an_hpack_decoder_init(&dec, 4096);
+	fail_if(decode_hex(&dec, "828684410f7777772e6578616d706c652e636f6d",
+	    &headers) == false);
+	check_headers(&headers, first);
+	fail_if(dec.count != 1);
+	fail_if(dec.size != 57);
+
+	fail_if(decode_hex(&dec, "828684be58086e6f2d6361636865",
+	    &headers) == false);
+	check_headers(&headers, second);
+	fail_if(dec.size != 110);
+
+	fail_if(decode_hex(&dec,
+	    "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565",
+	    &headers) == false);
+	check_headers(&headers, third);
+	fail_if(dec.count != 3);
+	fail_if(dec.size != 164);
+	an_hpack_decoder_deinit(&dec);
+
+	an_hpack_decoder_init(&dec, 4096);
+	fail_if(decode_hex(&dec, "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+	    &headers) == false);
+	check_headers(&headers, first);
+
+	fail_if(decode_hex(&dec, "828684be5886a8eb10649cbf",
+	    &headers) == false);
+	check_headers(&headers, second);
+
+	fail_if(decode_hex(&dec,
+	    "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+	    &headers) == false);
+	check_headers(&headers, third);
+	fail_if(dec.size != 164);
+	an_hpack_decoder_deinit(&dec);
+}
+END_TEST
+
+/* Values may contain NULs, which on_header can't deal with. */
+struct value {
+	size_t count;
+	char data[128];
+	size_t len;
+};
+
+static void
+on_value(void *arg, const char *name, size_t name_len, const char *value,
+    size_t value_len)
+{
+	struct value *result = arg;
+
+	fail_if(name_len != 1 || name[0] != 'x');
+	fail_if(value_len > sizeof(result->data));
+	memcpy(result->data, value, value_len);
+	result->len = value_len;
+	result->count++;
+	return;
+}
+
+START_TEST(test_huffman)
+{
+	/* 0x20 to 0x7e, then 0, 1, 0x7f, 0x80, 0xfe, 0xff, '\r' and '\n' */
+	static const char encoded[] =
+	    "53f8fe7febff2afc7fafebfbf9ff7f4b2ec002265a6dc75e7ee7dfffc83feffc"
+	    "ffd4376f5fc187163c997367d1a756bd9b776fe1c797e73fdffdffff0ffe7ff9"
+	    "17ffd1c6490b2cd39ba75a29a8f5f6b109b7bf8f3ebdfffeff9ffefff7ff1fff"
+	    "f63ffffff3fff9bfffff87ffffddffffffefffffff9f";
+	struct an_hpack_decoder dec;
+	struct value result = { 0 };
+	char expected[128];
+	uint8_t block[256];
+	size_t i, len, n = 0;
+
+	for (i = 0x20; i < 0x7f; i++) {
+		expected[n++] = i;
+	}
+
+	expected[n++] = 0;
+	expected[n++] = 1;
+	expected[n++] = 0x7f;
+	expected[n++] = 0x80;
+	expected[n++] = 0xfe;
+	expected[n++] = 0xff;
+	expected[n++] = '\r';
+	expected[n++] = '\n';
+
+	/* Literal never indexed, new name "x", Huffman coded value */
+	len = 0;
+	block[len++] = 0x10;
+	block[len++] = 1;
+	block[len++] = 'x';
+	block[len++] = 0x80 | ((sizeof(encoded) - 1) / 2);
+	len += unhex(block + len, encoded);
+
+	an_hpack_decoder_init(&dec, 4096);
+	fail_if(an_hpack_decode(&dec, block, len, on_value, &result) == false);
+	fail_if(result.count != 1);
+	fail_if(result.len != n);
+	fail_if(memcmp(result.data, expected, n) != 0);
+	fail_if(dec.count != 0);
+	an_hpack_decoder_deinit(&dec);
+}
+END_TEST
+
+START_TEST(test_invalid)
+{
+	static const char *blocks[] = {
+		/* Index 0, and past the end of the dynamic table */
+		"80",
+		"be",
+		"7e0161",
+		/* Truncated integer, and too large */
+		"ff",
+		"ffffffffffff0f",
+		/* Truncated string */
+		"400561",
+		"0003616161",
+		/* Table size update over our limit, or after a header */
+		"3fe21f",
+		"823f00",
+		/* "a" Huffman coded with 11 bits of padding, or zero bits */
+		"000161821fff",
+		"0001618118",
+		/* EOS */
+		"00016184ffffffff",
+		NULL
+	};
+	struct an_hpack_decoder dec;
+	struct headers headers;
+	size_t i;
+
+	for (i = 0; blocks[i] != NULL; i++) {
+		an_hpack_decoder_init(&dec, 4096);
+		fail_if(decode_hex(&dec, blocks[i], &headers) == true,
+		    "Decoded %s", blocks[i]);
+		an_hpack_decoder_deinit(&dec);
+	}
+
+	/* Both are fine with valid padding. */
+	an_hpack_decoder_init(&dec, 4096);
+	fail_if(decode_hex(&dec, "000161811f", &headers) == false);
+	fail_if(strcmp(headers.fields[0], "a: a") != 0);
+	fail_if(decode_hex(&dec, "3fe11f", &headers) == false);
+	an_hpack_decoder_deinit(&dec);
+}
+END_TEST
+
+START_TEST(test_eviction)
+{
+	static const char *expected[] = { "aaaa: bbbb", NULL };
+	struct an_hpack_decoder dec;
+	struct headers headers;
+
+	/* Room for two 40 byte entries. */
+	an_hpack_decoder_init(&dec, 80);
+	fail_if(decode_hex(&dec, "4004616161610462626262", &headers) == false);
+	fail_if(decode_hex(&dec, "4004636363630464646464", &headers) == false);
+	fail_if(dec.count != 2);
+	fail_if(decode_hex(&dec, "bf", &headers) == false);
+	check_headers(&headers, expected);
+
+	/* The oldest entry goes, the new one reuses its name. */
+	fail_if(decode_hex(&dec, "7f000465656565", &headers) == false);
+	fail_if(dec.count != 2);
+	fail_if(dec.size != 80);
+	fail_if(decode_hex(&dec, "be", &headers) == false);
+	fail_if(strcmp(headers.fields[0], "aaaa: eeee") != 0);
+	fail_if(decode_hex(&dec, "bf", &headers) == false);
+	fail_if(strcmp(headers.fields[0], "cccc: dddd") != 0);
+
+	/* An entry larger than the table empties it. */
+	fail_if(decode_hex(&dec, "4004616161612d", &headers) == true);
+	fail_if(decode_hex(&dec,
+	    "4004616161613030303030303030303030303030303030303030303030303030"
+	    "3030303030303030303030303030303030303030303030",
+	    &headers) == false);
+	fail_if(dec.count != 0 || dec.size != 0);
+
+	/* Shrinking the table evicts. */
+	fail_if(decode_hex(&dec, "4004616161610462626262", &headers) == false);
+	fail_if(decode_hex(&dec, "4004636363630464646464", &headers) == false);
+	fail_if(decode_hex(&dec, "3f0abe", &headers) == false);
+	fail_if(dec.count != 1);
+	fail_if(strcmp(headers.fields[0], "cccc: dddd") != 0);
+	fail_if(decode_hex(&dec, "20", &headers) == false);
+	fail_if(dec.count != 0);
+	an_hpack_decoder_deinit(&dec);
+}
+END_TEST
+
+/* Whatever we encode, we must decode to the same (lowercased) headers. */
+START_TEST(test_encode)
+{
+	static const unsigned int statuses[] = {
+		200, 204, 206, 304, 400, 404, 500, 100, 302, 503, 999
+	};
+	static const char alphabet[] = "aZ-_:/ \t0\x80\xff";
+	struct an_hpack_decoder dec;
+	struct headers headers;
+	uint8_t block[1024];
+	size_t i, len;
+
+	an_hpack_decoder_init(&dec, 4096);
+	for (i = 0; i < sizeof(statuses) / sizeof(statuses[0]); i++) {
+		char expected[32];
+
+		len = an_hpack_encode_status(block, statuses[i]);
+		fail_if(len > AN_HPACK_HEADER_BOUND(0, 3));
+		memset(&headers, 0, sizeof(headers));
+		fail_if(an_hpack_decode(&dec, block, len, on_header,
+		    &headers) == false);
+		snprintf(expected, sizeof(expected), ":status: %u", statuses[i]);
+		fail_if(headers.count != 1);
+		fail_if(strcmp(headers.fields[0], expected) != 0);
+	}
+
+	len = an_hpack_encode_header(block, "Content-Type", 12, "text/html", 9);
+	/* Name from the static table, entry 31 */
+	fail_if(block[0] != 0x0f || block[1] != 31 - 15);
+	memset(&headers, 0, sizeof(headers));
+	fail_if(an_hpack_decode(&dec, block, len, on_header, &headers) == false);
+	fail_if(strcmp(headers.fields[0], "content-type: text/html") != 0);
+
+	for (i = 0; i < 10000; i++) {
+		char name[64], value[200], expected[256];
+		size_t j, name_len, value_len;
+
+		name_len = 1 + an_random_below(sizeof(name));
+		for (j = 0; j < name_len; j++) {
+			name[j] = alphabet[an_random_below(4)];
+		}
+
+		value_len = an_random_below(sizeof(value));
+		for (j = 0; j < value_len; j++) {
+			value[j] = alphabet[an_random_below(sizeof(alphabet) - 1)];
+		}
+
+		len = an_hpack_encode_header(block, name, name_len, value, value_len);
+		fail_if(len > AN_HPACK_HEADER_BOUND(name_len, value_len));
+
+		for (j = 0; j < name_len; j++) {
+			if (name[j] == 'Z') {
+				name[j] = 'z';
+			}
+		}
+
+		snprintf(expected, sizeof(expected), "%.*s: %.*s",
+		    (int)name_len, name, (int)value_len, value);
+		memset(&headers, 0, sizeof(headers));
+		fail_if(an_hpack_decode(&dec, block, len, on_header,
+		    &headers) == false);
+		fail_if(headers.count != 1);
+		fail_if(strcmp(headers.fields[0], expected) != 0);
+	}
+
+	/* Nothing was ever indexed. */
+	fail_if(dec.count != 0);
+	an_hpack_decoder_deinit(&dec);
+}
+END_TEST
+
+int
+main(int argc, char *argv[])
+{
+	SRunner *sr;
+	Suite *suite = suite_create("common/an_h2");
+	TCase *tc = tcase_create("test_an_h2");
+
+	tcase_add_test(tc, test_frame);
+	tcase_add_test(tc, test_requests);
+	tcase_add_test(tc, test_huffman);
+	tcase_add_test(tc, test_invalid);
+	tcase_add_test(tc, test_eviction);
+	tcase_add_test(tc, test_encode);
+
+	suite_add_tcase(suite, tc);
+
+	sr = srunner_create(suite);
+	srunner_set_xml(sr, "check/check_an_h2.xml");
+	srunner_set_fork_status(sr, CK_NOFORK);
+	srunner_run_all(sr, CK_NORMAL);
+
+	return srunner_ntests_failed(sr);
+}
@@ -0,0 +1,206 @@
+#include <check.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common/an_http_scan.h"
+#include "common/an_rand.h"
+#include "third_party/http-parser/http_parser.h"
+
+#define S(x) (x), sizeof(x) - 1
+
+/* What http_parser makes of the first message in a buffer. */
+struct reference {
+	size_t total_len;
+	const char *uri;
+	size_t uri_len;
+	bool complete;
+	bool keepalive;
+};
+
+static int
+on_url(http_parser *parser, const char *data, size_t len)
+{
+	struct reference *ref = parser->data;
+
+	if (ref->uri == NULL) {
+		ref->uri = data;
+	}
+	ref->uri_len += len;
+	return 0;
+}
+
+static int
+on_message_complete(http_parser *parser)
+{
+	struct reference *ref = parser->data;
+
+	ref->complete = true;
+	ref->keepalive = http_should_keep_alive(parser);
+	http_parser_pause(parser, 1);
+	return 0;
+}
+
+static bool
+reference_parse(const char *data, size_t len, struct reference *ref)
+{
+	http_parser_settings settings = {
+		.on_url = on_url,
+		.on_message_complete = on_message_complete
+	};
+	http_parser parser;
+
+	memset(ref, 0, sizeof(*ref));
+	http_parser_init(&parser, HTTP_REQUEST);
+	parser.data = ref;
+	ref->total_len = http_parser_execute(&parser, &settings, data, len);
+	return ref->complete && HTTP_PARSER_ERRNO(&parser) == HPE_PAUSED;
+}
+
+/* Whenever the scanner accepts a request, http_parser must agree with it. */
+static void
+check_consistent(const char *data, size_t len)
+{
+	struct an_http_scan scan;
+	struct reference ref;
+
+	if (an_http_scan_request(data, len, &scan) == false) {
+		return;
+	}
+
+	fail_if(reference_parse(data, len, &ref) == false,
+	    "Scanned invalid request: %.*s", (int)len, data);
+	fail_if(scan.total_len != ref.total_len);
+	fail_if(scan.uri_len != ref.uri_len);
+	fail_if(data + scan.uri_offset != ref.uri);
+	fail_if(scan.keepalive != ref.keepalive);
+}
+
+START_TEST(test_simple)
+{
+	static const char request[] =
+	    "GET /foo?bar=baz HTTP/1.1\r\n"
+	    "Host: example.com\r\n"
+	    "Accept: */*\r\n"
+	    "\r\n"
+	    "GET /next HTTP/1.1\r\n\r\n";
+	struct an_http_scan scan;
+	size_t first;
+
+	first = strstr(request, "GET /next") - request;
+	fail_if(an_http_scan_request(S(request), &scan) == false);
+	fail_if(scan.total_len != first);
+	fail_if(scan.uri_offset != 4);
+	fail_if(scan.uri_len != strlen("/foo?bar=baz"));
+	fail_if(scan.keepalive == false);
+	check_consistent(S(request));
+
+	fail_if(an_http_scan_request(request + first, sizeof(request) - 1 - first,
+	    &scan) == false);
+	fail_if(scan.total_len != sizeof(request) - 1 - first);
+
+	fail_if(an_http_scan_request(S("GET / HTTP/1.0\r\n\r\n"), &scan) == false);
+	fail_if(scan.keepalive == true);
+}
+END_TEST
+
+START_TEST(test_fallback)
+{
+	static const char *requests[] = {
+		/* Incomplete */
+		"GET / HTTP/1.1\r\nHost: example.com\r\n",
+		"GET / HTTP/1.1\r\nHost: example.com\r\n\r",
+		/* Not a GET, or an unusual request line */
+		"POST / HTTP/1.1\r\nContent-Length: 0\r\n\r\n",
+		"\r\nGET / HTTP/1.1\r\n\r\n",
+		"GET  / HTTP/1.1\r\n\r\n",
+		"GET http://example.com/ HTTP/1.1\r\n\r\n",
+		"GET / HTTP/2.0\r\n\r\n",
+		"GET /\r\n\r\n",
+		"GET / HTTP/1.1\n\n",
+		/* Headers http_parser handles specially */
+		"GET / HTTP/1.1\r\nConnection: close\r\n\r\n",
+		"GET / HTTP/1.1\r\nContent-length: 10\r\n\r\n0123456789",
+		"GET / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n",
+		"GET / HTTP/1.1\r\nUPGRADE: websocket\r\n\r\n",
+		"GET / HTTP/1.0\r\nProxy-Connection: keep-alive\r\n\r\n",
+		/* Odd header lines */
+		"GET / HTTP/1.1\r\n Host: example.com\r\n\r\n",
+		"GET / HTTP/1.1\r\nHost : example.com\r\n\r\n",
+		"GET / HTTP/1.1\r\nHost\r\n\r\n",
+		"GET / HTTP/1.1\r\nHost: a\nb\r\n\r\n",
+		"GET / HTTP/1.1\r\nHost: a\rb\r\n\r\n",
+		NULL
+	};
+	struct an_http_scan scan;
+	size_t i;
+
+	for (i = 0; requests[i] != NULL; i++) {
+		fail_if(an_http_scan_request(requests[i], strlen(requests[i]),
+		    &scan) == true, "Scanned %s", requests[i]);
+	}
+}
+END_TEST
+
+START_TEST(test_headers_end)
+{
+	static const char data[] = "0123456789abcdef0123456789a\r\n\r\nbcdef";
+	size_t i;
+
+	for (i = 0; i < sizeof(data) - 1; i++) {
+		const char *end;
+
+		end = an_http_scan_headers_end(data + i, sizeof(data) - 1 - i);
+		fail_if(i <= 27 && end != data + 31);
+		fail_if(i > 27 && end != NULL);
+	}
+}
+END_TEST
+
+/* Mutate a valid request at random, and compare against http_parser. */
+START_TEST(test_random)
+{
+	static const char base[] =
+	    "GET /a/b?c=d&e=f HTTP/1.1\r\n"
+	    "Host: example.com\r\n"
+	    "User-Agent: check\r\n"
+	    "X-Forwarded-For: 10.0.0.1\r\n"
+	    "\r\n";
+	static const char alphabet[] = " \t\r\n:/?#GETHP01.-aZ\x7f\x80";
+	char request[sizeof(base)];
+	size_t i, j, len;
+
+	for (i = 0; i < 100000; i++) {
+		memcpy(request, base, sizeof(base));
+		len = sizeof(base) - 1 - an_random_below(4);
+		for (j = an_random_below(4); j > 0; j--) {
+			request[an_random_below(len)] =
+			    alphabet[an_random_below(sizeof(alphabet) - 1)];
+		}
+
+		check_consistent(request, len);
+	}
+}
+END_TEST
+
+int
+main(int argc, char *argv[])
+{
+	SRunner *sr;
+	Suite *suite = suite_create("common/an_http_scan");
+	TCase *tc = tcase_create("test_an_http_scan");
+
+	tcase_add_test(tc, test_simple);
+	tcase_add_test(tc, test_fallback);
+	tcase_add_test(tc, test_headers_end);
+	tcase_add_test(tc, test_random);
+
+	suite_add_tcase(suite, tc);
+
+	sr = srunner_create(suite);
+	srunner_set_xml(sr, "check/check_an_http_scan.xml");
+	srunner_set_fork_status(sr, CK_NOFORK);
+	srunner_run_all(sr, CK_NORMAL);
+
+	return srunner_ntests_failed(sr);
+}
@@ -0,0 +1,160 @@
+#include <check.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "common/an_rand.h"
+#include "common/an_wheel.h"
+
+#define N_TIMERS 1000
+
+static struct an_wheel wheel;
+static struct an_wheel_timer timers[N_TIMERS];
+static uint64_t deadlines[N_TIMERS];
+static bool armed[N_TIMERS];
+
+static void
+setup(uint64_t now)
+{
+	size_t i;
+
+	an_wheel_init(&wheel, now);
+	for (i = 0; i < N_TIMERS; i++) {
+		an_wheel_timer_init(&timers[i]);
+		armed[i] = false;
+	}
+}
+
+/* Expire everything due at now, and check against our shadow state. */
+static void
+advance(uint64_t now)
+{
+	struct an_wheel_timer *timer;
+	size_t i;
+
+	while ((timer = an_wheel_expire(&wheel, now)) != NULL) {
+		i = timer - timers;
+		fail_if(i >= N_TIMERS);
+		fail_if(armed[i] == false);
+		fail_if(deadlines[i] > now, "Timer %zu expired early: "
+		    "%"PRIu64" > %"PRIu64, i, deadlines[i], now);
+		fail_if(an_wheel_timer_armed(timer));
+		armed[i] = false;
+	}
+
+	for (i = 0; i < N_TIMERS; i++) {
+		fail_if(armed[i] && deadlines[i] <= now,
+		    "Timer %zu did not expire at %"PRIu64, i, now);
+	}
+}
+
+START_TEST(test_basic)
+{
+	setup(100);
+
+	fail_if(an_wheel_next(&wheel) != UINT64_MAX);
+	fail_if(an_wheel_expire(&wheel, 1000) != NULL);
+
+	an_wheel_add(&wheel, &timers[0], 1010);
+	deadlines[0] = 1010;
+	armed[0] = true;
+	fail_if(an_wheel_next(&wheel) > 10);
+
+	advance(1009);
+	fail_if(armed[0] == false);
+	advance(1010);
+	fail_if(armed[0] == true);
+
+	/* Cancelled timers never fire, and cancelling twice is fine. */
+	an_wheel_add(&wheel, &timers[1], 2000);
+	an_wheel_remove(&wheel, &timers[1]);
+	an_wheel_remove(&wheel, &timers[1]);
+	fail_if(an_wheel_expire(&wheel, 3000) != NULL);
+
+	/* Deadlines in the past expire right away. */
+	an_wheel_add(&wheel, &timers[2], 10);
+	fail_if(an_wheel_next(&wheel) != 0);
+	fail_if(an_wheel_expire(&wheel, 3000) != &timers[2]);
+}
+END_TEST
+
+START_TEST(test_far)
+{
+	uint64_t far;
+
+	setup(0);
+
+	/* Well beyond the range of the wheel. */
+	far = 1ULL << 40;
+	an_wheel_add(&wheel, &timers[0], far);
+	deadlines[0] = far;
+	armed[0] = true;
+
+	advance(far / 3);
+	advance(far - 1);
+	fail_if(armed[0] == false);
+	advance(far);
+	fail_if(armed[0] == true);
+}
+END_TEST
+
+START_TEST(test_random)
+{
+	uint64_t now, next, delta;
+	size_t i, j;
+
+	now = an_rand64() >> 8;
+	setup(now);
+
+	for (i = 0; i < 100000; i++) {
+		j = an_random_below(N_TIMERS);
+
+		switch (an_random_below(4)) {
+		case 0:
+			an_wheel_remove(&wheel, &timers[j]);
+			armed[j] = false;
+			break;
+		case 1:
+			advance(now);
+			next = an_wheel_next(&wheel);
+			for (j = 0; j < N_TIMERS; j++) {
+				fail_if(armed[j] && deadlines[j] - now < next);
+			}
+
+			delta = an_random_below(4) == 0 ? an_random_below(100000) :
+			    an_random_below(100);
+			now += delta;
+			advance(now);
+			break;
+		default:
+			delta = an_random_below(2) == 0 ? an_random_below(64) :
+			    an_rand64() >> (20 + an_random_below(44));
+			an_wheel_add(&wheel, &timers[j], now + delta);
+			deadlines[j] = now + delta;
+			armed[j] = true;
+			break;
+		}
+	}
+}
+END_TEST
+
+int
+main(int argc, char *argv[])
+{
+	SRunner *sr;
+	Suite *suite = suite_create("common/an_wheel");
+	TCase *tc = tcase_create("test_an_wheel");
+
+	tcase_add_test(tc, test_basic);
+	tcase_add_test(tc, test_far);
+	tcase_add_test(tc, test_random);
+
+	suite_add_tcase(suite, tc);
+
+	sr = srunner_create(suite);
+	srunner_set_xml(sr, "check/check_an_wheel.xml");
+	srunner_set_fork_status(sr, CK_NOFORK);
+	srunner_run_all(sr, CK_NORMAL);
+
+	return srunner_ntests_failed(sr);
+}
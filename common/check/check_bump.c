@@ -2,6 +2,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common/memory/bump.h"
 
@@ -65,6 +66,68 @@ START_TEST(smoke_shared)
 	}
 } END_TEST
 
+START_TEST(hugepage_private)
+{
+	struct an_bump_policy policy = {
+		.hugepage = AN_MEMORY_HUGEPAGE_HUGETLB
+	};
+	struct an_bump_private *private;
+	size_t allocated = 0;
+	size_t capacity;
+
+	/* Rounded up to 2 huge pages, whether or not hugetlbfs has any. */
+	private = an_bump_private_create(3UL << 20, &policy);
+	fail_if(private == NULL);
+	fail_if(((uintptr_t)private % AN_MEMORY_HUGEPAGE_SIZE) != 0);
+	{
+		void *first = an_bump_alloc(private, 0, 0);
+		capacity = 2 * AN_MEMORY_HUGEPAGE_SIZE -
+		    ((uintptr_t)first - (uintptr_t)private);
+	}
+
+	while (allocated < capacity) {
+		size_t request = 4096;
+		void *alloc;
+
+		if (request > capacity - allocated) {
+			request = capacity - allocated;
+		}
+
+		alloc = an_bump_alloc(private, request, 0);
+		fail_if(alloc == NULL);
+		memset(alloc, 0xff, request);
+		allocated += request;
+	}
+
+	fail_if(an_bump_alloc(private, 1, 0) != NULL);
+} END_TEST
+
+START_TEST(bind_shared)
+{
+	struct an_bump_policy policy = {
+		.bind = true,
+		.node = AN_MEMORY_NODE_LOCAL
+	};
+	struct an_bump_shared *shared;
+	size_t capacity = 1UL << 22;
+	size_t allocated;
+
+	/* Not premapped: every growth must be bound as well. */
+	shared = an_bump_shared_create(capacity, &policy);
+	fail_if(shared == NULL);
+	for (allocated = 0; allocated < capacity / 2; allocated += 4096) {
+		void *alloc = an_bump_alloc(shared, 4096, 0);
+
+		fail_if(alloc == NULL);
+		memset(alloc, 0xff, 4096);
+	}
+
+	fail_if(an_bump_shared_quiesce(shared) == false);
+	fail_if(an_bump_shared_reset(shared) == false);
+	an_bump_shared_bind(shared, 0);
+	fail_if(an_bump_alloc(shared, 4096, 0) == NULL);
+} END_TEST
+
 int
 main(int argc, char *argv[])
 {
@@ -74,6 +137,8 @@ main(int argc, char *argv[])
 
 	tcase_add_test(tc, smoke_private);
 	tcase_add_test(tc, smoke_shared);
+	tcase_add_test(tc, hugepage_private);
+	tcase_add_test(tc, bind_shared);
 
 	suite_add_tcase(suite, tc);
 
@@ -0,0 +1,108 @@
+#include <check.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common/memory/slab.h"
+#include "common/rtbr/rtbr.h"
+
+#define N_OBJECTS 1000
+
+struct object {
+	uint64_t values[5];
+};
+
+AN_SLAB(static, objects, sizeof(struct object), 1UL << 24);
+
+static struct object *allocated[N_OBJECTS];
+
+static uintptr_t
+allocate_all(void)
+{
+	uintptr_t max = 0;
+
+	for (size_t i = 0; i < N_OBJECTS; i++) {
+		allocated[i] = an_slab_calloc(&objects);
+		fail_if(allocated[i] == NULL);
+		fail_if(((uintptr_t)allocated[i] % 16) != 0);
+		fail_if(allocated[i]->values[0] != 0);
+		memset(allocated[i], 0xff, sizeof(struct object));
+		if ((uintptr_t)allocated[i] > max) {
+			max = (uintptr_t)allocated[i];
+		}
+	}
+
+	return max;
+}
+
+static void
+free_all(void)
+{
+
+	for (size_t i = 0; i < N_OBJECTS; i++) {
+		an_slab_free(&objects, allocated[i]);
+	}
+
+	an_slab_flush(&objects);
+}
+
+START_TEST(reuse)
+{
+	uintptr_t max;
+
+	fail_if(objects.size != 48);
+	max = allocate_all();
+	free_all();
+	an_rtbr_synchronize();
+
+	/* Everything comes back from the first batch of objects. */
+	for (size_t i = 0; i < N_OBJECTS; i++) {
+		struct object *object = an_slab_alloc(&objects);
+
+		fail_if(object == NULL);
+		fail_if((uintptr_t)object > max);
+	}
+} END_TEST
+
+START_TEST(grace_period)
+{
+	struct an_rtbr_section section;
+	uintptr_t max;
+
+	max = allocate_all();
+	an_rtbr_begin(&section, an_rtbr_prepare(), "check_slab");
+	free_all();
+	an_rtbr_poll(true);
+
+	/* Our own section keeps freed objects from being reused. */
+	for (size_t i = 0; i < N_OBJECTS; i++) {
+		struct object *object = an_slab_alloc(&objects);
+
+		fail_if(object == NULL);
+		fail_if((uintptr_t)object <= max);
+	}
+
+	an_rtbr_end(&section);
+	an_rtbr_synchronize();
+	fail_if(an_slab_alloc(&objects) == NULL);
+} END_TEST
+
+int
+main(int argc, char *argv[])
+{
+	SRunner *sr;
+	Suite *suite = suite_create("common/slab");
+	TCase *tc = tcase_create("test_slab");
+
+	tcase_add_test(tc, reuse);
+	tcase_add_test(tc, grace_period);
+
+	suite_add_tcase(suite, tc);
+
+	sr = srunner_create(suite);
+	srunner_set_xml(sr, "check/check_slab.xml");
+	srunner_set_fork_status(sr, CK_NOFORK);
+	srunner_run_all(sr, CK_NORMAL);
+
+	return srunner_ntests_failed(sr);
+}
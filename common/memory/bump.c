@@ -12,6 +12,8 @@ struct an_bump_impl {
 	struct an_bump_fast fast;
 	uint64_t mapped;
 	uint64_t reserved;
+	enum an_memory_hugepage hugepage;
+	int node; /* Preferred NUMA node, or -1. */
 };
 
 struct an_bump_private {
@@ -29,72 +31,189 @@ _Static_assert(sizeof(struct an_bump_private) <= MEMORY_BUMP_PAGE_SIZE,
 _Static_assert(sizeof(struct an_bump_shared) <= MEMORY_BUMP_PAGE_SIZE,
     "Size of bump allocation header must be at most one page");
 
-struct an_bump_private *
-an_bump_private_create(size_t capacity, const struct an_bump_policy *policy)
+/*
+ * Round @a capacity up as per @a policy, and return the alignment the
+ * region needs.
+ */
+static size_t
+bump_capacity(size_t *capacity, const struct an_bump_policy *policy)
 {
-	struct an_bump_private *ret;
-	size_t mapped;
+	size_t page_size = MEMORY_BUMP_PAGE_SIZE;
+
+	if (policy != NULL && policy->hugepage != AN_MEMORY_HUGEPAGE_NONE) {
+		page_size = AN_MEMORY_HUGEPAGE_SIZE;
+	}
+
+	if (*capacity < MEMORY_BUMP_PAGE_SIZE * 2) {
+		*capacity = MEMORY_BUMP_PAGE_SIZE * 2;
+	}
+
+	if ((*capacity % page_size) != 0) {
+		*capacity = (1 + (*capacity / page_size)) * page_size;
+		assert(*capacity != 0);
+	}
 
-	if (capacity < MEMORY_BUMP_PAGE_SIZE * 2) {
-		capacity = MEMORY_BUMP_PAGE_SIZE * 2;
+	return page_size;
+}
+
+static int
+bump_node(const struct an_bump_policy *policy)
+{
+
+	if (policy == NULL || policy->bind == false) {
+		return -1;
 	}
 
-	if ((capacity % MEMORY_BUMP_PAGE_SIZE) != 0) {
-		capacity = (1 + (capacity / MEMORY_BUMP_PAGE_SIZE)) * MEMORY_BUMP_PAGE_SIZE;
-		assert(capacity != 0);
+	if (policy->node == AN_MEMORY_NODE_LOCAL) {
+		return an_memory_local_node();
 	}
 
-	ret = an_memory_reserve(capacity, MEMORY_BUMP_PAGE_SIZE);
+	return (policy->node >= 0) ? policy->node : -1;
+}
+
+/* Map in the beginning of a new region, before we touch its header. */
+static size_t
+bump_map(void *region, size_t capacity, enum an_memory_hugepage hugepage,
+    int node, const struct an_bump_policy *policy)
+{
+	size_t mapped;
+
 	if (policy != NULL && policy->premap) {
-		mapped = an_memory_map(ret, capacity, capacity);
+		mapped = an_memory_map_huge(region, capacity, capacity,
+		    hugepage);
 	} else {
-		mapped = an_memory_map(ret, MEMORY_BUMP_PAGE_SIZE, capacity);
+		mapped = an_memory_map_huge(region, MEMORY_BUMP_PAGE_SIZE,
+		    capacity, hugepage);
+	}
+
+	if (mapped > 0 && node >= 0) {
+		an_memory_bind(region, mapped, node);
 	}
 
+	return mapped;
+}
+
+struct an_bump_private *
+an_bump_private_create(size_t capacity, const struct an_bump_policy *policy)
+{
+	enum an_memory_hugepage hugepage;
+	struct an_bump_private *ret;
+	size_t alignment;
+	size_t mapped;
+	int node;
+
+	hugepage = (policy != NULL) ? policy->hugepage : AN_MEMORY_HUGEPAGE_NONE;
+	node = bump_node(policy);
+	alignment = bump_capacity(&capacity, policy);
+	ret = an_memory_reserve(capacity, alignment);
+	mapped = bump_map(ret, capacity, hugepage, node, policy);
+
 	assert(mapped >= MEMORY_BUMP_PAGE_SIZE);
 	ret->impl.fast.allocated = (uintptr_t)ret + sizeof(*ret);
 	ret->impl.fast.capacity = mapped / MEMORY_BUMP_PAGE_SIZE;
 	ret->impl.mapped = mapped;
 	ret->impl.reserved = capacity;
+	ret->impl.hugepage = hugepage;
+	ret->impl.node = node;
 	return ret;
 }
 
 struct an_bump_shared *
 an_bump_shared_create(size_t capacity, const struct an_bump_policy *policy)
 {
+	enum an_memory_hugepage hugepage;
 	struct an_bump_shared *ret;
+	size_t alignment;
 	size_t mapped;
+	int node;
 
-	if (capacity < MEMORY_BUMP_PAGE_SIZE * 2) {
-		capacity = MEMORY_BUMP_PAGE_SIZE * 2;
-	}
-
-	if ((capacity % MEMORY_BUMP_PAGE_SIZE) != 0) {
-		capacity = (1 + (capacity / MEMORY_BUMP_PAGE_SIZE)) * MEMORY_BUMP_PAGE_SIZE;
-		assert(capacity != 0);
-	}
-
-	ret = an_memory_reserve(capacity, MEMORY_BUMP_PAGE_SIZE);
+	hugepage = (policy != NULL) ? policy->hugepage : AN_MEMORY_HUGEPAGE_NONE;
+	node = bump_node(policy);
+	alignment = bump_capacity(&capacity, policy);
+	ret = an_memory_reserve(capacity, alignment);
 	assert(((uintptr_t)ret % 16) == 0 &&
 	    "Need 16 byte alignment for cmpxchg16b.");
 
-	if (policy != NULL && policy->premap) {
-		mapped = an_memory_map(ret, capacity, capacity);
-	} else {
-		mapped = an_memory_map(ret, MEMORY_BUMP_PAGE_SIZE, capacity);
-	}
+	mapped = bump_map(ret, capacity, hugepage, node, policy);
 
 	assert(mapped >= MEMORY_BUMP_PAGE_SIZE);
 	ret->impl.fast.allocated = (uintptr_t)ret + sizeof(*ret);
 	ret->impl.fast.capacity = mapped / MEMORY_BUMP_PAGE_SIZE;
 	ret->impl.mapped = mapped;
 	ret->impl.reserved = capacity;
+	ret->impl.hugepage = hugepage;
+	ret->impl.node = node;
 	ck_spinlock_init(&ret->grow_lock);
 
 	ck_pr_fence_store();
 	return ret;
 }
 
+static void
+bind_impl(struct an_bump_impl *impl, int node)
+{
+
+	if (node == AN_MEMORY_NODE_LOCAL) {
+		node = an_memory_local_node();
+	}
+
+	if (node < 0 || node == impl->node) {
+		return;
+	}
+
+	an_memory_bind(impl, impl->mapped, node);
+	impl->node = node;
+	return;
+}
+
+void
+an_bump_private_bind(struct an_bump_private *bump, int node)
+{
+
+	bind_impl(&bump->impl, node);
+	return;
+}
+
+void
+an_bump_shared_bind(struct an_bump_shared *bump, int node)
+{
+
+	ck_spinlock_lock(&bump->grow_lock);
+	bind_impl(&bump->impl, node);
+	ck_spinlock_unlock(&bump->grow_lock);
+	return;
+}
+
+static void
+prefault_impl(struct an_bump_impl *impl)
+{
+	uintptr_t header = (uintptr_t)impl + MEMORY_BUMP_PAGE_SIZE;
+
+	/* The header page is already in. */
+	if (impl->mapped > MEMORY_BUMP_PAGE_SIZE) {
+		an_memory_populate((void *)header,
+		    impl->mapped - MEMORY_BUMP_PAGE_SIZE);
+	}
+
+	return;
+}
+
+void
+an_bump_private_prefault(struct an_bump_private *bump)
+{
+
+	prefault_impl(&bump->impl);
+	return;
+}
+
+void
+an_bump_shared_prefault(struct an_bump_shared *bump)
+{
+
+	prefault_impl(&bump->impl);
+	return;
+}
+
 void
 an_bump_private_reset(struct an_bump_private *bump)
 {
@@ -180,12 +299,17 @@ grow(struct an_bump_impl *impl, size_t goal)
 	}
 
 	/* If shared, we're locked out. */
-	growth = an_memory_map((void *)((uintptr_t)impl + impl->mapped),
-	    goal - impl->mapped, impl->reserved - impl->mapped);
+	growth = an_memory_map_huge((void *)((uintptr_t)impl + impl->mapped),
+	    goal - impl->mapped, impl->reserved - impl->mapped, impl->hugepage);
 	if (growth < (goal - impl->mapped)) {
 		return false;
 	}
 
+	if (impl->node >= 0) {
+		an_memory_bind((void *)((uintptr_t)impl + impl->mapped),
+		    growth, impl->node);
+	}
+
 	ck_pr_store_64(&impl->mapped, impl->mapped + growth);
 	copy = an_bump_fast_read(&impl->fast);
 
@@ -7,11 +7,24 @@
 #include <string.h>
 
 #include "common/an_cc.h"
+#include "common/memory/map.h"
 
 #define MEMORY_BUMP_PAGE_SIZE 4096ULL
 
 struct an_bump_policy {
 	bool premap; /* If true, map in the whole region from the start. */
+	/*
+	 * Back the region with 2MB pages. This rounds the capacity up
+	 * to a multiple of AN_MEMORY_HUGEPAGE_SIZE, and the region is
+	 * mapped in huge page increments.
+	 */
+	enum an_memory_hugepage hugepage;
+	/*
+	 * If true, prefer NUMA node `node` (or AN_MEMORY_NODE_LOCAL, the
+	 * creator's) for the region, as it is mapped in.
+	 */
+	bool bind;
+	int node;
 };
 
 /* Private bump pointers are thread local. */
@@ -25,6 +38,29 @@ an_bump_private_create(size_t capacity, const struct an_bump_policy *);
 struct an_bump_shared *
 an_bump_shared_create(size_t capacity, const struct an_bump_policy *);
 
+/**
+ * @brief prefer NUMA node @a node for the region, including the part
+ * not mapped in yet; see an_memory_bind().
+ *
+ * Pages already faulted in elsewhere are migrated, so this is meant
+ * for regions that are being recycled, before they are shared.
+ */
+void
+an_bump_private_bind(struct an_bump_private *, int node);
+
+void
+an_bump_shared_bind(struct an_bump_shared *, int node);
+
+/**
+ * @brief fault in the whole mapped region ahead of time; only for
+ * regions nothing has been allocated from yet.
+ */
+void
+an_bump_private_prefault(struct an_bump_private *);
+
+void
+an_bump_shared_prefault(struct an_bump_shared *);
+
 /**
  * @brief reset the allocation pointer on a private bump pointer.
  */
@@ -112,6 +148,50 @@ an_bump_fast_cas(struct an_bump_fast *dst,
 	return ret;
 }
 
+/**
+ * @brief Try to grow @a ptr, the last allocation from a private bump
+ * pointer, from @a size to @a new_size bytes in place.
+ * @return false if @a ptr is not the last allocation or if there is
+ * not enough room left, true otherwise.
+ */
+static inline bool
+an_bump_private_extend(struct an_bump_private **pool_p, void *ptr,
+    size_t size, size_t new_size)
+{
+	struct an_bump_fast *fast = *(void **)pool_p;
+	uint64_t capacity;
+	uint64_t next;
+
+	if (fast == NULL || (uintptr_t)ptr + size != fast->allocated) {
+		return false;
+	}
+
+	capacity = fast->capacity * MEMORY_BUMP_PAGE_SIZE;
+	next = (uintptr_t)ptr + new_size;
+	if ((next - (uintptr_t)fast) > capacity) {
+		return false;
+	}
+
+	fast->allocated = next;
+	return true;
+}
+
+/**
+ * @brief Check whether @a ptr points inside a private bump region.
+ */
+static inline bool
+an_bump_private_contains(struct an_bump_private *const *pool_p, const void *ptr)
+{
+	const struct an_bump_fast *fast = *(void *const *)pool_p;
+
+	if (fast == NULL || (uintptr_t)ptr < (uintptr_t)fast) {
+		return false;
+	}
+
+	return ((uintptr_t)ptr - (uintptr_t)fast) <
+	    (uint64_t)fast->capacity * MEMORY_BUMP_PAGE_SIZE;
+}
+
 static inline void *
 an_bump_private_alloc(struct an_bump_private **pool_p, size_t size, size_t align)
 {
@@ -184,4 +264,25 @@ slow:
 	return an_bump_shared_alloc_slow(pool_p, size, align);
 }
 
+/**
+ * @brief bytes allocated from @a bump so far, including its header.
+ */
+static inline uint64_t
+an_bump_private_used(const struct an_bump_private *bump)
+{
+	const struct an_bump_fast *fast = (const void *)bump;
+
+	return fast->allocated - (uintptr_t)fast;
+}
+
+/* Quiesced regions look full. */
+static inline uint64_t
+an_bump_shared_used(const struct an_bump_shared *bump)
+{
+	struct an_bump_fast copy;
+
+	copy = an_bump_fast_read((const void *)bump);
+	return copy.allocated - (uintptr_t)bump;
+}
+
 #endif /* !MEMORY_BUMP_H */
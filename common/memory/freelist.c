@@ -2,6 +2,7 @@
 #include <ck_pr.h>
 #include <stdbool.h>
 
+#include "common/an_md.h"
 #include "common/memory/freelist.h"
 #include "common/rtbr/rtbr.h"
 
@@ -126,7 +127,9 @@ an_freelist_manage(struct an_freelist *freelist, struct an_freelist_entry **OUT_
 			break;
 		}
 
+		ck_pr_dec_64(&freelist->limbo);
 		if (entry != NULL) {
+			ck_pr_inc_64(&freelist->reusable);
 			ck_stack_push_mpmc(&freelist->stack, &entry->stack_entry);
 		}
 
@@ -140,6 +143,7 @@ an_freelist_manage(struct an_freelist *freelist, struct an_freelist_entry **OUT_
 	}
 
 	if (OUT_entry == NULL) {
+		ck_pr_inc_64(&freelist->reusable);
 		ck_stack_push_mpmc(&freelist->stack, &entry->stack_entry);
 		return NULL;
 	}
@@ -159,6 +163,7 @@ an_freelist_pop(struct an_freelist *freelist,
 		if (stack_entry != NULL) {
 			struct an_freelist_entry *entry;
 
+			ck_pr_dec_64(&freelist->reusable);
 			entry = freelist_entry_of_stack_entry(stack_entry);
 			*OUT_entry = entry;
 			return entry->value;
@@ -177,6 +182,7 @@ an_freelist_shelve(struct an_freelist *freelist,
 	entry->deletion_timestamp = an_rtbr_prepare().timestamp;
 
 	an_freelist_manage(freelist, NULL);
+	ck_pr_inc_64(&freelist->limbo);
 	ck_fifo_mpmc_enqueue(&freelist->fifo, &entry->fifo_entry,
 	    entry);
 	return;
@@ -188,6 +194,80 @@ an_freelist_push(struct an_freelist *freelist,
 {
 
 	entry->value = value;
+	ck_pr_inc_64(&freelist->reusable);
 	ck_stack_push_mpmc(&freelist->stack, &entry->stack_entry);
 	return;
 }
+
+size_t
+an_freelist_promote(struct an_freelist *freelist, size_t limit)
+{
+	size_t i;
+
+	if (ck_pr_load_64(&freelist->limbo) == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < limit; i++) {
+		struct an_freelist_entry *entry;
+		struct ck_fifo_mpmc_entry *garbage;
+		void *value;
+
+		if (ck_fifo_mpmc_maybe_dequeue(&freelist->fifo,
+		    &value, &garbage,
+		    an_freelist_pop_predicate, NULL) == false) {
+			break;
+		}
+
+		/* Same entry shuffle as an_freelist_manage. */
+		ck_pr_dec_64(&freelist->limbo);
+		entry = (void *)garbage;
+		entry->value = value;
+		ck_pr_inc_64(&freelist->reusable);
+		ck_stack_push_mpmc(&freelist->stack, &entry->stack_entry);
+	}
+
+	return i;
+}
+
+void
+an_freelist_stats(const struct an_freelist *freelist,
+    struct an_freelist_stats *OUT_stats)
+{
+	struct ck_fifo_mpmc_entry *head, *next;
+	uint64_t registered;
+
+	/* Entry 0 is the FIFO's initial stub. */
+	OUT_stats->capacity = freelist->n_elem - 1;
+	/* Failed an_freelist_register calls overshoot used_elem. */
+	registered = ck_pr_load_64(&freelist->used_elem) - 1;
+	if (registered > OUT_stats->capacity) {
+		registered = OUT_stats->capacity;
+	}
+
+	OUT_stats->registered = registered;
+	OUT_stats->limbo = ck_pr_load_64(&freelist->limbo);
+	OUT_stats->reusable = ck_pr_load_64(&freelist->reusable);
+	OUT_stats->oldest_limbo_us = 0;
+
+	/*
+	 * The head of the FIFO is a stub; the oldest value is right
+	 * after it.  Entries are statically allocated, so this is safe
+	 * even if they are recycled under our feet.
+	 */
+	head = ck_pr_load_ptr(&freelist->fifo.head.pointer);
+	next = ck_pr_load_ptr(&head->next.pointer);
+	if (next != NULL) {
+		const struct an_freelist_entry *entry;
+		uint64_t now, then;
+
+		entry = ck_pr_load_ptr(&next->value);
+		then = ck_pr_load_64(&entry->deletion_timestamp);
+		now = an_rtbr_prepare().timestamp;
+		if (now > then) {
+			OUT_stats->oldest_limbo_us = an_md_rdtsc_scale(now - then);
+		}
+	}
+
+	return;
+}
@@ -41,6 +41,16 @@ struct an_freelist {
 	uint64_t used_elem;
 	struct ck_fifo_mpmc fifo;
 	struct an_freelist_entry *const entries;
+	uint64_t limbo; /* Values on the FIFO. */
+	uint64_t reusable; /* Values on the stack. */
+};
+
+struct an_freelist_stats {
+	uint64_t capacity; /* Entries, i.e., values we can ever track. */
+	uint64_t registered; /* Entries handed out by an_freelist_register. */
+	uint64_t limbo;
+	uint64_t reusable;
+	uint64_t oldest_limbo_us; /* Age of the oldest value in limbo. */
 };
 
 #define AN_FREELIST(LINKAGE, NAME, N_ELEM)				\
@@ -84,4 +94,19 @@ void an_freelist_shelve(struct an_freelist *, struct an_freelist_entry *entry, v
  * @brief Mark @a value as immediately ready for re-use.
  */
 void an_freelist_push(struct an_freelist *, struct an_freelist_entry *entry, void *value);
+
+/**
+ * @brief Move up to @a limit values that RTBR cleared from the limbo FIFO
+ * to the reuse stack, so that later pops find them there.
+ * @return the number of values moved.
+ *
+ * Pops do that incrementally anyway; this is for background callers.
+ */
+size_t an_freelist_promote(struct an_freelist *, size_t limit);
+
+/**
+ * @brief Fill @a OUT_stats with a snapshot of @a freelist's state; values
+ * are racy, but each is read atomically.
+ */
+void an_freelist_stats(const struct an_freelist *, struct an_freelist_stats *OUT_stats);
 #endif /* !MEMORY_FREELIST_H */
@@ -1,4 +1,8 @@
 #include <assert.h>
+#include <numa.h>
+#include <numaif.h>
+#include <sched.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "common/memory/map.h"
@@ -8,9 +12,39 @@
 #define MADV_DODUMP 17
 #endif
 
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#define MEMORY_MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define MEMORY_MAP_MAX_NODES 1024
+
 size_t
 an_memory_map(void *address, size_t at_least, size_t at_most)
 {
+
+	return an_memory_map_huge(address, at_least, at_most,
+	    AN_MEMORY_HUGEPAGE_NONE);
+}
+
+size_t
+an_memory_map_huge(void *address, size_t at_least, size_t at_most,
+    enum an_memory_hugepage hugepage)
+{
+	size_t huge_mask = AN_MEMORY_HUGEPAGE_SIZE - 1;
 	size_t mask;
 	size_t rounded_size;
 	void *ret;
@@ -19,18 +53,44 @@ an_memory_map(void *address, size_t at_least, size_t at_most)
 		return 0;
 	}
 
+	if (hugepage != AN_MEMORY_HUGEPAGE_NONE) {
+		rounded_size = (at_least + huge_mask) & ~huge_mask;
+		if (((uintptr_t)address & huge_mask) != 0 ||
+		    rounded_size < at_least || rounded_size > at_most) {
+			hugepage = AN_MEMORY_HUGEPAGE_NONE;
+		}
+	}
+
 	mask = ck_pr_load_64(&an_memory_reserve_page_size) - 1;
+	if (hugepage != AN_MEMORY_HUGEPAGE_NONE) {
+		mask = huge_mask;
+	}
+
 	rounded_size = (at_least + mask) & ~mask;
 	if (rounded_size < at_least || rounded_size > at_most) {
 		return 0;
 	}
 
-	ret = mmap(address, rounded_size, PROT_READ | PROT_WRITE,
-	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
-	    -1, 0);
+	ret = MAP_FAILED;
+	if (hugepage == AN_MEMORY_HUGEPAGE_HUGETLB) {
+		/* Fails with ENOMEM when the hugetlb pool is exhausted. */
+		ret = mmap(address, rounded_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED |
+		    MAP_HUGETLB | MEMORY_MAP_HUGE_2MB,
+		    -1, 0);
+	}
 
 	if (ret == MAP_FAILED) {
-		return 0;
+		ret = mmap(address, rounded_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+		    -1, 0);
+		if (ret == MAP_FAILED) {
+			return 0;
+		}
+
+		if (hugepage != AN_MEMORY_HUGEPAGE_NONE) {
+			(void)madvise(ret, rounded_size, MADV_HUGEPAGE);
+		}
 	}
 
 	(void)madvise(ret, rounded_size, MADV_DODUMP);
@@ -41,3 +101,59 @@ an_memory_map(void *address, size_t at_least, size_t at_most)
 
 	return at_most;
 }
+
+void
+an_memory_bind(void *address, size_t size, int node)
+{
+	unsigned long mask[MEMORY_MAP_MAX_NODES / (8 * sizeof(unsigned long))];
+	size_t bits;
+
+	if (node == AN_MEMORY_NODE_LOCAL) {
+		node = an_memory_local_node();
+	}
+
+	if (node < 0 || node >= MEMORY_MAP_MAX_NODES) {
+		return;
+	}
+
+	bits = 8 * sizeof(mask[0]);
+	memset(mask, 0, sizeof(mask));
+	mask[node / bits] = 1UL << (node % bits);
+	(void)mbind(address, size, MPOL_PREFERRED, mask,
+	    MEMORY_MAP_MAX_NODES, MPOL_MF_MOVE);
+}
+
+void
+an_memory_populate(void *address, size_t size)
+{
+	size_t page_size;
+
+	/* Linux 5.14+; one call instead of a fault per page. */
+	if (madvise(address, size, MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+
+	page_size = ck_pr_load_64(&an_memory_reserve_page_size);
+	for (size_t i = 0; i < size; i += page_size) {
+		volatile char *byte = (volatile char *)address + i;
+
+		/* Write back what we read; the contents are unchanged. */
+		*byte = *byte;
+	}
+
+	return;
+}
+
+int
+an_memory_local_node(void)
+{
+	int cpu, node;
+
+	cpu = sched_getcpu();
+	if (cpu < 0) {
+		return 0;
+	}
+
+	node = numa_node_of_cpu(cpu);
+	return (node < 0) ? 0 : node;
+}
@@ -2,12 +2,58 @@
 #define MEMORY_MAP_H
 #include <stddef.h>
 
+#define AN_MEMORY_HUGEPAGE_SIZE (2ULL << 20)
+
+enum an_memory_hugepage {
+	AN_MEMORY_HUGEPAGE_NONE = 0,
+	/* madvise(MADV_HUGEPAGE), for khugepaged and the fault handler. */
+	AN_MEMORY_HUGEPAGE_TRANSPARENT,
+	/* MAP_HUGETLB, or transparent huge pages if none are available. */
+	AN_MEMORY_HUGEPAGE_HUGETLB
+};
+
 /**
  * @brief map at least @a at_least bytes at @a address, and at most @a at_most.
  * @return 0 if the mapping failed, number of bytes mapped on success.
  *
  * Assumes the address is already reserved via map_reserve.
- * TODO: NUMA and hugepage hints.
+ * See an_memory_bind() for NUMA.
  */
 size_t an_memory_map(void *address, size_t at_least, size_t at_most);
+
+/**
+ * @brief like an_memory_map, but back the mapping with 2MB pages as per
+ * @a hugepage.
+ *
+ * Huge pages are only used when @a address is aligned to
+ * AN_MEMORY_HUGEPAGE_SIZE, and @a at_least rounded up to a whole number
+ * of huge pages is still at most @a at_most; we map regular pages
+ * otherwise.
+ */
+size_t an_memory_map_huge(void *address, size_t at_least, size_t at_most,
+    enum an_memory_hugepage hugepage);
+
+/* For an_memory_bind(): the NUMA node of the CPU we are running on. */
+#define AN_MEMORY_NODE_LOCAL (-2)
+
+/**
+ * @brief prefer NUMA node @a node for the pages in [address, address + size),
+ * migrating the ones already faulted in elsewhere.
+ *
+ * This is only a hint: failures are ignored, as are negative nodes
+ * other than AN_MEMORY_NODE_LOCAL.
+ */
+void an_memory_bind(void *address, size_t size, int node);
+
+/**
+ * @brief fault in the pages in [address, address + size), which must be
+ * mapped, so that first writes do not take page faults. Contents are
+ * preserved, but the range must not be written to concurrently.
+ */
+void an_memory_populate(void *address, size_t size);
+
+/**
+ * @brief the NUMA node of the CPU we are running on, 0 if unknown.
+ */
+int an_memory_local_node(void);
 #endif /* !MEMORY_MAP_H */
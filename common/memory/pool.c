@@ -1,11 +1,14 @@
 #include <assert.h>
 #include <ck_pr.h>
+#include <event2/buffer.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <string.h>
 
 #include "common/an_cc.h"
 #include "common/memory/bump.h"
 #include "common/memory/freelist.h"
+#include "common/memory/map.h"
 #include "common/memory/pool.h"
 #include "common/util.h"
 
@@ -27,7 +30,10 @@ an_pool_shared_alloc_bump(struct an_pool_shared *shared,
     struct an_freelist_entry **OUT_entry)
 {
 	struct an_bump_policy policy = {
-		.premap = true
+		.premap = true,
+		.hugepage = shared->hugepage,
+		.bind = true,
+		.node = ck_pr_load_int(&shared->node)
 	};
 	struct an_bump_shared *ret;
 
@@ -41,9 +47,32 @@ an_pool_shared_alloc_bump(struct an_pool_shared *shared,
 	}
 
 	ret = an_bump_shared_create(shared->bump_size, &policy);
+	if (ret != NULL) {
+		ck_pr_inc_64(&shared->regions);
+	}
+
 	return ret;
 }
 
+/* Claims a pool's spare slot while maintenance fills it in. */
+#define POOL_SPARE_BUSY ((struct an_freelist_entry *)1)
+
+static struct an_bump_shared *
+an_pool_shared_take_spare(struct an_pool_shared *shared,
+    struct an_freelist_entry **OUT_entry)
+{
+	struct an_freelist_entry *spare;
+
+	spare = ck_pr_load_ptr(&shared->spare);
+	if (spare == NULL || spare == POOL_SPARE_BUSY ||
+	    ck_pr_cas_ptr(&shared->spare, spare, NULL) == false) {
+		return NULL;
+	}
+
+	*OUT_entry = spare;
+	return spare->value;
+}
+
 static bool
 an_pool_shared_swap(struct an_pool_shared *shared,
     struct an_bump_shared **snapshot)
@@ -52,6 +81,7 @@ an_pool_shared_swap(struct an_pool_shared *shared,
 	struct an_freelist_entry *entry;
 	struct an_bump_shared *next;
 	struct an_bump_shared *old;
+	int node;
 	bool r;
 
 	if (refresh(snapshot, &shared->bumps)) {
@@ -63,12 +93,20 @@ an_pool_shared_swap(struct an_pool_shared *shared,
 	next = an_freelist_pop(shared->freelist, &entry);
 	if (next != NULL) {
 		an_bump_shared_reset(next);
+		node = ck_pr_load_int(&shared->node);
+		if (node != -1) {
+			an_bump_shared_bind(next, node);
+		}
 	} else {
 		entry = NULL;
 
-		/* Only get an entry if we have something to recycle. */
-		next = an_pool_shared_alloc_bump(shared,
-		    (actual[1] != NULL) ? &entry : NULL);
+		/* Fresh regions come from this pool's spare first. */
+		next = an_pool_shared_take_spare(shared, &entry);
+		if (next == NULL) {
+			/* Only get an entry if we have something to recycle. */
+			next = an_pool_shared_alloc_bump(shared,
+			    (actual[1] != NULL) ? &entry : NULL);
+		}
 	}
 
 	if (next == NULL) {
@@ -83,6 +121,12 @@ an_pool_shared_swap(struct an_pool_shared *shared,
 			entry = an_freelist_register(shared->freelist);
 		}
 		if (entry != NULL) {
+			/* Save the region for this pool's next swap. */
+			entry->value = next;
+			if (ck_pr_cas_ptr(&shared->spare, NULL, entry) == true) {
+				return true;
+			}
+
 			/*
 			 * the entry will be leaked but it's better than crashing.
 			 * if we size buffers correctly this won't get hit
@@ -93,6 +137,7 @@ an_pool_shared_swap(struct an_pool_shared *shared,
 	}
 
 	memcpy(snapshot, &actual, sizeof(actual));
+	ck_pr_inc_64(&shared->swaps);
 	if (old != NULL) {
 		r = an_bump_shared_quiesce(old);
 		assert(r && "Race condition despite CMPXCHG16B?");
@@ -130,12 +175,28 @@ out:
 	return ret;
 }
 
-static void
-an_pool_private_swap(struct an_pool_private *private)
+static struct an_bump_private *
+an_pool_private_alloc_bump(struct an_pool_private *private)
 {
 	struct an_bump_policy policy = {
-		.premap = true
+		.premap = true,
+		.hugepage = private->hugepage,
+		.bind = true,
+		.node = private->node
 	};
+	struct an_bump_private *ret;
+
+	ret = an_bump_private_create(private->bump_size, &policy);
+	if (ret != NULL) {
+		ck_pr_store_64(&private->regions, private->regions + 1);
+	}
+
+	return ret;
+}
+
+static void
+an_pool_private_swap(struct an_pool_private *private)
+{
 	struct an_bump_private *bump;
 	struct an_freelist_entry *entry = NULL;
 
@@ -147,17 +208,25 @@ an_pool_private_swap(struct an_pool_private *private)
 
 	private->bump = NULL;
 	private->entry = NULL;
+	private->generation++;
 	bump = an_freelist_pop(private->freelist, &entry);
-	if (bump == NULL) {
+	if (bump == NULL && private->spare != NULL) {
+		/* Prefaulted by an_pool_private_maintain, on our node. */
+		entry = private->spare;
+		bump = entry->value;
+		private->spare = NULL;
+	} else if (bump == NULL) {
 		entry = an_freelist_register(private->freelist);
 		if (entry == NULL) {
 			return;
 		}
 
-		bump = an_bump_private_create(private->bump_size, &policy);
+		bump = an_pool_private_alloc_bump(private);
 		if (bump == NULL) {
 			return;
 		}
+	} else if (private->node != -1) {
+		an_bump_private_bind(bump, private->node);
 	}
 
 	an_bump_private_reset(bump);
@@ -189,3 +258,141 @@ an_pool_private_alloc_slow(struct an_pool_private *pool,
 
 	return ret;
 }
+
+/* Regions cleared per maintenance call; pops keep up with the rest. */
+#define POOL_MAINTAIN_PROMOTE 16
+
+void
+an_pool_shared_maintain(struct an_pool_shared *shared, bool prefault)
+{
+	struct an_freelist_entry *entry;
+	struct an_bump_shared *bump;
+
+	an_freelist_promote(shared->freelist, POOL_MAINTAIN_PROMOTE);
+
+	/*
+	 * Don't map anything in for pools that barely allocate, or that
+	 * will recycle a region anyway.
+	 */
+	if (prefault == false || ck_pr_load_64(&shared->swaps) < 2 ||
+	    ck_pr_load_64(&shared->freelist->reusable) > 0) {
+		return;
+	}
+
+	/* The spare is only ever handed to this pool's swap. */
+	if (ck_pr_load_ptr(&shared->spare) != NULL ||
+	    ck_pr_cas_ptr(&shared->spare, NULL, POOL_SPARE_BUSY) == false) {
+		return;
+	}
+
+	bump = an_pool_shared_alloc_bump(shared, &entry);
+	if (bump == NULL) {
+		ck_pr_store_ptr(&shared->spare, NULL);
+		return;
+	}
+
+	an_bump_shared_prefault(bump);
+	entry->value = bump;
+	ck_pr_fence_store();
+	ck_pr_store_ptr(&shared->spare, entry);
+	return;
+}
+
+void
+an_pool_private_maintain(struct an_pool_private *private, bool prefault)
+{
+	struct an_freelist_entry *entry;
+	struct an_bump_private *bump;
+
+	an_freelist_promote(private->freelist, POOL_MAINTAIN_PROMOTE);
+
+	if (prefault == false || private->generation < 2 ||
+	    private->spare != NULL ||
+	    ck_pr_load_64(&private->freelist->reusable) > 0) {
+		return;
+	}
+
+	entry = an_freelist_register(private->freelist);
+	if (entry == NULL) {
+		return;
+	}
+
+	bump = an_pool_private_alloc_bump(private);
+	if (bump == NULL) {
+		/* Leaks the entry, like an_pool_private_swap. */
+		return;
+	}
+
+	an_bump_private_prefault(bump);
+	entry->value = bump;
+	private->spare = entry;
+	return;
+}
+
+void
+an_pool_shared_stats(const struct an_pool_shared *pool,
+    struct an_pool_stats *OUT_stats)
+{
+	struct an_bump_shared *bumps[2];
+
+	memset(OUT_stats, 0, sizeof(*OUT_stats));
+	OUT_stats->bump_size = pool->bump_size;
+	OUT_stats->regions = ck_pr_load_64(&pool->regions);
+	OUT_stats->swaps = ck_pr_load_64(&pool->swaps);
+
+	/* Regions are never unmapped, so this is safe even if stale. */
+	ck_pr_load_ptr_2(&pool->bumps, bumps);
+	for (size_t i = 0; i < ARRAY_SIZE(bumps); i++) {
+		if (bumps[i] != NULL) {
+			OUT_stats->allocated += an_bump_shared_used(bumps[i]);
+		}
+	}
+
+	an_freelist_stats(pool->freelist, &OUT_stats->freelist);
+	return;
+}
+
+void
+an_pool_private_stats(const struct an_pool_private *pool,
+    struct an_pool_stats *OUT_stats)
+{
+	struct an_bump_private *bump;
+
+	memset(OUT_stats, 0, sizeof(*OUT_stats));
+	OUT_stats->bump_size = pool->bump_size;
+	OUT_stats->regions = ck_pr_load_64(&pool->regions);
+	OUT_stats->swaps = ck_pr_load_64(&pool->generation);
+
+	bump = ck_pr_load_ptr(&pool->bump);
+	if (bump != NULL) {
+		OUT_stats->allocated = an_bump_private_used(bump);
+	}
+
+	an_freelist_stats(pool->freelist, &OUT_stats->freelist);
+	return;
+}
+
+void
+an_pool_stats_print(struct evbuffer *buf, const char *name,
+    const struct an_pool_stats *stats)
+{
+	const struct an_freelist_stats *freelist = &stats->freelist;
+
+#define PRINT(stat, value)						\
+	evbuffer_add_printf(buf, "an_pool.%s." stat "_avg: %" PRIu64 "\n", \
+	    name, (uint64_t)(value))
+
+	PRINT("regions", stats->regions);
+	PRINT("swaps", stats->swaps);
+	PRINT("allocated_bytes", stats->allocated);
+	PRINT("reserved_bytes", stats->regions * stats->bump_size);
+	/* Once registered reaches capacity, the pool cannot grow anymore. */
+	PRINT("freelist_registered", freelist->registered);
+	PRINT("freelist_capacity", freelist->capacity);
+	PRINT("limit_bytes", freelist->capacity * stats->bump_size);
+	PRINT("limbo", freelist->limbo);
+	PRINT("reusable", freelist->reusable);
+	PRINT("oldest_limbo_us", freelist->oldest_limbo_us);
+#undef PRINT
+	return;
+}
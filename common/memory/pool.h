@@ -13,29 +13,184 @@ struct an_pool_shared {
 	struct an_bump_shared *bumps[2];
 	struct an_freelist *const freelist;
 	const uint64_t bump_size;
+	int node; /* NUMA node for new bump regions, or -1. */
+	enum an_memory_hugepage hugepage; /* For new bump regions. */
+	uint64_t regions; /* Bump regions created. */
+	uint64_t swaps; /* Moves to a new current region. */
+	struct an_freelist_entry *spare; /* Prefaulted region, or NULL. */
 } CK_CC_ALIGN(16);
 
+/* Private pools also accept AN_MEMORY_NODE_LOCAL, the owner's node. */
 struct an_pool_private {
 	struct an_bump_private *bump;
 	struct an_freelist_entry *entry;
 	struct an_freelist *const freelist;
 	const uint64_t bump_size;
+	uint64_t generation; /* Incremented whenever bump is swapped out. */
+	int node; /* NUMA node for new bump regions, or -1. */
+	enum an_memory_hugepage hugepage; /* For new bump regions. */
+	uint64_t regions; /* Bump regions created. */
+	struct an_freelist_entry *spare; /* Prefaulted region, or NULL. */
 } CK_CC_ALIGN(16);
 
+struct an_pool_stats {
+	uint64_t bump_size;
+	uint64_t regions;
+	uint64_t swaps;
+	uint64_t allocated; /* Bytes allocated from the current region(s). */
+	/* Shared by all the pools of an AN_POOL_SHARED_ARRAY/NUMA. */
+	struct an_freelist_stats freelist;
+};
+
 #define AN_POOL_SHARED(LINKAGE, NAME, BUMP_SIZE, ALLOCATION_LIMIT) \
 	AN_FREELIST(static, NAME##_freelist, 2 + (ALLOCATION_LIMIT / BUMP_SIZE)); \
 	LINKAGE struct an_pool_shared NAME = {			\
 		.freelist = &NAME##_freelist,			\
-		.bump_size = (BUMP_SIZE)			\
+		.bump_size = (BUMP_SIZE),			\
+		.node = -1					\
+	};
+
+/*
+ * N shared pools recycling bump regions through the same freelist,
+ * typically one per NUMA node; see an_pool_shared_set_node().
+ */
+#define AN_POOL_SHARED_ARRAY(LINKAGE, NAME, N, BUMP_SIZE, ALLOCATION_LIMIT) \
+	AN_FREELIST(static, NAME##_freelist, 2 * (N) + (ALLOCATION_LIMIT / BUMP_SIZE)); \
+	LINKAGE struct an_pool_shared NAME[N] = {		\
+		[0 ... (N) - 1] = {				\
+			.freelist = &NAME##_freelist,		\
+			.bump_size = (BUMP_SIZE),		\
+			.node = -1				\
+		}						\
+	};
+
+/* NUMA nodes covered by AN_POOL_SHARED_NUMA; others wrap around. */
+#define AN_POOL_NUMA_NODES 8
+
+#define AN_POOL_SHARED_NUMA_ENTRY(NAME, BUMP_SIZE, NODE)		\
+	[NODE] = {							\
+		.freelist = &NAME##_freelist,				\
+		.bump_size = (BUMP_SIZE),				\
+		.node = (NODE)						\
+	}
+
+/*
+ * One shared pool per NUMA node, each backed by memory from its node.
+ * Allocate from an_pool_shared_local(NAME) to use the caller's node.
+ */
+#define AN_POOL_SHARED_NUMA(LINKAGE, NAME, BUMP_SIZE, ALLOCATION_LIMIT) \
+	AN_FREELIST(static, NAME##_freelist,				\
+	    2 * AN_POOL_NUMA_NODES + (ALLOCATION_LIMIT / BUMP_SIZE));	\
+	LINKAGE struct an_pool_shared NAME[AN_POOL_NUMA_NODES] = {	\
+		AN_POOL_SHARED_NUMA_ENTRY(NAME, BUMP_SIZE, 0),		\
+		AN_POOL_SHARED_NUMA_ENTRY(NAME, BUMP_SIZE, 1),		\
+		AN_POOL_SHARED_NUMA_ENTRY(NAME, BUMP_SIZE, 2),		\
+		AN_POOL_SHARED_NUMA_ENTRY(NAME, BUMP_SIZE, 3),		\
+		AN_POOL_SHARED_NUMA_ENTRY(NAME, BUMP_SIZE, 4),		\
+		AN_POOL_SHARED_NUMA_ENTRY(NAME, BUMP_SIZE, 5),		\
+		AN_POOL_SHARED_NUMA_ENTRY(NAME, BUMP_SIZE, 6),		\
+		AN_POOL_SHARED_NUMA_ENTRY(NAME, BUMP_SIZE, 7)		\
 	};
 
+_Static_assert(AN_POOL_NUMA_NODES == 8,
+    "AN_POOL_SHARED_NUMA must list AN_POOL_NUMA_NODES entries");
+
+static inline struct an_pool_shared *
+an_pool_shared_local(struct an_pool_shared pools[AN_POOL_NUMA_NODES])
+{
+
+	return &pools[an_memory_local_node() % AN_POOL_NUMA_NODES];
+}
+
 #define AN_POOL_PRIVATE(LINKAGE, NAME, BUMP_SIZE, ALLOCATION_LIMIT)	\
 	AN_FREELIST(static, NAME##_freelist, 2 + (ALLOCATION_LIMIT / BUMP_SIZE)); \
 	LINKAGE __thread struct an_pool_private NAME = {		\
 		.freelist = &NAME##_freelist,				\
-		.bump_size = (BUMP_SIZE)				\
+		.bump_size = (BUMP_SIZE),				\
+		.node = -1						\
+	};
+
+/*
+ * A private pool whose regions are bound to the NUMA node its owner
+ * runs on whenever it moves to a new region.
+ */
+#define AN_POOL_PRIVATE_LOCAL(LINKAGE, NAME, BUMP_SIZE, ALLOCATION_LIMIT) \
+	AN_FREELIST(static, NAME##_freelist, 2 + (ALLOCATION_LIMIT / BUMP_SIZE)); \
+	LINKAGE __thread struct an_pool_private NAME = {		\
+		.freelist = &NAME##_freelist,				\
+		.bump_size = (BUMP_SIZE),				\
+		.node = AN_MEMORY_NODE_LOCAL				\
 	};
 
+/*
+ * Back a pool with memory from NUMA node @a node (any node if -1),
+ * starting with its next bump region. Regions recycled from another node
+ * have their pages migrated, see an_memory_bind().
+ */
+static inline void
+an_pool_shared_set_node(struct an_pool_shared *pool, int node)
+{
+
+	ck_pr_store_int(&pool->node, node);
+}
+
+static inline void
+an_pool_private_set_node(struct an_pool_private *pool, int node)
+{
+
+	pool->node = node;
+}
+
+/*
+ * Back new bump regions with 2MB pages, see an_memory_map_huge().
+ * Regions are rounded up to whole huge pages, so this works best when
+ * the bump size is a multiple of AN_MEMORY_HUGEPAGE_SIZE. Call before
+ * the pool is shared with other threads.
+ */
+static inline void
+an_pool_shared_set_hugepage(struct an_pool_shared *pool,
+    enum an_memory_hugepage hugepage)
+{
+
+	pool->hugepage = hugepage;
+}
+
+static inline void
+an_pool_private_set_hugepage(struct an_pool_private *pool,
+    enum an_memory_hugepage hugepage)
+{
+
+	pool->hugepage = hugepage;
+}
+
+/*
+ * Background maintenance, for idle time: promote freelist values RTBR
+ * is done with, and, if @a prefault and the pool has already gone
+ * through a region, create and fault in a spare region when none is
+ * reusable. This moves that work off the allocation slow path. The
+ * spare belongs to the pool, on its node, and is not shared with the
+ * other pools of the same freelist. Private pools must be maintained
+ * by their owner.
+ */
+void an_pool_shared_maintain(struct an_pool_shared *, bool prefault);
+void an_pool_private_maintain(struct an_pool_private *, bool prefault);
+
+/*
+ * Statistics are racy snapshots. Private pools are thread-local, so
+ * other threads must get at them through a pointer from their owner.
+ */
+void an_pool_shared_stats(const struct an_pool_shared *, struct an_pool_stats *);
+void an_pool_private_stats(const struct an_pool_private *, struct an_pool_stats *);
+
+struct evbuffer;
+
+/*
+ * Print pool statistics as an_pool.<name>.<stat>_avg metrics, like
+ * an_malloc_token_metrics_print().
+ */
+void an_pool_stats_print(struct evbuffer *, const char *name,
+    const struct an_pool_stats *);
+
 #define an_pool_alloc(POOL, SIZE, ZERO, ALIGN)				\
 	(__builtin_choose_expr(						\
 	    __builtin_types_compatible_p(__typeof__(POOL), struct an_pool_private *), \
@@ -88,4 +243,30 @@ an_pool_private_alloc(struct an_pool_private *pool, size_t size, bool zero, size
 
 	return an_pool_private_alloc_slow(pool, size, zero, align);
 }
+
+/*
+ * Grow the last allocation from a private pool in place, see
+ * an_bump_private_extend(). Callers fall back to a fresh allocation
+ * and a copy when this fails.
+ */
+static inline bool
+an_pool_private_extend(struct an_pool_private *pool, void *ptr, size_t size,
+    size_t new_size)
+{
+
+	return an_bump_private_extend(&pool->bump, ptr, size, new_size);
+}
+
+/*
+ * Whether @a ptr points into the current bump region of a private
+ * pool. For memory that is still in use (and thus keeps its region
+ * from being recycled), this means it was allocated during the
+ * current generation.
+ */
+static inline bool
+an_pool_private_current(const struct an_pool_private *pool, const void *ptr)
+{
+
+	return an_bump_private_contains(&pool->bump, ptr);
+}
 #endif /* !MEMORY_POOL_H */
@@ -0,0 +1,196 @@
+#include <assert.h>
+#include <ck_pr.h>
+#include <ck_spinlock.h>
+#include <ck_stack.h>
+#include <string.h>
+
+#include "common/an_cc.h"
+#include "common/memory/bump.h"
+#include "common/memory/slab.h"
+#include "common/rtbr/rtbr.h"
+
+CK_STACK_CONTAINER(struct an_slab_magazine, next,
+    slab_magazine_of_stack_entry);
+
+static struct an_bump_shared *
+slab_bump(struct an_slab *slab)
+{
+	struct an_bump_shared *bump;
+
+	bump = ck_pr_load_ptr(&slab->bump);
+	if (AN_CC_LIKELY(bump != NULL)) {
+		return bump;
+	}
+
+	ck_spinlock_lock(&slab->lock);
+	bump = slab->bump;
+	if (bump == NULL) {
+		/* Mapped in as we go: the limit is only reserved. */
+		bump = an_bump_shared_create(slab->limit, NULL);
+		ck_pr_fence_store();
+		ck_pr_store_ptr(&slab->bump, bump);
+	}
+
+	ck_spinlock_unlock(&slab->lock);
+	return bump;
+}
+
+static struct an_slab_magazine *
+slab_magazine_get(struct an_slab *slab)
+{
+	struct an_slab_magazine *magazine;
+	struct an_bump_shared *bump;
+	struct ck_stack_entry *entry;
+
+	entry = ck_stack_pop_mpmc(&slab->empty);
+	if (entry != NULL) {
+		magazine = slab_magazine_of_stack_entry(entry);
+		assert(magazine->count == 0);
+		return magazine;
+	}
+
+	bump = slab_bump(slab);
+	magazine = an_bump_alloc(bump, sizeof(*magazine), 16);
+	if (magazine == NULL) {
+		return NULL;
+	}
+
+	memset(magazine, 0, sizeof(*magazine));
+	magazine->slab = slab;
+	return magazine;
+}
+
+/*
+ * Fill @a magazine with fresh objects, a single bump allocation for
+ * the whole batch if we can.
+ */
+static bool
+slab_carve(struct an_slab *slab, struct an_slab_magazine *magazine)
+{
+	struct an_bump_shared *bump;
+	unsigned int n = AN_SLAB_MAGAZINE;
+	uint8_t *objects;
+
+	bump = slab_bump(slab);
+	objects = an_bump_alloc(bump, n * slab->size, 16);
+	if (objects == NULL) {
+		n = 1;
+		objects = an_bump_alloc(bump, slab->size, 16);
+		if (objects == NULL) {
+			return false;
+		}
+	}
+
+	for (unsigned int i = 0; i < n; i++) {
+		magazine->objects[i] = objects + (n - 1 - i) * slab->size;
+	}
+
+	magazine->count = n;
+	return true;
+}
+
+static void
+slab_magazine_ready(void *arg)
+{
+	struct an_slab_magazine *magazine = arg;
+
+	ck_stack_push_mpmc(&magazine->slab->full, &magazine->next);
+	return;
+}
+
+void *
+an_slab_alloc_slow(struct an_slab *slab, struct an_slab_cache *cache)
+{
+	struct an_slab_magazine *magazine = cache->alloc;
+	struct ck_stack_entry *entry;
+
+	entry = ck_stack_pop_mpmc(&slab->full);
+	if (entry != NULL) {
+		if (magazine != NULL) {
+			ck_stack_push_mpmc(&slab->empty, &magazine->next);
+		}
+
+		magazine = slab_magazine_of_stack_entry(entry);
+		cache->alloc = magazine;
+		assert(magazine->count > 0);
+		return magazine->objects[--magazine->count];
+	}
+
+	/* Nothing to reuse; carve fresh objects. */
+	if (magazine == NULL) {
+		magazine = slab_magazine_get(slab);
+		if (magazine == NULL) {
+			return NULL;
+		}
+
+		cache->alloc = magazine;
+	}
+
+	if (slab_carve(slab, magazine) == false) {
+		return NULL;
+	}
+
+	return magazine->objects[--magazine->count];
+}
+
+void
+an_slab_free_slow(struct an_slab *slab, struct an_slab_cache *cache,
+    void *ptr)
+{
+	struct an_slab_magazine *magazine;
+
+	magazine = slab_magazine_get(slab);
+	if (magazine == NULL && cache->alloc != NULL &&
+	    cache->alloc->count == 0) {
+		/* Out of memory for magazines; use our empty one. */
+		magazine = cache->alloc;
+		cache->alloc = NULL;
+	}
+
+	if (AN_CC_UNLIKELY(magazine == NULL)) {
+		/* Leak the object rather than reuse it too early. */
+		return;
+	}
+
+	cache->free = magazine;
+	magazine->objects[magazine->count++] = ptr;
+	return;
+}
+
+void
+an_slab_retire(struct an_slab *slab, struct an_slab_cache *cache)
+{
+	struct an_slab_magazine *magazine = cache->free;
+
+	(void)slab;
+	if (magazine == NULL || magazine->count == 0) {
+		return;
+	}
+
+	cache->free = NULL;
+	an_rtbr_call(&magazine->rtbr, slab_magazine_ready, magazine);
+	return;
+}
+
+void
+an_slab_flush(struct an_slab *slab)
+{
+	struct an_slab_cache *cache = slab->cache();
+	struct an_slab_magazine *magazine;
+
+	an_slab_retire(slab, cache);
+
+	magazine = cache->alloc;
+	cache->alloc = NULL;
+	if (magazine == NULL) {
+		return;
+	}
+
+	if (magazine->count > 0) {
+		ck_stack_push_mpmc(&slab->full, &magazine->next);
+	} else {
+		ck_stack_push_mpmc(&slab->empty, &magazine->next);
+	}
+
+	return;
+}
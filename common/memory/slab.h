@@ -0,0 +1,153 @@
+#ifndef MEMORY_SLAB_H
+#define MEMORY_SLAB_H
+/*
+ * Fixed-size object allocator, for long-lived objects that are freed
+ * one at a time (unlike pools, which recycle whole regions).
+ *
+ * Objects are carved, a magazine at a time, from a lazily mapped
+ * shared bump region of at most `limit` bytes, and never returned to
+ * the OS.  Each thread caches two magazines per slab: one to allocate
+ * from, and one that collects the objects it frees.  Once full, the
+ * latter is handed to RTBR (an_rtbr_call), and only becomes available
+ * for reuse, on the slab's global stack of full magazines, when every
+ * read-side section that could still see its objects has ended.
+ * Threads that free objects must thus call an_rtbr_poll() regularly.
+ *
+ * Allocation and free only touch the thread cache in the common case;
+ * the slow paths are lock-free, except for creating the bump region.
+ */
+
+#include <ck_cc.h>
+#include <ck_spinlock.h>
+#include <ck_stack.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common/an_cc.h"
+#include "common/memory/bump.h"
+#include "common/rtbr/rtbr.h"
+
+/* Number of objects per magazine. */
+#define AN_SLAB_MAGAZINE 30
+
+/* Objects are 16 byte aligned. */
+#define AN_SLAB_OBJECT_SIZE(SIZE) ((((SIZE) > 0 ? (SIZE) : 1) + 15ULL) & ~15ULL)
+
+struct an_slab;
+
+struct an_slab_magazine {
+	struct an_rtbr_entry rtbr;
+	struct ck_stack_entry next;
+	struct an_slab *slab;
+	unsigned int count;
+	void *objects[AN_SLAB_MAGAZINE];
+};
+
+struct an_slab_cache {
+	struct an_slab_magazine *alloc; /* Objects ready for reuse. */
+	struct an_slab_magazine *free; /* Freed objects, not safe yet. */
+};
+
+struct an_slab {
+	struct ck_stack full CK_CC_ALIGN(16); /* Reusable magazines. */
+	struct ck_stack empty CK_CC_ALIGN(16);
+	struct an_bump_shared *bump;
+	ck_spinlock_t lock; /* Only serialises the creation of bump. */
+	const char *const name;
+	const uint64_t size;
+	const uint64_t limit;
+	struct an_slab_cache *(*const cache)(void);
+};
+
+#define AN_SLAB(LINKAGE, NAME, SIZE, LIMIT)				\
+	static __thread struct an_slab_cache NAME##_slab_cache;		\
+	static struct an_slab_cache *					\
+	NAME##_slab_cache_get(void)					\
+	{								\
+									\
+		return &NAME##_slab_cache;				\
+	}								\
+	LINKAGE struct an_slab NAME = {					\
+		.full = CK_STACK_INITIALIZER,				\
+		.empty = CK_STACK_INITIALIZER,				\
+		.lock = CK_SPINLOCK_INITIALIZER,			\
+		.name = #NAME,						\
+		.size = AN_SLAB_OBJECT_SIZE(SIZE),			\
+		.limit = (LIMIT),					\
+		.cache = NAME##_slab_cache_get				\
+	}
+
+void *an_slab_alloc_slow(struct an_slab *, struct an_slab_cache *);
+void an_slab_free_slow(struct an_slab *, struct an_slab_cache *, void *);
+
+/**
+ * @brief hand the current magazine of freed objects over to RTBR.
+ */
+void an_slab_retire(struct an_slab *, struct an_slab_cache *);
+
+/**
+ * @brief give the calling thread's cached objects back to the slab,
+ * e.g., before the thread exits.
+ */
+void an_slab_flush(struct an_slab *);
+
+/**
+ * @return an uninitialised object, or NULL if the slab is exhausted.
+ */
+static inline void *
+an_slab_alloc(struct an_slab *slab)
+{
+	struct an_slab_cache *cache = slab->cache();
+	struct an_slab_magazine *magazine = cache->alloc;
+
+	if (AN_CC_LIKELY(magazine != NULL && magazine->count > 0)) {
+		return magazine->objects[--magazine->count];
+	}
+
+	return an_slab_alloc_slow(slab, cache);
+}
+
+static inline void *
+an_slab_calloc(struct an_slab *slab)
+{
+	void *ret;
+
+	ret = an_slab_alloc(slab);
+	if (AN_CC_LIKELY(ret != NULL)) {
+		memset(ret, 0, slab->size);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief free @a ptr, which will not be reused before all current
+ * read-side sections have ended.
+ */
+static inline void
+an_slab_free(struct an_slab *slab, void *ptr)
+{
+	struct an_slab_cache *cache;
+	struct an_slab_magazine *magazine;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	cache = slab->cache();
+	magazine = cache->free;
+	if (AN_CC_UNLIKELY(magazine == NULL)) {
+		an_slab_free_slow(slab, cache, ptr);
+		return;
+	}
+
+	magazine->objects[magazine->count++] = ptr;
+	if (AN_CC_UNLIKELY(magazine->count == AN_SLAB_MAGAZINE)) {
+		an_slab_retire(slab, cache);
+	}
+
+	return;
+}
+#endif /* !MEMORY_SLAB_H */